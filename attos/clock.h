@@ -0,0 +1,48 @@
+#ifndef ATTOS_CLOCK_H
+#define ATTOS_CLOCK_H
+
+#include <stdint.h>
+
+namespace attos {
+
+constexpr uint64_t ns_per_us = 1000;
+constexpr uint64_t ns_per_ms = 1000 * ns_per_us;
+constexpr uint64_t ns_per_s  = 1000 * ns_per_ms;
+
+// Nanoseconds since an arbitrary point in time (e.g. boot), never goes backwards
+uint64_t monotonic_ns();
+
+// A point in time on the monotonic clock for code that polls (e.g. retransmission timeouts)
+class deadline {
+public:
+    constexpr explicit deadline() : ns_(0) {
+    }
+
+    void arm_after_ms(uint64_t ms) {
+        ns_ = monotonic_ns() + ms * ns_per_ms;
+    }
+
+    void disarm() {
+        ns_ = 0;
+    }
+
+    bool armed() const {
+        return ns_ != 0;
+    }
+
+    // Returns true (and disarms) if the deadline is armed and has passed
+    bool expired() {
+        if (!ns_ || monotonic_ns() < ns_) {
+            return false;
+        }
+        ns_ = 0;
+        return true;
+    }
+
+private:
+    uint64_t ns_;
+};
+
+} // namespace attos
+
+#endif
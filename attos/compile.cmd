@@ -1,7 +1,7 @@
 @pushd %~dp0
 @setlocal
 @call ..\setflags.cmd
-@set cpp=rt.cpp mem.cpp pe.cpp out_stream.cpp
+@set cpp=rt.cpp mem.cpp magazine.cpp pe.cpp out_stream.cpp log.cpp
 @set extracpp=net\net.cpp net\tftp.cpp
 @set hostcpp=host_stubs.cpp
 @set usercpp=crtstartup.cpp
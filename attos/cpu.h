@@ -58,7 +58,7 @@ constexpr auto rflag_mask_ac   = 1U << rflag_bit_ac;
 
 enum class interrupt_number : uint8_t;
 
-// Must match the structure in isr_common.asm
+// Must match the structure in kernel.inc
 struct registers {
     uint64_t rax;
     uint64_t rbx;
@@ -75,8 +75,9 @@ struct registers {
     uint64_t r13;
     uint64_t r14;
     uint64_t r15;
-    uint64_t reserved0;
-    alignas(16) uint8_t  fx_state[512];
+    uint32_t mxcsr;
+    uint32_t reserved0;
+    alignas(16) uint64_t xmm[6][2]; // xmm0-xmm5, the rest of the x87/SSE state is switched lazily by the kernel
     uint64_t reserved1;
     interrupt_number interrupt_no;
     uint8_t  reserved2[7];
@@ -119,6 +120,14 @@ constexpr uint32_t efer_mask_lmsle = 1U<<13; // Long Mode Segment Limit Enabled
 constexpr uint32_t efer_mask_ffxsr = 1U<<14; // Fast fxsave/fxrstor
 constexpr uint32_t efer_mask_tce   = 1U<<15; // Translation Cache Extension
 
+//
+// Control registers
+//
+
+constexpr uint32_t cr0_mask_mp = 1U<<1; // Monitor co-Processor (WAIT/FWAIT honor TS)
+constexpr uint32_t cr0_mask_em = 1U<<2; // x87 EMulation
+constexpr uint32_t cr0_mask_ts = 1U<<3; // Task Switched (x87/SSE instructions raise #NM)
+
 #pragma warning(push)
 #pragma warning(disable: 4127) // conditional expression is constant
 template<bool Enable>
@@ -147,6 +156,44 @@ private:
 using interrupt_disabler = interrupt_toggler<false>;
 using interrupt_enabler  = interrupt_toggler<true>;
 
+class spinlock {
+public:
+    spinlock() : locked_(0) {
+    }
+    spinlock(const spinlock&) = delete;
+    spinlock& operator=(const spinlock&) = delete;
+
+    void lock() {
+        while (_InterlockedExchange(&locked_, 1)) {
+            while (locked_) {
+                _mm_pause();
+            }
+        }
+    }
+
+    void unlock() {
+        _ReadWriteBarrier(); // Stores aren't reordered with older stores on x86, only the compiler needs to be kept in check
+        locked_ = 0;
+    }
+
+private:
+    volatile long locked_;
+};
+
+class spinlock_guard {
+public:
+    explicit spinlock_guard(spinlock& lock) : lock_(lock) {
+        lock_.lock();
+    }
+    ~spinlock_guard() {
+        lock_.unlock();
+    }
+    spinlock_guard(const spinlock_guard&) = delete;
+    spinlock_guard& operator=(const spinlock_guard&) = delete;
+private:
+    spinlock& lock_;
+};
+
 enum class descriptor_privilege_level : uint8_t {
     kernel = 0,
     user   = 3
@@ -1,6 +1,7 @@
 #include <attos/out_stream.h>
 #include <attos/sysuser.h>
 #include <attos/cpu.h>
+#include <attos/clock.h>
 
 using namespace attos;
 
@@ -26,6 +27,11 @@ void yield()
     syscall0(syscall_number::yield);
 }
 
+uint64_t monotonic_ns()
+{
+    return syscall0(syscall_number::monotonic_ns);
+}
+
 void exit(uint64_t ret)
 {
     syscall1(syscall_number::exit, ret);
@@ -3,7 +3,9 @@
 #include <attos/net/net.h>
 #include <attos/net/tftp.h>
 #include <attos/cpu.h>
+#include <attos/clock.h>
 #include <stdlib.h>
+#include <chrono>
 
 namespace attos {
 void* kalloc(uint64_t size) {
@@ -19,6 +21,10 @@ void yield() {
     abort();
 }
 
+uint64_t monotonic_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
 void fatal_error(const char* file, int line, const char* detail) {
     dbgout() << file << ':' << line << ": " << detail << ".\nQuitting\n";
     abort();
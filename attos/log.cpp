@@ -0,0 +1,67 @@
+#include "log.h"
+
+namespace attos {
+
+namespace detail {
+
+log_level log_levels[static_cast<uint32_t>(log_category::count)] = {
+    log_default_level, log_default_level, log_default_level, log_default_level,
+    log_default_level, log_default_level, log_default_level, log_default_level,
+};
+static_assert(static_cast<uint32_t>(log_category::count) == 8, "Update log_levels");
+
+bool          trace_on = true;
+volatile long trace_next;
+trace_event   trace_buffer[trace_entries];
+
+} // namespace detail
+
+log_level log_set_level(log_category category, log_level level) {
+    auto& l = detail::log_levels[static_cast<uint32_t>(category)];
+    const auto old = l;
+    l = level;
+    return old;
+}
+
+void log_set_level_all(log_level level) {
+    for (auto& l : detail::log_levels) {
+        l = level;
+    }
+}
+
+const char* log_category_name(log_category category) {
+    switch (category) {
+    case log_category::eth:    return "eth";
+    case log_category::arp:    return "arp";
+    case log_category::ipv4:   return "ipv4";
+    case log_category::icmp:   return "icmp";
+    case log_category::udp:    return "udp";
+    case log_category::dhcp:   return "dhcp";
+    case log_category::tftp:   return "tftp";
+    case log_category::ethdev: return "ethdev";
+    case log_category::count:  break;
+    }
+    return "?";
+}
+
+void trace_enable(bool enable) {
+    detail::trace_on = enable;
+}
+
+void trace_dump(out_stream& os) {
+    const auto next  = static_cast<uint32_t>(detail::trace_next);
+    const auto count = next < trace_entries ? next : trace_entries;
+    uint64_t first_tsc = 0;
+    for (uint32_t i = next - count; i != next; ++i) {
+        const auto& e = detail::trace_buffer[i & (trace_entries - 1)];
+        if (!e.what) {
+            continue;
+        }
+        if (!first_tsc) {
+            first_tsc = e.tsc;
+        }
+        os << "+" << (e.tsc - first_tsc) << " [" << log_category_name(e.category) << "] " << e.what << " " << e.a << " " << e.b << "\n";
+    }
+}
+
+} // namespace attos
@@ -0,0 +1,93 @@
+#ifndef ATTOS_LOG_H
+#define ATTOS_LOG_H
+
+#include <stdint.h>
+#include <intrin.h>
+#include <attos/out_stream.h>
+
+// Messages above this level are compiled out (0 = error, 1 = info, 2 = debug)
+#ifndef ATTOS_LOG_MAX_LEVEL
+#define ATTOS_LOG_MAX_LEVEL 2
+#endif
+
+namespace attos {
+
+enum class log_category : uint8_t {
+    eth,
+    arp,
+    ipv4,
+    icmp,
+    udp,
+    dhcp,
+    tftp,
+    ethdev, // Network drivers
+
+    count // Must be last
+};
+
+enum class log_level : uint8_t {
+    error,
+    info,  // Events that happen once in a while (e.g. configuration changes)
+    debug, // Per-packet events
+};
+
+constexpr log_level log_default_level = log_level::info;
+
+namespace detail {
+extern log_level log_levels[static_cast<uint32_t>(log_category::count)];
+} // namespace detail
+
+template<log_level level>
+bool log_enabled(log_category category) {
+    return static_cast<uint32_t>(level) <= ATTOS_LOG_MAX_LEVEL && level <= detail::log_levels[static_cast<uint32_t>(category)];
+}
+
+// Returns the previous level
+log_level log_set_level(log_category category, log_level level);
+void log_set_level_all(log_level level);
+
+const char* log_category_name(log_category category);
+
+// LOG(udp, debug) << "..." writes to dbgout() if the level is enabled for the category. The arguments aren't
+// evaluated otherwise.
+#define LOG(category, level) \
+    if (!::attos::log_enabled<::attos::log_level::level>(::attos::log_category::category)) {} else ::attos::dbgout() << "[" #category "] "
+
+// Binary trace of recent events. Recording one is a few stores, so it can be used on paths where printing would
+// be too slow. `what' must be a string literal (only the pointer is stored).
+struct trace_event {
+    uint64_t     tsc;
+    const char*  what;
+    uint64_t     a;
+    uint32_t     b;
+    log_category category;
+};
+
+constexpr uint32_t trace_entries = 512; // Must be a power of 2
+
+namespace detail {
+extern bool         trace_on;
+extern volatile long trace_next;
+extern trace_event  trace_buffer[trace_entries];
+} // namespace detail
+
+inline void trace(log_category category, const char* what, uint64_t a = 0, uint32_t b = 0) {
+    if (!detail::trace_on) {
+        return;
+    }
+    auto& e = detail::trace_buffer[static_cast<uint32_t>(_InterlockedIncrement(&detail::trace_next) - 1) & (trace_entries - 1)];
+    e.tsc      = __rdtsc();
+    e.what     = what;
+    e.a        = a;
+    e.b        = b;
+    e.category = category;
+}
+
+void trace_enable(bool enable);
+
+// Prints the recorded events (oldest first) with their TSC relative to the first one
+void trace_dump(out_stream& os);
+
+} // namespace attos
+
+#endif
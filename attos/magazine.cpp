@@ -0,0 +1,139 @@
+#include "magazine.h"
+
+namespace attos {
+
+magazine_cache::magazine_cache(default_heap& heap, uint32_t cpu_count) : heap_(heap), cpu_count_(cpu_count) {
+    REQUIRE(cpu_count >= 1 && cpu_count <= max_cpus);
+    for (auto& c : cpus_) {
+        for (uint32_t i = 0; i < num_classes; ++i) {
+            c.loaded[i]   = nullptr;
+            c.previous[i] = nullptr;
+        }
+    }
+    for (auto& d : depots_) {
+        d.full       = nullptr;
+        d.empty      = nullptr;
+        d.full_count = 0;
+    }
+}
+
+magazine_cache::~magazine_cache() {
+    for (auto& c : cpus_) {
+        for (uint32_t i = 0; i < num_classes; ++i) {
+            if (c.loaded[i])   destroy_magazine(c.loaded[i]);
+            if (c.previous[i]) destroy_magazine(c.previous[i]);
+        }
+    }
+    for (auto& d : depots_) {
+        while (d.full)  destroy_magazine(pop(d.full));
+        while (d.empty) destroy_magazine(pop(d.empty));
+    }
+}
+
+void* magazine_cache::alloc(uint32_t cpu, uint64_t size) {
+    REQUIRE(cpu < cpu_count_);
+    const auto block_size = default_heap::block_size_for(size);
+    if (block_size > max_block_size) {
+        spinlock_guard lock{lock_};
+        return heap_.alloc(size);
+    }
+    const auto index = size_class_heap::class_index(block_size);
+    auto& c = cpus_[cpu];
+    auto& loaded = c.loaded[index];
+    if (loaded && loaded->rounds) {
+        return loaded->blocks[--loaded->rounds];
+    }
+    auto& previous = c.previous[index];
+    if (previous && previous->rounds) {
+        std::swap(loaded, previous);
+        return loaded->blocks[--loaded->rounds];
+    }
+    return alloc_from_depot(c, index, size);
+}
+
+void magazine_cache::free(uint32_t cpu, void* ptr) {
+    REQUIRE(cpu < cpu_count_);
+    const auto block_size = default_heap::block_size(ptr);
+    if (block_size > max_block_size) {
+        spinlock_guard lock{lock_};
+        heap_.free(ptr);
+        return;
+    }
+    const auto index = size_class_heap::class_index(block_size);
+    auto& c = cpus_[cpu];
+    auto& loaded = c.loaded[index];
+    if (loaded && loaded->rounds < magazine_size) {
+        loaded->blocks[loaded->rounds++] = ptr;
+        return;
+    }
+    auto& previous = c.previous[index];
+    if (previous && previous->rounds < magazine_size) {
+        std::swap(loaded, previous);
+        loaded->blocks[loaded->rounds++] = ptr;
+        return;
+    }
+    free_to_depot(c, index, ptr);
+}
+
+magazine_cache::magazine* magazine_cache::pop(magazine*& list) {
+    auto m = list;
+    if (m) {
+        list = m->next;
+    }
+    return m;
+}
+
+void magazine_cache::push(magazine*& list, magazine* m) {
+    m->next = list;
+    list = m;
+}
+
+void* magazine_cache::alloc_from_depot(cpu_cache& c, uint32_t index, uint64_t size) {
+    auto& loaded   = c.loaded[index];
+    auto& previous = c.previous[index];
+    auto& d = depots_[index];
+    spinlock_guard lock{lock_};
+    if (auto full = pop(d.full)) {
+        // Hand in the empty previous magazine for a full one
+        --d.full_count;
+        if (previous) {
+            push(d.empty, previous);
+        }
+        previous = loaded;
+        loaded   = full;
+        return loaded->blocks[--loaded->rounds];
+    }
+    return heap_.alloc(size);
+}
+
+void magazine_cache::free_to_depot(cpu_cache& c, uint32_t index, void* ptr) {
+    auto& loaded   = c.loaded[index];
+    auto& previous = c.previous[index];
+    auto& d = depots_[index];
+    spinlock_guard lock{lock_};
+    if (previous) {
+        // Both magazines are full, hand in the previous one
+        if (d.full_count < max_depot_full) {
+            push(d.full, previous);
+            ++d.full_count;
+        } else {
+            destroy_magazine(previous);
+        }
+    }
+    previous = loaded;
+    loaded   = pop(d.empty);
+    if (!loaded) {
+        loaded = static_cast<magazine*>(heap_.alloc(sizeof(magazine)));
+    }
+    loaded->rounds = 0;
+    loaded->blocks[loaded->rounds++] = ptr;
+}
+
+void magazine_cache::destroy_magazine(magazine* m) {
+    while (m->rounds) {
+        heap_.free(m->blocks[--m->rounds]);
+    }
+    heap_.free(m);
+}
+
+} // namespace attos
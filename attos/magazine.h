@@ -0,0 +1,72 @@
+#ifndef ATTOS_MAGAZINE_H
+#define ATTOS_MAGAZINE_H
+
+#include <attos/mem.h>
+#include <attos/cpu.h>
+
+namespace attos {
+
+// Per-CPU magazine caches (Bonwick & Adams, "Magazines and Vmem") in front of a default_heap.
+//
+// Every CPU has a loaded and a previous magazine of free blocks for each of the small size classes.
+// alloc() and free() only touch the magazines of the calling CPU in the common case, so they take no lock.
+// When both magazines are empty (alloc) or full (free), the CPU swaps one with the depot.
+// The depot holds full and empty magazines shared by all CPUs, and is the only place the lock is taken.
+// Blocks freed on one CPU can therefore be allocated on another.
+//
+// The per-CPU state must only be used by code running on that CPU. It must not be re-entered from interrupt handlers.
+#pragma warning(push)
+#pragma warning(disable: 4324) // structure was padded due to alignment specifier
+class magazine_cache {
+public:
+    static constexpr uint32_t max_cpus       = 16;
+    static constexpr uint32_t magazine_size  = 15;  // Blocks per magazine
+    static constexpr uint64_t max_block_size = 512; // Larger blocks bypass the cache
+    static constexpr uint32_t max_depot_full = 8;   // Full magazines kept per size class, the rest are returned to the heap
+
+    explicit magazine_cache(default_heap& heap, uint32_t cpu_count);
+    ~magazine_cache();
+
+    magazine_cache(const magazine_cache&) = delete;
+    magazine_cache& operator=(const magazine_cache&) = delete;
+
+    void* alloc(uint32_t cpu, uint64_t size);
+    void free(uint32_t cpu, void* ptr);
+
+private:
+    static constexpr uint32_t num_classes = size_class_heap::num_classes;
+
+    struct magazine {
+        magazine* next;
+        uint32_t  rounds;
+        void*     blocks[magazine_size];
+    };
+
+    struct alignas(64) cpu_cache {
+        magazine* loaded[num_classes];
+        magazine* previous[num_classes];
+    };
+
+    struct depot {
+        magazine* full;
+        magazine* empty;
+        uint32_t  full_count;
+    };
+
+    default_heap&  heap_;
+    const uint32_t cpu_count_;
+    cpu_cache      cpus_[max_cpus];
+    spinlock       lock_;  // Protects depots_ and heap_
+    depot          depots_[num_classes];
+
+    static magazine* pop(magazine*& list);
+    static void push(magazine*& list, magazine* m);
+    void* alloc_from_depot(cpu_cache& c, uint32_t index, uint64_t size);
+    void free_to_depot(cpu_cache& c, uint32_t index, void* ptr);
+    void destroy_magazine(magazine* m);
+};
+#pragma warning(pop)
+
+} // namespace attos
+
+#endif
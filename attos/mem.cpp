@@ -15,24 +15,46 @@ out_stream& operator<<(out_stream& os, memory_type type) {
     return os;
 }
 
-simple_heap::simple_heap(uint8_t* base, uint64_t length) : base_(base), end_(base + length), free_(end_of_list) {
-    REQUIRE(length >= sizeof(free_node));
-    REQUIRE(length % sizeof(free_node) == 0);
-    insert_free(base, length);
+simple_heap::simple_heap(uint8_t* base, uint64_t length, page_source* pages) : pages_(pages), region_count_(0), total_length_(0), free_(end_of_list) {
+    add_region(base, length);
 }
 
 simple_heap::~simple_heap() {
     // All allocations should have been freed
-    REQUIRE(free_ == reinterpret_cast<free_node*>(base_) && free_->size == static_cast<uint64_t>(end_ - base_));
+    uint64_t free_size = 0;
+    for (auto f = free_; f != end_of_list; f = f->next) {
+        free_size += f->size;
+    }
+    REQUIRE(free_size == total_length_);
+    // Return the regions the heap grew by
+    for (uint32_t i = 1; i < region_count_; ++i) {
+        pages_->free_pages(regions_[i].base, regions_[i].length);
+    }
 }
 
 uint8_t* simple_heap::alloc(uint64_t size) {
+    if (auto res = try_alloc(size)) {
+        return res;
+    }
+    REQUIRE(pages_ && "Could not satisfy allocation request");
+    // Grow by at least the current size (up to a limit) to keep the number of regions down
+    const auto grow_size = round_up(std::max(size, std::min(total_length_, max_grow_size)), page_source::granularity);
+    //dbgout() << "simple_heap growing by " << as_hex(grow_size) << "\n";
+    add_region(pages_->alloc_pages(grow_size), grow_size);
+    auto res = try_alloc(size);
+    REQUIRE(res);
+    return res;
+}
+
+uint8_t* simple_heap::try_alloc(uint64_t size) {
     //dbgout() << "simple_heap::alloc(" << as_hex(size) << ")\n";
     free_node** fp = &free_;
     while ((*fp) != end_of_list && (*fp)->size < size) {
         fp = &(*fp)->next;
     }
-    REQUIRE(*fp != end_of_list && "Could not satisfy allocation request");
+    if (*fp == end_of_list) {
+        return nullptr;
+    }
 
     uint8_t* res = reinterpret_cast<uint8_t*>(*fp);
     free_node* next_free     = *fp + size / sizeof(free_node);
@@ -52,10 +74,19 @@ uint8_t* simple_heap::alloc(uint64_t size) {
 
 void simple_heap::free(uint8_t* ptr, uint64_t size) {
     //dbgout() << "simple_heap::free(" << as_hex((uint64_t)ptr) << ") size = "  << as_hex(size) << "\n";
-    REQUIRE((uint64_t)ptr >= (uint64_t)base_ && (uint64_t)ptr + size <= (uint64_t)end_);
+    REQUIRE(std::any_of(regions_, regions_ + region_count_, [ptr, size](const region& r) { return ptr >= r.base && ptr + size <= r.base + r.length; }));
     insert_free(ptr, size);
 }
 
+void simple_heap::add_region(uint8_t* base, uint64_t length) {
+    REQUIRE(length >= sizeof(free_node));
+    REQUIRE(length % sizeof(free_node) == 0);
+    REQUIRE(region_count_ < max_regions);
+    regions_[region_count_++] = region{base, length};
+    total_length_ += length;
+    insert_free(base, length);
+}
+
 void simple_heap::insert_free(void* ptr, uint64_t size) {
     auto new_free = reinterpret_cast<free_node*>(ptr);
     new_free->size = size;
@@ -83,22 +114,117 @@ void simple_heap::insert_free(void* ptr, uint64_t size) {
     new_free->next = prev->next;
     prev->next = new_free;
 
-    // Coalescing blocks starting from our insertion point
+    // Coalescing blocks starting from our insertion point (the new block may only join the next one)
+    coalesce_from(new_free);
     coalesce_from(prev);
 }
 
+bool simple_heap::region_start(const free_node* f) const {
+    return std::any_of(regions_, regions_ + region_count_, [f](const region& r) { return reinterpret_cast<const uint8_t*>(f) == r.base; });
+}
+
+// Blocks are only joined within a region. Regions the heap grew by are often adjacent, but each is returned
+// separately and free() checks that blocks lie within one.
 void simple_heap::coalesce_from(free_node* f) {
-    while (f != end_of_list && f->next != end_of_list && reinterpret_cast<uint64_t>(f) + f->size == reinterpret_cast<uint64_t>(f->next)) {
+    while (f != end_of_list && f->next != end_of_list && reinterpret_cast<uint64_t>(f) + f->size == reinterpret_cast<uint64_t>(f->next) && !region_start(f->next)) {
         //dbgout() << "coalesce " << *f << " with " << *f->next << "\n";
         f->size += f->next->size;
         f->next  = f->next->next;
     }
 }
 
-void* default_heap::alloc(uint64_t size) {
+size_class_heap::size_class_heap(simple_heap& backing) : backing_(backing), slabs_(nullptr), live_blocks_(0) {
+    for (auto& f : free_) {
+        f = nullptr;
+    }
+}
+
+size_class_heap::~size_class_heap() {
+    // All blocks should have been freed
+    REQUIRE(live_blocks_ == 0);
+    while (slabs_) {
+        auto s = slabs_;
+        slabs_ = s->next;
+        backing_.free(reinterpret_cast<uint8_t*>(s), s->size);
+    }
+}
+
+uint32_t size_class_heap::class_index(uint64_t size) {
+    static_assert(class_size_from_index(0) == min_size && class_size_from_index(num_classes - 1) == max_size, "");
+    if (size <= min_size) {
+        return 0;
+    }
+    REQUIRE(size <= max_size);
+    unsigned long b;
+    _BitScanReverse64(&b, size - 1); // 2^b < size <= 2^(b+1)
+    return size <= (3ULL << (b - 1)) ? 2 * (b - min_shift) + 1 : 2 * (b + 1 - min_shift);
+}
+
+uint8_t* size_class_heap::alloc(uint64_t size) {
+    const auto index = class_index(size);
+    REQUIRE(class_size_from_index(index) == size);
+    if (!free_[index]) {
+        refill(index);
+    }
+    auto b = free_[index];
+    free_[index] = b->next;
+    ++live_blocks_;
+    return reinterpret_cast<uint8_t*>(b);
+}
+
+void size_class_heap::free(uint8_t* ptr, uint64_t size) {
+    const auto index = class_index(size);
+    REQUIRE(ptr && class_size_from_index(index) == size);
+    REQUIRE(live_blocks_ > 0);
+    auto b = reinterpret_cast<free_block*>(ptr);
+    b->next = free_[index];
+    free_[index] = b;
+    --live_blocks_;
+}
+
+void size_class_heap::refill(uint32_t index) {
+    static_assert(sizeof(slab_header) % 16 == 0, "");
+    const uint64_t block_size = class_size_from_index(index);
+    const uint64_t count      = std::max<uint64_t>(slab_size / block_size, 2);
+    const uint64_t size       = sizeof(slab_header) + count * block_size;
+
+    auto s = reinterpret_cast<slab_header*>(backing_.alloc(size));
+    s->next = slabs_;
+    s->size = size;
+    slabs_  = s;
+
+    // Thread the blocks onto the free list in address order
+    auto p = reinterpret_cast<uint8_t*>(s + 1);
+    for (uint64_t i = 0; i < count; ++i, p += block_size) {
+        auto b = reinterpret_cast<free_block*>(p);
+        b->next = i + 1 < count ? reinterpret_cast<free_block*>(p + block_size) : free_[index];
+    }
+    free_[index] = reinterpret_cast<free_block*>(s + 1);
+}
+
+uint64_t default_heap::block_size_for(uint64_t size) {
     static_assert(align == 2*sizeof(uint64_t), "");
     size = round_up(size + align, align);
-    auto ptr = heap_.alloc(size);
+    return size <= size_class_heap::max_size ? size_class_heap::class_size(size) : size;
+}
+
+uint64_t default_heap::block_size(const void* ptr) {
+    auto p = static_cast<const uint8_t*>(ptr) - align;
+    REQUIRE(reinterpret_cast<const uint64_t*>(p)[1] == reinterpret_cast<uint64_t>(p)); // Check cookie
+    return reinterpret_cast<const uint64_t*>(p)[0];
+}
+
+void* default_heap::alloc(uint64_t size) {
+    size = block_size_for(size);
+    uint8_t* ptr;
+    if (size <= size_class_heap::max_size) {
+        ptr = small_.alloc(size);
+    } else if (size <= large_size || !pages_) {
+        ptr = heap_.alloc(size);
+    } else {
+        size = round_up(size, page_source::granularity);
+        ptr  = pages_->alloc_pages(size);
+    }
     reinterpret_cast<uint64_t*>(ptr)[0] = size; // Save size
     reinterpret_cast<uint64_t*>(ptr)[1] = reinterpret_cast<uint64_t>(ptr);  // Cookie to detect corruption
     return ptr + align;
@@ -109,7 +235,123 @@ void default_heap::free(void* ptr) {
     auto size = reinterpret_cast<const uint64_t*>(p)[0];
     REQUIRE(reinterpret_cast<const uint64_t*>(p)[1] == reinterpret_cast<uint64_t>(p)); // Check cookie
     reinterpret_cast<uint64_t*>(p)[1] = 0; // Clear cookie
-    heap_.free(p, size);
+    if (size <= size_class_heap::max_size) {
+        small_.free(p, size);
+    } else if (size <= large_size || !pages_) {
+        heap_.free(p, size);
+    } else {
+        pages_->free_pages(p, size);
+    }
+}
+
+buddy_allocator::buddy_allocator(uint8_t* base, uint64_t length)
+    : base_(reinterpret_cast<uint8_t*>(round_up(reinterpret_cast<uint64_t>(base), page_size)))
+    , end_(reinterpret_cast<uint8_t*>((reinterpret_cast<uint64_t>(base) + length) & ~(page_size - 1)))
+    , first_(base_ + round_up(static_cast<uint64_t>(end_ - base_) >> page_shift, page_size))
+    , order_(base_)
+    , free_bytes_(0) {
+    REQUIRE(end_ > first_);
+    for (auto& f : free_) {
+        f = nullptr;
+    }
+    __stosq(reinterpret_cast<uint64_t*>(order_), 0, (first_ - base_) / 8);
+    free_range(first_, end_);
+}
+
+buddy_allocator::~buddy_allocator() {
+    // All allocations should have been freed
+    REQUIRE(free_bytes_ == managed_bytes());
+}
+
+uint8_t* buddy_allocator::alloc(uint64_t size) {
+    REQUIRE(size != 0);
+    const uint64_t pages = round_up(size, page_size) >> page_shift;
+    unsigned long order = 0;
+    if (pages > 1) {
+        _BitScanReverse64(&order, pages - 1);
+        ++order;
+    }
+    REQUIRE(order <= max_order);
+
+    uint32_t o = order;
+    while (o <= max_order && !free_[o]) {
+        ++o;
+    }
+    REQUIRE(o <= max_order && "Could not satisfy allocation request");
+
+    auto p = reinterpret_cast<uint8_t*>(free_[o]);
+    remove_free(p, o);
+    // Split the block, returning the upper halves to the free lists
+    while (o > order) {
+        --o;
+        insert_free(p + (page_size << o), o);
+    }
+    // And give back the pages that weren't asked for
+    const uint64_t used = pages << page_shift;
+    free_bytes_ -= page_size << order;
+    if (used != page_size << order) {
+        free_range(p + used, p + (page_size << order));
+    }
+    return p;
+}
+
+void buddy_allocator::free(uint8_t* ptr, uint64_t size) {
+    REQUIRE(!(reinterpret_cast<uint64_t>(ptr) & (page_size - 1)));
+    size = round_up(size, page_size);
+    REQUIRE(size && ptr >= first_ && ptr + size <= end_);
+    free_range(ptr, ptr + size);
+}
+
+void buddy_allocator::insert_free(uint8_t* p, uint32_t order) {
+    auto b = reinterpret_cast<free_block*>(p);
+    b->next = free_[order];
+    b->prev = nullptr;
+    if (b->next) {
+        b->next->prev = b;
+    }
+    free_[order] = b;
+    page_state(p) = static_cast<uint8_t>(order + 1);
+}
+
+void buddy_allocator::remove_free(uint8_t* p, uint32_t order) {
+    auto b = reinterpret_cast<free_block*>(p);
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        free_[order] = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+    page_state(p) = 0;
+}
+
+void buddy_allocator::free_block_of_order(uint8_t* p, uint32_t order) {
+    REQUIRE(page_state(p) == 0 && "Double free");
+    free_bytes_ += page_size << order;
+    for (; order < max_order; ++order) {
+        auto buddy = reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(p) ^ (page_size << order));
+        if (buddy < first_ || buddy + (page_size << order) > end_ || page_state(buddy) != order + 1) {
+            break;
+        }
+        remove_free(buddy, order);
+        p = std::min(p, buddy);
+    }
+    insert_free(p, order);
+}
+
+void buddy_allocator::free_range(uint8_t* p, uint8_t* end) {
+    // Split the range into the largest naturally aligned blocks possible
+    while (p < end) {
+        uint32_t order = 0;
+        while (order < max_order
+            && !(reinterpret_cast<uint64_t>(p) & ((page_size << (order + 1)) - 1))
+            && p + (page_size << (order + 1)) <= end) {
+            ++order;
+        }
+        free_block_of_order(p, order);
+        p += page_size << order;
+    }
 }
 
 } //namespace attos
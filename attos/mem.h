@@ -244,11 +244,33 @@ private:
 template<typename T>
 T* singleton<T>::instance_;
 
+// Supplies page granular memory to heaps that grow on demand
+class __declspec(novtable) page_source {
+public:
+    virtual ~page_source() = 0 {}
+
+    static constexpr uint64_t granularity = 4096;
+
+    // 'length' is a multiple of granularity
+    uint8_t* alloc_pages(uint64_t length) {
+        return do_alloc_pages(length);
+    }
+
+    void free_pages(uint8_t* ptr, uint64_t length) {
+        do_free_pages(ptr, length);
+    }
+
+private:
+    virtual uint8_t* do_alloc_pages(uint64_t length) = 0;
+    virtual void do_free_pages(uint8_t* ptr, uint64_t length) = 0;
+};
+
 // Simple heap. The free blocks are kept in list sorted according to memory address. Memory blocks are coalesced on free().
 // No alignment is enformed and the user needs to know the size of allocations (or allocation memory to store them)
+// If a page_source is given, the heap grows by adding regions from it when an allocation can't be satisfied.
 class simple_heap {
 public:
-    explicit simple_heap(uint8_t* base, uint64_t length);
+    explicit simple_heap(uint8_t* base, uint64_t length, page_source* pages = nullptr);
     ~simple_heap();
 
     simple_heap(const simple_heap&) = delete;
@@ -258,8 +280,17 @@ public:
     void free(uint8_t* ptr, uint64_t size);
 
 private:
-    uint8_t* const base_;
-    uint8_t* const end_;
+    static constexpr uint32_t max_regions   = 32;
+    static constexpr uint64_t max_grow_size = 16 << 20;
+
+    struct region {
+        uint8_t* base;
+        uint64_t length;
+    };
+    page_source* const pages_;
+    region             regions_[max_regions];
+    uint32_t           region_count_;
+    uint64_t           total_length_;
 
     struct free_node {
         uint64_t   size;
@@ -268,21 +299,123 @@ private:
     static constexpr free_node* end_of_list = reinterpret_cast<free_node*>(~0ULL);
     free_node* free_;
 
+    uint8_t* try_alloc(uint64_t size);
+    void add_region(uint8_t* base, uint64_t length);
     void insert_free(void* ptr, uint64_t size);
-    static void coalesce_from(free_node* f);
+    bool region_start(const free_node* f) const;
+    void coalesce_from(free_node* f);
 };
 
+// Segregated free lists for small blocks. There are two size classes per power of two (32, 48, 64, 96, ..., 4096 bytes),
+// each refilled with slabs carved from the backing simple_heap, making alloc() and free() O(1).
+// Blocks stay on the free list of their class once carved out, the slabs are only returned when the heap is destroyed.
+class size_class_heap {
+public:
+    static constexpr uint32_t min_shift = 5;
+    static constexpr uint32_t max_shift = 12;
+    static constexpr uint64_t min_size  = 1ULL << min_shift;
+    static constexpr uint64_t max_size  = 1ULL << max_shift;
+    static constexpr uint64_t slab_size = 8 << 10;
+
+    explicit size_class_heap(simple_heap& backing);
+    ~size_class_heap();
+
+    size_class_heap(const size_class_heap&) = delete;
+    size_class_heap& operator=(const size_class_heap&) = delete;
+
+    static constexpr uint32_t num_classes = 2 * (max_shift - min_shift) + 1;
+
+    // Returns the size of the block used to satisfy a request for 'size' bytes (size <= max_size)
+    static uint64_t class_size(uint64_t size) { return class_size_from_index(class_index(size)); }
+    static uint32_t class_index(uint64_t size);
+    static constexpr uint64_t class_size_from_index(uint32_t index) {
+        return (index & 1 ? 3ULL << (min_shift - 1) : 1ULL << min_shift) << (index >> 1);
+    }
+
+    // Both 'size' arguments must be class sizes (as returned by class_size)
+    uint8_t* alloc(uint64_t size);
+    void free(uint8_t* ptr, uint64_t size);
+
+private:
+    struct free_block {
+        free_block* next;
+    };
+    struct slab_header {
+        slab_header* next;
+        uint64_t     size;
+    };
+    simple_heap& backing_;
+    free_block*  free_[num_classes];
+    slab_header* slabs_;
+    uint64_t     live_blocks_;
+
+    void refill(uint32_t index);
+};
+
+// Binary buddy allocator for page frames. A block of order k is 2^k pages and is aligned to its size (the alignment is that
+// of the memory address, so for identity mapped memory it is also the physical alignment). Free blocks are kept in per-order
+// lists stored in the free memory itself. One byte per page, carved from the start of the range, holds the order of
+// each free block so the buddy of a block can be checked in O(1) when it's freed.
+class buddy_allocator {
+public:
+    static constexpr uint32_t page_shift = 12;
+    static constexpr uint64_t page_size  = 1ULL << page_shift;
+    static constexpr uint32_t max_order  = 30 - page_shift; // 1 GB
+
+    explicit buddy_allocator(uint8_t* base, uint64_t length);
+    ~buddy_allocator();
+
+    buddy_allocator(const buddy_allocator&) = delete;
+    buddy_allocator& operator=(const buddy_allocator&) = delete;
+
+    // Allocates 'size' bytes rounded up to whole pages. Requests for a power of two number of pages are naturally aligned.
+    uint8_t* alloc(uint64_t size);
+    // Frees a page aligned range. The range doesn't have to match a previous alloc() call, as long as all of it is allocated.
+    void free(uint8_t* ptr, uint64_t size);
+
+    uint64_t free_bytes() const { return free_bytes_; }
+    uint64_t managed_bytes() const { return static_cast<uint64_t>(end_ - first_); }
+
+private:
+    struct free_block {
+        free_block* next;
+        free_block* prev;
+    };
+    uint8_t* const base_;  // Address of page 0 of the page state array
+    uint8_t* const end_;
+    uint8_t* const first_; // First allocatable page
+    uint8_t*       order_; // For each page: 0 if not the start of a free block, otherwise order+1
+    free_block*    free_[max_order + 1];
+    uint64_t       free_bytes_;
+
+    uint8_t& page_state(const uint8_t* p) { return order_[(p - base_) >> page_shift]; }
+    void insert_free(uint8_t* p, uint32_t order);
+    void remove_free(uint8_t* p, uint32_t order);
+    void free_block_of_order(uint8_t* p, uint32_t order);
+    void free_range(uint8_t* p, uint8_t* end);
+};
+
+// General purpose heap. Small blocks come from a size_class_heap, larger ones from the simple_heap behind it.
+// With a page_source the heap grows on demand, and blocks larger than large_size get their own pages.
 class default_heap {
 public:
-    static constexpr uint64_t align = 16;
+    static constexpr uint64_t align      = 16;
+    static constexpr uint64_t large_size = 64 << 10;
 
-    explicit default_heap(uint8_t* base, uint64_t length) : heap_(base, length) {
+    explicit default_heap(uint8_t* base, uint64_t length, page_source* pages = nullptr) : pages_(pages), heap_(base, length, pages), small_(heap_) {
     }
 
     void* alloc(uint64_t size);
     void free(void* ptr);
+
+    // Size of the block (including the header) that backs an allocation of 'size' bytes
+    static uint64_t block_size_for(uint64_t size);
+    // Size of the block backing 'ptr' (which must have been returned by alloc())
+    static uint64_t block_size(const void* ptr);
 private:
-    simple_heap heap_;
+    page_source*    pages_;
+    simple_heap     heap_;
+    size_class_heap small_;
 };
 
 } // namespace attos
@@ -41,4 +41,12 @@ uint16_t inet_csum(const void * src, uint16_t length, uint16_t init) {
     return static_cast<uint16_t>(result);
 }
 
+uint16_t udp_pseudo_header_sum(ipv4_address src, ipv4_address dst, uint16_t udp_length) {
+    const uint32_t s = src.host_u32(), d = dst.host_u32();
+    uint32_t result = (s >> 16) + (s & 0xFFFF) + (d >> 16) + (d & 0xFFFF) + static_cast<uint8_t>(ip_protocol::udp) + udp_length;
+    result = (result >> 16) + (result & 0xFFFF);
+    result += (result >> 16);
+    return static_cast<uint16_t>(result);
+}
+
 } } // namespace attos::net
@@ -2,6 +2,7 @@
 #define ATTOS_NET_NET_H
 
 #include <attos/function.h>
+#include <attos/net/packet_pool.h>
 #include <array>
 #include <type_traits>
 
@@ -112,6 +113,7 @@ static_assert(sizeof(ipv4_address) == 4, "");
 out_stream& operator<<(out_stream& os, const ipv4_address& ip);
 
 using packet_process_function = function<void (const uint8_t*, uint32_t)>;
+using packet_receive_function = function<void (packet_ref)>;
 
 constexpr uint16_t ethernet_max_bytes = 1500;
 
@@ -123,18 +125,49 @@ public:
         return do_hw_address();
     }
 
-    void send_packet(const void* data, uint32_t length) {
-        do_send_packet(data, length);
+    // The device fills in the checksums in `insert' (which must be supported, see features()). Their fields
+    // must be zero, except the UDP checksum which must hold the (uncomplemented) sum of the pseudo header.
+    void send_packet(const void* data, uint32_t length, checksum_offload insert = checksum_offload::none) {
+        do_send_packet(data, length, insert);
     }
 
+    struct offload_features {
+        checksum_offload rx; // Verified on receive (when the device can, see packet_ref::verified)
+        checksum_offload tx; // Can be inserted on transmit
+    };
+
+    offload_features features() const {
+        return do_features();
+    }
+
+    // The frame passed to `ppf' is only valid during the call
     void process_packets(const packet_process_function& ppf, int max_packets) {
-        do_process_packets(ppf, max_packets);
+        do_receive_packets([&ppf](packet_ref p) { ppf(p.data(), p.length()); }, max_packets);
+    }
+
+    // Passes up to `max_packets' received frames to `prf'. They stay in the device's buffers (which aren't
+    // reused for new frames) for as long as they're referenced.
+    void receive_packets(const packet_receive_function& prf, int max_packets) {
+        do_receive_packets(prf, max_packets);
+    }
+
+    // The pool the received frames are lent out from
+    const packet_pool& rx_pool() const {
+        return *do_rx_pool();
+    }
+
+    // `notify' is called (possibly from an interrupt handler) when packets may have been received
+    void set_receive_notify(const function<void ()>& notify) {
+        do_set_receive_notify(notify);
     }
 
 private:
     virtual mac_address do_hw_address() const = 0;
-    virtual void do_send_packet(const void* data, uint32_t length) = 0;
-    virtual void do_process_packets(const packet_process_function& ppf, int max_packets) = 0;
+    virtual void do_send_packet(const void* data, uint32_t length, checksum_offload insert) = 0;
+    virtual void do_receive_packets(const packet_receive_function& prf, int max_packets) = 0;
+    virtual const packet_pool* do_rx_pool() const = 0;
+    virtual offload_features do_features() const = 0;
+    virtual void do_set_receive_notify(const function<void ()>& notify) = 0;
 };
 
 enum class ethertype : uint16_t {
@@ -276,6 +309,8 @@ enum class dhcp_message_type : uint8_t {
 #pragma pack(pop)
 
 uint16_t inet_csum(const void * src, uint16_t length, uint16_t init = 0);
+// The sum (not complemented) of the pseudo header used for the UDP checksum, as `init' for inet_csum
+uint16_t udp_pseudo_header_sum(ipv4_address src, ipv4_address dst, uint16_t udp_length);
 
 struct ipv4_net_config {
     ipv4_address addr;
@@ -0,0 +1,155 @@
+#ifndef ATTOS_NET_PACKET_POOL_H
+#define ATTOS_NET_PACKET_POOL_H
+
+#include <attos/cpu.h>
+#include <attos/containers.h>
+#include <attos/function.h>
+
+namespace attos { namespace net {
+
+class packet_pool;
+
+// Checksums computed by a network device: verified on receive (packet_ref::verified) or inserted on transmit
+// (ethernet_device::send_packet)
+enum class checksum_offload : uint32_t {
+    none = 0x0000,
+    ipv4 = 0x0001, // IPv4 header
+    udp  = 0x0002, // UDP (including the pseudo header)
+};
+ENUM_BIT_OPS(checksum_offload, uint32_t)
+
+// A received frame in a packet_pool buffer. The buffer isn't reused while any copy of the packet_ref exists,
+// so the frame can be kept without copying it.
+class packet_ref {
+public:
+    packet_ref() = default;
+    packet_ref(const packet_ref& other);
+    packet_ref(packet_ref&& other) : pool_(other.pool_), index_(other.index_), length_(other.length_), verified_(other.verified_) {
+        other.pool_ = nullptr;
+    }
+    packet_ref& operator=(packet_ref other) {
+        std::swap(pool_, other.pool_);
+        std::swap(index_, other.index_);
+        std::swap(length_, other.length_);
+        std::swap(verified_, other.verified_);
+        return *this;
+    }
+    ~packet_ref() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return pool_ != nullptr;
+    }
+
+    const uint8_t* data() const;
+
+    uint32_t length() const {
+        return length_;
+    }
+
+    uint32_t index() const {
+        return index_;
+    }
+
+    // The checksums the device found to be correct (frames that fail the hardware check are delivered unverified)
+    checksum_offload verified() const {
+        return verified_;
+    }
+
+    void reset();
+
+private:
+    packet_pool*     pool_ = nullptr;
+    uint32_t         index_ = 0;
+    uint32_t         length_ = 0;
+    checksum_offload verified_ = checksum_offload::none;
+
+    explicit packet_ref(packet_pool& pool, uint32_t index, uint32_t length, checksum_offload verified) : pool_(&pool), index_(index), length_(length), verified_(verified) {
+    }
+
+    friend packet_pool;
+};
+
+// Reference counts for `count' buffers of `size' bytes starting at `base'. The owner of the memory decides which
+// buffers to lend out and is told (through `on_free') when the last reference to one goes away.
+// Not safe across processors or interrupt handlers.
+class packet_pool {
+public:
+    explicit packet_pool(uint8_t* base, uint32_t count, uint32_t size, const function<void (uint32_t)>& on_free)
+        : base_(base), size_(size), on_free_(on_free) {
+        refs_.resize(count);
+        for (auto& r: refs_) {
+            r = 0;
+        }
+    }
+    ~packet_pool() {
+        for (const auto r: refs_) {
+            REQUIRE(r == 0 && "Packet still referenced");
+        }
+    }
+    packet_pool(const packet_pool&) = delete;
+    packet_pool& operator=(const packet_pool&) = delete;
+
+    uint32_t count() const {
+        return static_cast<uint32_t>(refs_.size());
+    }
+
+    uint32_t buffer_size() const {
+        return size_;
+    }
+
+    uint8_t* buffer(uint32_t index) const {
+        REQUIRE(index < count());
+        return base_ + static_cast<uint64_t>(index) * size_;
+    }
+
+    // Hands out buffer `index' (which must not be referenced) holding a `length' byte frame
+    packet_ref lend(uint32_t index, uint32_t length, checksum_offload verified = checksum_offload::none) {
+        REQUIRE(index < count() && refs_[index] == 0 && length <= size_);
+        refs_[index] = 1;
+        return packet_ref{*this, index, length, verified};
+    }
+
+private:
+    uint8_t*                  base_;
+    uint32_t                  size_;
+    function<void (uint32_t)> on_free_;
+    kvector<uint32_t>         refs_;
+
+    void add_ref(uint32_t index) {
+        REQUIRE(refs_[index] != 0);
+        ++refs_[index];
+    }
+
+    void release(uint32_t index) {
+        REQUIRE(refs_[index] != 0);
+        if (!--refs_[index]) {
+            on_free_(index);
+        }
+    }
+
+    friend packet_ref;
+};
+
+inline packet_ref::packet_ref(const packet_ref& other) : pool_(other.pool_), index_(other.index_), length_(other.length_), verified_(other.verified_) {
+    if (pool_) {
+        pool_->add_ref(index_);
+    }
+}
+
+inline const uint8_t* packet_ref::data() const {
+    REQUIRE(pool_);
+    return pool_->buffer(index_);
+}
+
+inline void packet_ref::reset() {
+    if (pool_) {
+        pool_->release(index_);
+        pool_ = nullptr;
+    }
+}
+
+} } // namespace attos::net
+
+#endif
@@ -1,8 +1,10 @@
 #include "tftp.h"
 #include <attos/string.h>
 #include <attos/cpu.h>
+#include <attos/clock.h>
 #include <attos/containers.h>
 #include <attos/out_stream.h>
+#include <attos/log.h>
 
 namespace attos { namespace net { namespace tftp {
 
@@ -48,14 +50,16 @@ namespace attos { namespace net {
 
 class udp_socket {
 public:
-    using send_function_type = function<void (uint8_t*, uint32_t)>;
+    using send_function_type = function<void (uint8_t*, uint32_t, checksum_offload)>;
     using unregister_function_type = function<void (void)>;
 
-    explicit udp_socket(send_function_type send_func, unregister_function_type unregister_func, ipv4_address local_addr, uint16_t local_port)
+    // The checksums in `tx_offload' are left to the device
+    explicit udp_socket(send_function_type send_func, unregister_function_type unregister_func, ipv4_address local_addr, uint16_t local_port, checksum_offload tx_offload)
         : send_func_(send_func)
         , unregister_func_(unregister_func)
         , local_addr_(local_addr)
-        , local_port_(local_port) {
+        , local_port_(local_port)
+        , tx_offload_(tx_offload) {
         REQUIRE(local_port != 0);
     }
 
@@ -81,19 +85,30 @@ public:
         ih.protocol = ip_protocol::udp;
         ih.src      = local_addr_;
         ih.dst      = remote_addr;
-        ih.checksum = inet_csum(&ih, sizeof(ih));
+        if (!static_cast<uint32_t>(tx_offload_ & checksum_offload::ipv4)) {
+            ih.checksum = inet_csum(&ih, sizeof(ih));
+        }
 
+        const auto udp_length = static_cast<uint16_t>(sizeof(udp_header) + length);
+        const auto pseudo_sum = udp_pseudo_header_sum(local_addr_, remote_addr, udp_length);
         auto& uh = *reinterpret_cast<udp_header*>(b);
         b += sizeof(udp_header);
         uh.src_port = local_port_;
         uh.dst_port = remote_port;
-        uh.length   = static_cast<uint16_t>(sizeof(udp_header) + length);
+        uh.length   = udp_length;
         uh.checksum = 0;
 
         memcpy(b, data, length);
         b += length;
 
-        send_func_(send_buffer_, static_cast<uint32_t>(b-&send_buffer_[0]));
+        if (static_cast<uint32_t>(tx_offload_ & checksum_offload::udp)) {
+            uh.checksum = pseudo_sum; // The device sums the rest
+        } else {
+            const auto csum = inet_csum(&uh, udp_length, pseudo_sum);
+            uh.checksum = csum ? csum : static_cast<uint16_t>(0xFFFF); // 0 means no checksum
+        }
+
+        send_func_(send_buffer_, static_cast<uint32_t>(b-&send_buffer_[0]), tx_offload_);
     }
 
 private:
@@ -101,12 +116,17 @@ private:
     unregister_function_type    unregister_func_;
     ipv4_address                local_addr_;
     uint16_t                    local_port_;
+    checksum_offload            tx_offload_;
     uint8_t                     send_buffer_[ethernet_max_bytes];
 };
 
 class ipv4_ethernet_device : public ipv4_device {
 public:
-    explicit ipv4_ethernet_device(ethernet_device& ethdev) : ethdev_{ethdev} {
+    explicit ipv4_ethernet_device(ethernet_device& ethdev, int rx_budget)
+        : ethdev_{ethdev}
+        , rx_budget_{rx_budget}
+        , tx_offload_{ethdev.features().tx & (checksum_offload::ipv4 | checksum_offload::udp)} {
+        REQUIRE(rx_budget_ >= 1);
     }
 
     virtual ~ipv4_ethernet_device() override {
@@ -124,14 +144,14 @@ public:
         }
         REQUIRE(local_addr == ipv4_config_.addr || local_addr == inaddr_any);
         REQUIRE(!find_open_udp_socket(local_addr, local_port));
-        dbgout() << "[udp] Opening " << local_addr << ':' << local_port << "\n";
-        auto s = knew<udp_socket>([this] (uint8_t* data, uint32_t length) { ipv4_out(data, length); }, [this, local_addr, local_port] { udp_close(local_addr, local_port); }, local_addr, local_port);
+        LOG(udp, info) << "Opening " << local_addr << ':' << local_port << "\n";
+        auto s = knew<udp_socket>([this] (uint8_t* data, uint32_t length, checksum_offload insert) { ipv4_out(data, length, insert); }, [this, local_addr, local_port] { udp_close(local_addr, local_port); }, local_addr, local_port, tx_offload_);
         udp_sockets_.push_back({s.get(), recv_func});
         return s;
     }
 
     void process_packets() {
-        ethdev_.process_packets([this] (const uint8_t* data, uint32_t length) { eth_in(data, length); }, /*max_packets*/ 8);
+        ethdev_.receive_packets([this] (packet_ref p) { eth_in(p.data(), p.length(), p.verified()); }, rx_budget_);
     }
 
     mac_address hw_address() const {
@@ -146,7 +166,7 @@ public:
         REQUIRE(ipv4_config_.addr == inaddr_any);
         REQUIRE(config.addr != inaddr_any && config.addr != inaddr_broadcast);
         REQUIRE(config.netmask != inaddr_any);
-        dbgout() << "[ipv4] Configuration IP " << config.addr << " Net " << config.netmask << " Gateway " << config.gateway << "\n";
+        LOG(ipv4, info) << "Configuration IP " << config.addr << " Net " << config.netmask << " Gateway " << config.gateway << "\n";
         ipv4_config_ = config;
     }
 
@@ -161,11 +181,14 @@ private:
     };
 
     ethernet_device&            ethdev_;
+    int                         rx_budget_;
+    checksum_offload            tx_offload_; // Checksums the device inserts
     ipv4_net_config             ipv4_config_ = ipv4_net_config_none;
     kvector<arp_entry>          arp_entries_;
     kvector<open_udp_socket>    udp_sockets_;
 
-    void eth_in(const uint8_t* data, uint32_t length) {
+    // `verified' are the checksums the device has already checked
+    void eth_in(const uint8_t* data, uint32_t length, checksum_offload verified) {
         REQUIRE(length >= sizeof(ethernet_header));
         const auto& eh = * reinterpret_cast<const ethernet_header*>(data);
         data   += sizeof(ethernet_header);
@@ -180,8 +203,11 @@ private:
                     REQUIRE(ih.ihl >= 5);
                     REQUIRE(ih.ihl*4U <= length);
                     REQUIRE(ih.length <= length);
-                    REQUIRE(inet_csum(&ih, ih.ihl * 4) == 0);
-                    ipv4_in(ih, data + ih.ihl * 4, ih.length - ih.ihl * 4);
+                    if (!static_cast<uint32_t>(verified & checksum_offload::ipv4) && inet_csum(&ih, ih.ihl * 4) != 0) {
+                        LOG(ipv4, debug) << "Dropping packet with bad header checksum from " << ih.src << "\n";
+                        break;
+                    }
+                    ipv4_in(ih, data + ih.ihl * 4, ih.length - ih.ihl * 4, verified);
                     break;
                 }
             case net::ethertype::arp:
@@ -191,7 +217,7 @@ private:
             case net::ethertype::ipv6:
                 REQUIRE(length >= 40);
                 REQUIRE((data[0]>>4) == 6); // Version
-                dbgout() << "[ipv6] Ignoring IPv6 packet\n";
+                LOG(eth, debug) << "Ignoring IPv6 packet\n";
                 break;
             default:
                 hexdump(dbgout(), data, length);
@@ -223,25 +249,25 @@ private:
         bool merge_flag = false;
         if (auto e = find_arp_entry(ah.spa)) {
             if (e->ha != ah.sha) {
-                dbgout() << "[arp] Updating ARP entry " << ah.spa << " = " << ah.sha << "\n";
+                LOG(arp, info) << "Updating ARP entry " << ah.spa << " = " << ah.sha << "\n";
                 e->ha = ah.sha;
             }
             merge_flag = true;
         }
 
         if (ipv4_config_.addr == ah.tpa) { // Are we the target?
-            dbgout() << "[arp] " << (ah.oper == arp_operation::request ? "RQ" : "RP")
+            LOG(arp, debug) << (ah.oper == arp_operation::request ? "RQ" : "RP")
                 << " " << ah.sha << " " << ah.spa << " -> " << ah.tha << " " << ah.tpa << "\n";
 
             if (!merge_flag) {
-                dbgout() << "[arp] Adding ARP entry " << ah.spa << " = " << ah.sha << "\n";
+                LOG(arp, info) << "Adding ARP entry " << ah.spa << " = " << ah.sha << "\n";
                 add_arp_entry(ah.spa, ah.sha);
             }
             if (ah.oper == arp_operation::request) {
                 // Swap hardware and protocol fields, putting the local hardware and protocol addresses in the sender fields.
                 // Set the ar$op field to ares_op$REPLY
                 // Send the packet to the (new) target hardware address on the same hardware on which the request was received.
-                dbgout() << "[arp] Sending ARP reply for " << ah.tpa << " to " << ah.spa << "\n";
+                LOG(arp, debug) << "Sending ARP reply for " << ah.tpa << " to " << ah.spa << "\n";
                 send_arp(arp_operation::reply, ah.tpa, ah.sha, ah.spa);
             }
         }
@@ -279,7 +305,7 @@ private:
     //
     // IPv4
     //
-    void ipv4_in(const ipv4_header& ih, const uint8_t* data, uint32_t length) {
+    void ipv4_in(const ipv4_header& ih, const uint8_t* data, uint32_t length, checksum_offload verified) {
         switch (ih.protocol) {
             case ip_protocol::icmp:
                 REQUIRE(length >= sizeof(icmp_header));
@@ -287,14 +313,14 @@ private:
                 icmp_in(ih, *reinterpret_cast<const icmp_header*>(data), data + sizeof(icmp_header), length - sizeof(icmp_header));
                 break;
             case ip_protocol::igmp:
-                dbgout() << "[ipv4] Ignoring IGMP message src = " << ih.src << " dst = " << ih.dst << "\n";
+                LOG(ipv4, debug) << "Ignoring IGMP message src = " << ih.src << " dst = " << ih.dst << "\n";
                 break;
             case ip_protocol::tcp:
-                dbgout() << "[ipv4] Ignoring TCP message src = " << ih.src << " dst = " << ih.dst << "\n";
+                LOG(ipv4, debug) << "Ignoring TCP message src = " << ih.src << " dst = " << ih.dst << "\n";
                 break;
             case ip_protocol::udp:
                 REQUIRE(length >= sizeof(udp_header));
-                udp_in(ih, *reinterpret_cast<const udp_header*>(data), data + sizeof(udp_header), length - sizeof(udp_header));
+                udp_in(ih, *reinterpret_cast<const udp_header*>(data), data + sizeof(udp_header), length - sizeof(udp_header), verified);
                 break;
             default:
                 hexdump(dbgout(), data, length);
@@ -304,7 +330,7 @@ private:
     }
 
     // assumes room for ethernet header at front with ipv4 header and the rest of the packet immediately following
-    void ipv4_out(uint8_t* data, uint32_t length) {
+    void ipv4_out(uint8_t* data, uint32_t length, checksum_offload insert) {
         REQUIRE(length >= sizeof(ethernet_header) + sizeof(ipv4_header) && length <= ethernet_max_bytes);
         auto& eh = *reinterpret_cast<ethernet_header*>(data);
         auto& ih = *reinterpret_cast<ipv4_header*>(data + sizeof(ethernet_header));
@@ -323,14 +349,14 @@ private:
             if (auto ae = find_arp_entry(tpa)) {
                 eh.dst = ae->ha;
             } else {
-                dbgout() << "[arp] Sending ARP request for " << tpa << "\n";
+                LOG(arp, debug) << "Sending ARP request for " << tpa << "\n";
                 send_arp(arp_operation::request, ipv4_config_.addr, mac_address::broadcast, tpa);
                 return;
             }
         }
         eh.src  = ethdev_.hw_address();
         eh.type = ethertype::ipv4;
-        ethdev_.send_packet(data, length);
+        ethdev_.send_packet(data, length, insert);
     }
 
     //
@@ -357,7 +383,9 @@ private:
                         oih.protocol = ip_protocol::icmp;
                         oih.src      = ih.dst;
                         oih.dst      = ih.src;
-                        oih.checksum = inet_csum(&oih, sizeof(oih));
+                        if (!static_cast<uint32_t>(tx_offload_ & checksum_offload::ipv4)) {
+                            oih.checksum = inet_csum(&oih, sizeof(oih));
+                        }
 
                         auto& oicmp = *reinterpret_cast<icmp_header*>(b);
                         b += sizeof(icmp_header);
@@ -371,14 +399,14 @@ private:
 
                         oicmp.checksum = inet_csum(&oicmp, static_cast<uint16_t>(sizeof(icmp_header) + length));
 
-                        ipv4_out(buffer, static_cast<uint16_t>(b - buffer));
+                        ipv4_out(buffer, static_cast<uint16_t>(b - buffer), tx_offload_ & checksum_offload::ipv4);
                         return;
                     }
                 default:
                     break;
             }
         }
-        dbgout() << "[icmp] Ignoring type " << as_hex(static_cast<uint8_t>(icmp_h.type)) << " code " << as_hex(icmp_h.code) << " from " << ih.src << " to " << ih.dst << "\n";
+        LOG(icmp, debug) << "Ignoring type " << as_hex(static_cast<uint8_t>(icmp_h.type)) << " code " << as_hex(icmp_h.code) << " from " << ih.src << " to " << ih.dst << "\n";
     }
 
     //
@@ -393,20 +421,24 @@ private:
         return it != udp_sockets_.end() ? &*it : nullptr;
     }
 
-    void udp_in(const ipv4_header& ih, const udp_header& uh, const uint8_t* data, uint32_t length) {
+    void udp_in(const ipv4_header& ih, const udp_header& uh, const uint8_t* data, uint32_t length, checksum_offload verified) {
         REQUIRE(uh.length >= sizeof(udp_header));
         REQUIRE(length >= uh.length - sizeof(udp_header));
         length = uh.length - sizeof(udp_header);
+        if (!static_cast<uint32_t>(verified & checksum_offload::udp) && uh.checksum != 0 && inet_csum(&uh, uh.length, udp_pseudo_header_sum(ih.src, ih.dst, uh.length)) != 0) {
+            LOG(udp, debug) << "Dropping datagram with bad checksum from " << ih.src << ':' << uh.src_port << "\n";
+            return;
+        }
         if (auto s = find_open_udp_socket(ih.dst, uh.dst_port)) {
             s->recv_func(data, length);
             return;
         }
-        dbgout() << "[udp] Ignoring data from " << ih.src << ':' << uh.src_port << " to " << ih.dst << ':' << uh.dst_port << "\n";
+        LOG(udp, debug) << "Ignoring data from " << ih.src << ':' << uh.src_port << " to " << ih.dst << ':' << uh.dst_port << "\n";
         (void) data; (void) length;
     }
 
     void udp_close(ipv4_address local_addr, uint16_t port) {
-        dbgout() << "[udp] Closing " << local_addr << ':' << port << "\n";
+        LOG(udp, info) << "Closing " << local_addr << ':' << port << "\n";
         auto s = find_open_udp_socket(local_addr, port);
         REQUIRE(s != nullptr);
         udp_sockets_.erase(s);
@@ -431,8 +463,8 @@ public:
     }
 
     void tick() {
-        if (timeout_ && !--timeout_) {
-            dbgout() << "[dhcp] Timed out.\n";
+        if (retransmit_.expired()) {
+            LOG(dhcp, info) << "Timed out.\n";
             send_dhcp_discover();
         }
     }
@@ -444,7 +476,8 @@ private:
     enum class state { wait_for_offer, wait_for_ack, finished } state_ = state::wait_for_offer;
     static constexpr uint16_t dhcp_src_port = 68;
     static constexpr uint16_t dhcp_dst_port = 67;
-    uint32_t timeout_ = 0;
+    static constexpr uint64_t retransmit_ms = 2000;
+    deadline retransmit_;
 
 #pragma pack(push, 1)
     struct dhcp_header : bootp_header {
@@ -484,7 +517,7 @@ private:
         REQUIRE(b >= &buffer_[sizeof(dhcp_header)] && b < &buffer_[sizeof(buffer_)-1]);
         *b++ = static_cast<uint8_t>(dhcp_option::end);
         s_->sendto(inaddr_broadcast, dhcp_dst_port, buffer_, static_cast<uint16_t>(b - buffer_));
-        timeout_ = 50;
+        retransmit_.arm_after_ms(retransmit_ms);
     }
 
     static uint8_t* put_option(uint8_t* b, dhcp_option opt, ipv4_address addr) {
@@ -518,7 +551,7 @@ private:
         REQUIRE(dh.message_type_opt == dhcp_option::message_type);
         REQUIRE(dh.message_type_len == 1);
         if (dh.message_type != expected_messge) {
-            dbgout() << "dh.message_type = " << as_hex((uint16_t)dh.message_type) << "\n";
+            LOG(dhcp, error) << "dh.message_type = " << as_hex((uint16_t)dh.message_type) << "\n";
         }
         REQUIRE(dh.message_type     == expected_messge);
 
@@ -541,7 +574,7 @@ private:
 
             switch (type) {
             default:
-                dbgout() << "[dhcp] Ignoring option " << static_cast<uint8_t>(type) << " of length " << len << "\n";
+                LOG(dhcp, debug) << "Ignoring option " << static_cast<uint8_t>(type) << " of length " << len << "\n";
             case dhcp_option::subnet_mask:
                 REQUIRE(len == 4);
                 res.netmask = *reinterpret_cast<const ipv4_address*>(data);
@@ -592,14 +625,14 @@ private:
     }
 
     void send_dhcp_discover() {
-        dbgout() << "[dhcp] Sending DHCPDISCOVER\n";
+        LOG(dhcp, info) << "Sending DHCPDISCOVER\n";
         auto b = start_request(dhcp_message_type::discover, bootp_broadcast_flag);
         finish_request(b);
         state_ = state::wait_for_offer;
     }
 
     void send_dhcp_request(ipv4_address address, ipv4_address server_id) {
-        dbgout() << "[dhcp] Sending DHCPREQUEST for " << address << "\n";
+        LOG(dhcp, info) << "Sending DHCPREQUEST for " << address << "\n";
         auto b = start_request(dhcp_message_type::request, bootp_broadcast_flag);
         b = put_option(b, dhcp_option::requested_ip, address);
         b = put_option(b, dhcp_option::server_identifier, server_id);
@@ -612,7 +645,7 @@ private:
         case state::wait_for_offer:
             {
                 auto pr = parse_reply(dhcp_message_type::offer, data, length);
-                dbgout() << "[dhcp] Got DHCPOFFER for " << pr.dh->yiaddr << " from " << pr.server_id << "\n";
+                LOG(dhcp, info) << "Got DHCPOFFER for " << pr.dh->yiaddr << " from " << pr.server_id << "\n";
                 config_.addr = pr.dh->yiaddr;
                 config_.netmask = pr.netmask;
                 config_.gateway = pr.router;
@@ -627,7 +660,7 @@ private:
         case state::wait_for_ack:
             {
                 auto pr = parse_reply(dhcp_message_type::ack, data, length);
-                dbgout() << "[dhcp] Got DHCPACK for " << pr.dh->yiaddr << " from " << pr.server_id << "\n";
+                LOG(dhcp, info) << "Got DHCPACK for " << pr.dh->yiaddr << " from " << pr.server_id << "\n";
                 REQUIRE(pr.dh->yiaddr == config_.addr);
                 state_ = state::finished;
                 break;
@@ -636,8 +669,8 @@ private:
     }
 };
 
-kowned_ptr<ipv4_device> make_ipv4_device(ethernet_device& ethdev) {
-    return kowned_ptr<ipv4_device>{knew<ipv4_ethernet_device>(ethdev).release()};
+kowned_ptr<ipv4_device> make_ipv4_device(ethernet_device& ethdev, int rx_budget) {
+    return kowned_ptr<ipv4_device>{knew<ipv4_ethernet_device>(ethdev, rx_budget).release()};
 }
 
 bool do_dhcp(ipv4_device& ipv4dev_, should_quit_function_type should_quit)
@@ -670,7 +703,7 @@ public:
         if (is_done()) {
             return result::done;
         }
-        if (timeout_ && !--timeout_) {
+        if (retransmit_.expired()) {
             on_timeout();
             return result::timeout;
         }
@@ -682,9 +715,9 @@ private:
     const ipv4_address     remote_addr_;
     kowned_ptr<udp_socket> s_;
     uint8_t                buffer_[4 + tftp::block_size]; // DATA 2 byte code, 2 byte block number + data bytes
-    uint32_t               timeout_;
+    deadline               retransmit_;
 
-    static constexpr uint32_t default_timeout = 50;
+    static constexpr uint64_t retransmit_ms = 2000;
 
 protected:
     uint8_t* start_packet(tftp::opcode op) {
@@ -693,7 +726,7 @@ protected:
 
     void send_packet(const uint8_t* b) {
         s_->sendto(remote_addr_, tftp::dst_port, buffer_, static_cast<uint16_t>(b - buffer_));
-        timeout_ = default_timeout;
+        retransmit_.arm_after_ms(retransmit_ms);
     }
 
 private:
@@ -708,7 +741,7 @@ private:
             {
                 const auto error_code = tftp::get_u16(data, length);
                 const auto error_msg  = tftp::get_string(data, length);
-                dbgout() << "[tftp] Error " << error_code << ": " << error_msg << "\n";
+                LOG(tftp, error) << "Error " << error_code << ": " << error_msg << "\n";
                 REQUIRE(false); // TODO: Handle errors
                 break;
             }
@@ -748,7 +781,7 @@ private:
     bool             done_;
 
     void send_rrq() {
-        dbgout() << "[tftp] Sending RRQ for " << filename_ << "\n";
+        LOG(tftp, info) << "Sending RRQ for " << filename_ << "\n";
         done_ = false;
         last_block_ = 0;
         data_.clear();
@@ -769,7 +802,7 @@ private:
     }
 
     virtual void on_timeout() override {
-        dbgout() << "[tftp] Timed out! Last block " << last_block_ << "\n";
+        LOG(tftp, info) << "Timed out! Last block " << last_block_ << "\n";
         if (!last_block_) {
             send_rrq();
         } else {
@@ -780,13 +813,14 @@ private:
     virtual bool on_packet(tftp::opcode opcode, const uint8_t* data, uint32_t length) override {
         if (opcode != tftp::opcode::data) return false;
         const auto block_number = tftp::get_u16(data, length);
-        dbgout() << "[tftp] Got Data #" << block_number << ":\n";
+        trace(log_category::tftp, "data", block_number, length);
+        LOG(tftp, debug) << "Got Data #" << block_number << "\n";
         REQUIRE(block_number - 1 == last_block_);
         data_.insert(data_.end(), data, data + length);
         last_block_ = block_number;
         send_ack(block_number);
         if (length != tftp::block_size) {
-            dbgout() << "[tftp] Read of " << filename_ << " done!\n";
+            LOG(tftp, info) << "Read of " << filename_ << " done!\n";
             done_ = true;
         }
         return true;
@@ -817,7 +851,7 @@ private:
     }
 
     void send_wrq() {
-        dbgout() << "[tftp] Sending WRQ for " << filename_ << "\n";
+        LOG(tftp, info) << "Sending WRQ for " << filename_ << "\n";
         last_ack_ = no_acks;
         auto b = start_packet(tftp::opcode::wrq);
         b = tftp::put(b, filename_);
@@ -826,7 +860,8 @@ private:
     }
 
     void send_data(uint16_t block_number) {
-        dbgout() << "[tftp] Sending block " << block_number << " of " << filename_ << "\n";
+        trace(log_category::tftp, "send block", block_number);
+        LOG(tftp, debug) << "Sending block " << block_number << " of " << filename_ << "\n";
         REQUIRE(block_number >= 1 && block_number <= block_count());
         const auto index = (block_number-1) * tftp::block_size;
         const auto size  = std::min(static_cast<uint64_t>(tftp::block_size), data_.size() - index);
@@ -842,7 +877,7 @@ private:
     }
 
     virtual void on_timeout() override {
-        dbgout() << "[tftp] Timed out! Last ack " << last_ack_ << "\n";
+        LOG(tftp, info) << "Timed out! Last ack " << last_ack_ << "\n";
         if (last_ack_ == no_acks) {
             send_wrq();
         } else if (last_ack_ < block_count()) {
@@ -855,13 +890,14 @@ private:
     virtual bool on_packet(tftp::opcode opcode, const uint8_t* data, uint32_t length) override {
         if (opcode != tftp::opcode::ack) return false;
         const auto block_number = tftp::get_u16(data, length);
-        dbgout() << "[tftp] Got ACK #" << block_number << ":\n";
+        trace(log_category::tftp, "ack", block_number);
+        LOG(tftp, debug) << "Got ACK #" << block_number << "\n";
         REQUIRE(block_number <= block_count());
         last_ack_ = block_number;
         if (block_number < block_count()) {
             send_data(last_ack_ + 1);
         } else {
-            dbgout() << "[tftp] Write of " << filename_ << " done!\n";
+            LOG(tftp, info) << "Write of " << filename_ << " done!\n";
         }
         return true;
     }
@@ -9,7 +9,12 @@
 namespace attos { namespace net {
 
 using should_quit_function_type = function<bool ()>;
-kowned_ptr<ipv4_device> make_ipv4_device(ethernet_device& ethdev);
+
+// The most frames handled each time the device is polled. The rest wait for the next poll, so one busy device
+// can't hold up everything else.
+constexpr int default_rx_budget = 16;
+
+kowned_ptr<ipv4_device> make_ipv4_device(ethernet_device& ethdev, int rx_budget = default_rx_budget);
 bool do_dhcp(ipv4_device& ipv4dev, should_quit_function_type should_quit);
 
 } }
@@ -22,6 +22,22 @@ enum class syscall_number : uint64_t {
     process_exit_code,
 
     mem_map_info,
+
+    wait,   // Blocks until the object has data (returns 1) or the timeout (in ms, 0 = none) expires (returns 0)
+    monotonic_ns,
+
+    ring_enter, // Runs the operations queued in a ring (see ring_buffer), returns the number run
+
+    // Zero-copy receive on an "ethdev" handle. Its receive buffers (ethdev_rx_buffer_size bytes each) are mapped
+    // read-only into the process, see mem_map_info.
+    ethdev_receive, // Lends the next frame to the process, returns ethdev_rx_frame(buffer index, length, verified checksums) or 0 if there are none
+    ethdev_release, // Returns a lent buffer (by index) so it can be reused by the device
+
+    // Kernel logging (see attos/log.h)
+    trace_dump, // Prints the kernel's trace buffer
+    log_level,  // Sets the log level of a category (log_category::count for all) to a log_level, returns the previous one
+
+    count // Must be last
 };
 
 struct mem_map_info {
@@ -30,5 +46,51 @@ struct mem_map_info {
     memory_type     type;
 };
 
+constexpr uint32_t ethdev_rx_buffer_size = 2048;
+
+// `verified' holds the net::checksum_offload bits of the checksums the device has checked
+constexpr uint64_t ethdev_rx_frame(uint32_t index, uint32_t length, uint32_t verified) {
+    return length | static_cast<uint64_t>(verified & 0xffff) << 16 | static_cast<uint64_t>(index) << 32;
+}
+constexpr uint32_t ethdev_rx_frame_index(uint64_t frame) {
+    return static_cast<uint32_t>(frame >> 32);
+}
+constexpr uint32_t ethdev_rx_frame_length(uint64_t frame) {
+    return static_cast<uint32_t>(frame & 0xffff);
+}
+constexpr uint32_t ethdev_rx_frame_verified(uint64_t frame) {
+    return static_cast<uint32_t>((frame >> 16) & 0xffff);
+}
+
+// An operation queued in a ring: any syscall that doesn't switch processes (e.g. read or write) other than
+// destroy and ring_enter. Other operations complete with ring_error.
+struct ring_submission {
+    syscall_number op;
+    uint64_t       args[3];
+    uint64_t       user_data; // Copied to the completion
+};
+
+struct ring_completion {
+    uint64_t user_data;
+    uint64_t result;          // What the syscall returned
+};
+
+constexpr uint32_t ring_entries = 64; // Must be a power of 2
+constexpr uint64_t ring_error   = UINT64_MAX;
+
+// Submission and completion queues shared between a process and the kernel (create "ring", the address is
+// returned by mem_map_info). The process queues operations in `sq' and runs them with one ring_enter syscall,
+// which puts their results in `cq' (stopping early if it's full). The indices wrap around, entries are at
+// index & (ring_entries - 1).
+struct ring_buffer {
+    volatile uint32_t sq_head; // Next submission to run (advanced by the kernel)
+    volatile uint32_t sq_tail; // Next free submission (advanced by the process after filling in the entry)
+    volatile uint32_t cq_head; // Next completion to take (advanced by the process)
+    volatile uint32_t cq_tail; // Next free completion (advanced by the kernel)
+    ring_submission   sq[ring_entries];
+    ring_completion   cq[ring_entries];
+};
+static_assert(sizeof(ring_buffer) <= 4096, "The ring must fit in a page");
+
 } // namespace attos
 #endif
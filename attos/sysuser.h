@@ -35,5 +35,56 @@ inline uint32_t read(sys_handle& h, void* data, uint32_t max) {
     return static_cast<uint32_t>(syscall3(syscall_number::read, h.id(), (uint64_t)data, max));
 }
 
+// Returns true if the object has data, false if `timeout_ms' (0 = wait forever) expired first
+inline bool wait(sys_handle& h, uint64_t timeout_ms = 0) {
+    return syscall2(syscall_number::wait, h.id(), timeout_ms) != 0;
+}
+
+// Batches syscalls through a ring_buffer shared with the kernel
+class sys_ring {
+public:
+    explicit sys_ring() : handle_("ring") {
+        mem_map_info info;
+        syscall2(syscall_number::mem_map_info, handle_.id(), reinterpret_cast<uint64_t>(&info));
+        ring_ = info.addr.in_current_address_space<ring_buffer>();
+    }
+
+    // Queues `op' with up to three arguments, returns false if the submission queue is full
+    bool submit(syscall_number op, uint64_t user_data, uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0) {
+        const uint32_t tail = ring_->sq_tail;
+        if (tail - ring_->sq_head == ring_entries) {
+            return false;
+        }
+        auto& s = ring_->sq[tail & (ring_entries - 1)];
+        s.op        = op;
+        s.args[0]   = arg0;
+        s.args[1]   = arg1;
+        s.args[2]   = arg2;
+        s.user_data = user_data;
+        ring_->sq_tail = tail + 1; // Volatile store, so the entry is written first
+        return true;
+    }
+
+    // Runs the queued operations, returns the number run
+    uint32_t enter() {
+        return static_cast<uint32_t>(syscall1(syscall_number::ring_enter, handle_.id()));
+    }
+
+    // Takes the next completion, returns false if there are none
+    bool complete(ring_completion& c) {
+        const uint32_t head = ring_->cq_head;
+        if (head == ring_->cq_tail) {
+            return false;
+        }
+        c = ring_->cq[head & (ring_entries - 1)];
+        ring_->cq_head = head + 1;
+        return true;
+    }
+
+private:
+    sys_handle   handle_;
+    ring_buffer* ring_;
+};
+
 } // namespace attos
 #endif
@@ -1,6 +1,10 @@
 #ifndef ATTOS_TREE_H
 #define ATTOS_TREE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
 namespace attos {
 
 template<typename Container, typename T>
@@ -12,6 +16,7 @@ struct tree_node {
     tree_node* parent;
     tree_node* left;
     tree_node* right;
+    bool       red;
 };
 
 inline tree_node* minimum_node(tree_node* node) {
@@ -21,6 +26,13 @@ inline tree_node* minimum_node(tree_node* node) {
     return node;
 }
 
+inline tree_node* maximum_node(tree_node* node) {
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
+}
+
 inline tree_node* successor_node(tree_node* node) {
     // We have visitied all the smaller (left) nodes
     // and `node' and want the successor
@@ -43,55 +55,72 @@ inline tree_node* successor_node(tree_node* node) {
     return parent;
 }
 
-namespace detail {
-
-// Updates the parent of `removed_node' to point to `replacement_node'
-inline void update_parent_of(tree_node& removed_node, tree_node* replacement_node) {
-    if (removed_node.parent) {
-        if (removed_node.parent->left == &removed_node) {
-            removed_node.parent->left = replacement_node;
-        } else {
-            assert(removed_node.parent->right == &removed_node);
-            removed_node.parent->right = replacement_node;
-        }
+inline tree_node* predecessor_node(tree_node* node) {
+    // Mirror image of successor_node
+    if (!node) {
+        return nullptr;
+    }
+    if (node->left) {
+        return maximum_node(node->left);
     }
+    tree_node* parent;
+    while ((parent = node->parent) != nullptr && parent->left == node) {
+        node = parent;
+    }
+    assert(!parent || parent->right == node);
+    return parent;
 }
 
-inline void reparent_child_nodes(tree_node& n)
-{
-    if (n.left) n.left->parent = &n;
-    if (n.right) n.right->parent = &n;
+namespace detail {
+
+inline bool is_red(const tree_node* n) {
+    return n && n->red;
 }
 
 #ifdef ATTOS_CHECK_TREE
-inline void check_tree(tree_node* root) {
-    if (!root) return;
+// Checks the links and the red-black properties, returns the black height
+inline int check_tree(tree_node* root) {
+    if (!root) return 1;
     if (root->left) {
         assert(root->left->parent == root);
-        check_tree(root->left);
     }
     if (root->right) {
         assert(root->right->parent == root);
-        check_tree(root->right);
     }
+    assert(!root->red || (!is_red(root->left) && !is_red(root->right)));
+    const int left_height = check_tree(root->left);
+    const int right_height = check_tree(root->right);
+    assert(left_height == right_height);
+    return left_height + (root->red ? 0 : 1);
 }
 #else
-inline void check_tree(tree_node*) {}
+inline int check_tree(tree_node*) { return 0; }
 #endif
 
 } // namespace detail
 
+// Augments do nothing by default. An Augment is called with a node whenever its children changed
+// (and after they have been updated themselves) to allow per-subtree information to be maintained.
+struct no_augment {
+    static void update(tree_node&) {}
+};
 
-template<typename Container, tree_node Container::*Field, typename Compare>
+// Intrusive red-black tree. Equal elements are kept in insertion order.
+template<typename Container, tree_node Container::*Field, typename Compare, typename Augment = no_augment>
 class tree {
 public:
     explicit tree() {}
     ~tree() {
-        detail::check_tree(root_);
+        check();
     }
 
     void insert(Container& c) {
-        do_insert(&root_, node(c));
+        auto& n = node(c);
+        do_insert(&root_, n);
+        n.red = true;
+        update_to_root(&n);
+        insert_fixup(&n);
+        check();
     }
 
     tree_node* debug_get_root() { return root_; }
@@ -106,6 +135,12 @@ public:
             return *this;
         }
 
+        // Decrementing the first element gives end()
+        iterator& operator--() {
+            node_ = predecessor_node(node_);
+            return *this;
+        }
+
         auto* operator->() {
             return &containing_record(*node_, Field);
         }
@@ -124,94 +159,48 @@ public:
 
     iterator begin() { return iterator{minimum_node(root_)}; }
     iterator end() { return iterator{}; }
+    // Returns an iterator to the largest element, or end() if the tree is empty
+    iterator last() { return iterator{maximum_node(root_)}; }
 
     void remove(Container& c) {
-        auto& node = tree::node(c);
-        tree_node* replacement_node = nullptr;
-        for (;;) {
-            if (node.left) {
-                if (node.right) {
-                    // We have 2 children, swap places with our inorder successor and retry
-                    auto successor = successor_node(&node);
-                    assert(successor);
-
-                    // Handle corner case
-                    if (successor == node.right) {
-                        // The successor is our right child
-                        assert(successor->parent == &node);
-
-                        // Update our parent
-                        detail::update_parent_of(node, successor);
-                        // The successor gets our parent
-                        successor->parent = node.parent;
-
-                        // The left child is easy
-                        std::swap(node.left, successor->left);
-
-                        // Grab the right child of the successor
-                        node.right = successor->right;
-
-                        // We're now the successors right child
-                        successor->right = &node;
-
-                    } else {
-                        // The successor is some other node (it can't be our left child)
-                        // and it can't be our parent, because the only way it can be our
-                        // direct parent is if we don't have any right child (in case we
-                        // wouldn't be in this code path)
-                        assert(successor != node.left);
-                        assert(successor != node.parent);
-
-                        // Update the parents
-                        detail::update_parent_of(*successor, &node);
-                        detail::update_parent_of(node, successor);
-
-                        // Swap children
-                        std::swap(node.left, successor->left);
-                        std::swap(node.right, successor->right);
-
-                        // Swap parents
-                        std::swap(node.parent, successor->parent);
-                    }
-
-                    // Update the children
-                    detail::reparent_child_nodes(node);
-                    detail::reparent_child_nodes(*successor);
-
-                    // Check if we were the root node
-                    if (&node == root_) {
-                        root_ = successor;
-                    }
-
-                    // Continue search
-                } else {
-                    // Only left child
-                    std::swap(replacement_node, node.left);
-                    break;
-                }
-            } else if (node.right) {
-                // Only right child
-                std::swap(replacement_node, node.right);
-                break;
+        auto& z = node(c);
+        tree_node* x;          // The node moving into the removed position (may be null)
+        tree_node* x_parent;   // and its parent
+        bool removed_red = z.red;
+        if (!z.left) {
+            x = z.right;
+            x_parent = z.parent;
+            transplant(z, z.right);
+        } else if (!z.right) {
+            x = z.left;
+            x_parent = z.parent;
+            transplant(z, z.left);
+        } else {
+            // Two children, the inorder successor takes our place
+            auto y = minimum_node(z.right);
+            removed_red = y->red;
+            x = y->right;
+            if (y->parent == &z) {
+                x_parent = y;
             } else {
-                // No children - Simply unhook from parent
-                break;
+                x_parent = y->parent;
+                transplant(*y, y->right);
+                y->right = z.right;
+                y->right->parent = y;
             }
+            transplant(z, y);
+            y->left = z.left;
+            y->left->parent = y;
+            y->red = z.red;
         }
-        assert(node.left == nullptr);
-        assert(node.right == nullptr);
-
-        // Unlink from parent
-        detail::update_parent_of(node, replacement_node);
-        // Link new node to parent
-        if (replacement_node) {
-            replacement_node->parent = node.parent;
-        }
-        // Update root if necessary
-        if (root_ == &node) {
-            root_ = replacement_node;
+        z.parent = z.left = z.right = nullptr;
+        z.red = false;
+
+        update_to_root(x_parent);
+        if (!removed_red) {
+            remove_fixup(x, x_parent);
         }
-        node.parent = nullptr;
+        check();
     }
 
     // Returns an iterator pointing to the first element that compares not less than key
@@ -246,9 +235,23 @@ public:
         return iterator{res};
     }
 
-private:
+protected:
+    static iterator make_iterator(tree_node* n) {
+        return iterator{n};
+    }
+
+    static constexpr Container& container(tree_node& n) {
+        return containing_record(n, Field);
+    }
+
     tree_node* root_ = nullptr;
 
+private:
+    void check() {
+        assert(!detail::is_red(root_));
+        detail::check_tree(root_);
+    }
+
     static void do_insert(tree_node** root, tree_node& node) {
         assert(node.parent == nullptr);
         assert(node.left   == nullptr);
@@ -266,11 +269,208 @@ private:
         *root = &node;
     }
 
+    static void update_to_root(tree_node* n) {
+        for (; n; n = n->parent) {
+            Augment::update(*n);
+        }
+    }
+
+    // Replaces the subtree rooted at `u' with the one rooted at `v'
+    void transplant(tree_node& u, tree_node* v) {
+        if (!u.parent) {
+            root_ = v;
+        } else if (u.parent->left == &u) {
+            u.parent->left = v;
+        } else {
+            assert(u.parent->right == &u);
+            u.parent->right = v;
+        }
+        if (v) {
+            v->parent = u.parent;
+        }
+    }
+
+    // x with right child y becomes y's left child, y's left subtree becomes x's right subtree
+    void rotate_left(tree_node* x) {
+        auto y = x->right;
+        x->right = y->left;
+        if (y->left) {
+            y->left->parent = x;
+        }
+        transplant(*x, y);
+        y->left = x;
+        x->parent = y;
+        Augment::update(*x);
+        Augment::update(*y);
+    }
+
+    void rotate_right(tree_node* x) {
+        auto y = x->left;
+        x->left = y->right;
+        if (y->right) {
+            y->right->parent = x;
+        }
+        transplant(*x, y);
+        y->right = x;
+        x->parent = y;
+        Augment::update(*x);
+        Augment::update(*y);
+    }
+
+    void insert_fixup(tree_node* z) {
+        while (detail::is_red(z->parent)) {
+            auto p = z->parent;
+            auto g = p->parent; // The parent is red, so it's not the root
+            if (p == g->left) {
+                auto u = g->right;
+                if (detail::is_red(u)) {
+                    p->red = u->red = false;
+                    g->red = true;
+                    z = g;
+                } else {
+                    if (z == p->right) {
+                        z = p;
+                        rotate_left(z);
+                        p = z->parent;
+                    }
+                    p->red = false;
+                    g->red = true;
+                    rotate_right(g);
+                }
+            } else {
+                auto u = g->left;
+                if (detail::is_red(u)) {
+                    p->red = u->red = false;
+                    g->red = true;
+                    z = g;
+                } else {
+                    if (z == p->left) {
+                        z = p;
+                        rotate_right(z);
+                        p = z->parent;
+                    }
+                    p->red = false;
+                    g->red = true;
+                    rotate_left(g);
+                }
+            }
+        }
+        root_->red = false;
+    }
+
+    // `x' (possibly null) is one black node short compared to its sibling
+    void remove_fixup(tree_node* x, tree_node* parent) {
+        while (x != root_ && !detail::is_red(x)) {
+            if (x == parent->left) {
+                auto w = parent->right;
+                if (w->red) {
+                    w->red = false;
+                    parent->red = true;
+                    rotate_left(parent);
+                    w = parent->right;
+                }
+                if (!detail::is_red(w->left) && !detail::is_red(w->right)) {
+                    w->red = true;
+                    x = parent;
+                    parent = x->parent;
+                } else {
+                    if (!detail::is_red(w->right)) {
+                        w->left->red = false;
+                        w->red = true;
+                        rotate_right(w);
+                        w = parent->right;
+                    }
+                    w->red = parent->red;
+                    parent->red = false;
+                    w->right->red = false;
+                    rotate_left(parent);
+                    x = root_;
+                }
+            } else {
+                auto w = parent->left;
+                if (w->red) {
+                    w->red = false;
+                    parent->red = true;
+                    rotate_right(parent);
+                    w = parent->left;
+                }
+                if (!detail::is_red(w->left) && !detail::is_red(w->right)) {
+                    w->red = true;
+                    x = parent;
+                    parent = x->parent;
+                } else {
+                    if (!detail::is_red(w->left)) {
+                        w->right->red = false;
+                        w->red = true;
+                        rotate_left(w);
+                        w = parent->left;
+                    }
+                    w->red = parent->red;
+                    parent->red = false;
+                    w->left->red = false;
+                    rotate_right(parent);
+                    x = root_;
+                }
+            }
+        }
+        if (x) {
+            x->red = false;
+        }
+    }
+
     static constexpr tree_node& node(Container& t) {
         return t.*Field;
     }
 };
 
+// Keeps the largest end of each subtree in the container. Traits must provide
+//   using compare = ...;                  // Ordering by start
+//   static uint64_t start(const Container&);
+//   static uint64_t end(const Container&);  // One past the last element of the interval
+//   static uint64_t& max_end(Container&);
+template<typename Container, tree_node Container::*Field, typename Traits>
+struct interval_augment {
+    static void update(tree_node& n) {
+        auto& c = containing_record(n, Field);
+        uint64_t m = Traits::end(c);
+        if (n.left && Traits::max_end(containing_record(*n.left, Field)) > m) {
+            m = Traits::max_end(containing_record(*n.left, Field));
+        }
+        if (n.right && Traits::max_end(containing_record(*n.right, Field)) > m) {
+            m = Traits::max_end(containing_record(*n.right, Field));
+        }
+        Traits::max_end(c) = m;
+    }
+};
+
+// Intrusive interval tree, ordered by start and augmented with the maximum end of each subtree
+template<typename Container, tree_node Container::*Field, typename Traits>
+class interval_tree : public tree<Container, Field, typename Traits::compare, interval_augment<Container, Field, Traits>> {
+public:
+    // Returns an iterator to the element with the lowest start overlapping [start; limit) or end() if there is none
+    auto find_overlap(uint64_t start, uint64_t limit) {
+        assert(start < limit);
+        tree_node* n = this->root_;
+        while (n) {
+            if (n->left && Traits::max_end(this->container(*n->left)) > start) {
+                // If nothing in the left subtree overlaps, one of its intervals ends after
+                // `start' but begins at or after `limit', and so does everything to the right of it.
+                n = n->left;
+                continue;
+            }
+            auto& c = this->container(*n);
+            if (Traits::start(c) >= limit) {
+                break;
+            }
+            if (Traits::end(c) > start) {
+                return this->make_iterator(n);
+            }
+            n = n->right;
+        }
+        return this->end();
+    }
+};
+
 } // namespace attos
 
 #endif
@@ -0,0 +1,5 @@
+@setlocal
+@pushd %~dp0
+cl /EHsc /W4 /WX /O2 /Zi /I..\..\ heap_bench.cpp ..\..\attos\attos_host.lib || exit /b 1
+@endlocal
+@popd
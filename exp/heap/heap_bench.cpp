@@ -0,0 +1,195 @@
+#include <attos/mem.h>
+#include <attos/cpu.h>
+#include <attos/magazine.h>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <memory>
+#include <thread>
+
+using namespace attos;
+
+// What default_heap used to be: every request goes straight to the first-fit simple_heap
+class first_fit_heap {
+public:
+    static constexpr uint64_t align = default_heap::align;
+
+    explicit first_fit_heap(uint8_t* base, uint64_t length) : heap_(base, length) {
+    }
+
+    void* alloc(uint64_t size) {
+        size = round_up(size + align, align);
+        auto ptr = heap_.alloc(size);
+        reinterpret_cast<uint64_t*>(ptr)[0] = size;
+        return ptr + align;
+    }
+
+    void free(void* ptr) {
+        auto p = static_cast<uint8_t*>(ptr) - align;
+        heap_.free(p, reinterpret_cast<const uint64_t*>(p)[0]);
+    }
+
+private:
+    simple_heap heap_;
+};
+
+constexpr uint64_t arena_size = 64 << 20;
+
+struct operation {
+    uint32_t slot;
+    uint32_t size; // 0 = free
+};
+
+// Random mix of mostly small allocations (kvector growth, knew'ed objects) with the occasional large buffer
+std::vector<operation> make_workload(uint32_t live_slots, uint32_t count) {
+    std::mt19937 rng{42};
+    std::uniform_int_distribution<uint32_t> slot_dist{0, live_slots - 1};
+    std::uniform_int_distribution<uint32_t> small_dist{1, 256};
+    std::uniform_int_distribution<uint32_t> medium_dist{257, 4000};
+    std::uniform_int_distribution<uint32_t> large_dist{4097, 64 << 10};
+    std::uniform_int_distribution<uint32_t> kind_dist{0, 99};
+
+    std::vector<bool> used(live_slots);
+    std::vector<operation> ops;
+    ops.reserve(count + live_slots);
+    for (uint32_t i = 0; i < count; ++i) {
+        const auto slot = slot_dist(rng);
+        if (used[slot]) {
+            ops.push_back(operation{slot, 0});
+        } else {
+            const auto kind = kind_dist(rng);
+            ops.push_back(operation{slot, kind < 85 ? small_dist(rng) : kind < 99 ? medium_dist(rng) : large_dist(rng)});
+        }
+        used[slot] = !used[slot];
+    }
+    for (uint32_t slot = 0; slot < live_slots; ++slot) {
+        if (used[slot]) ops.push_back(operation{slot, 0});
+    }
+    return ops;
+}
+
+template<typename Heap>
+double run(const std::vector<operation>& ops, uint32_t live_slots) {
+    std::unique_ptr<uint8_t[]> arena{new uint8_t[arena_size]};
+    std::vector<void*> slots(live_slots);
+    const auto start = std::chrono::high_resolution_clock::now();
+    {
+        Heap heap{arena.get(), arena_size};
+        for (const auto& op : ops) {
+            if (op.size) {
+                slots[op.slot] = heap.alloc(op.size);
+                *static_cast<uint8_t*>(slots[op.slot]) = 1;
+            } else {
+                heap.free(slots[op.slot]);
+            }
+        }
+    }
+    const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ops.size();
+}
+
+// Kernel heap as it is without per-CPU caches: every CPU serializes on one lock
+class locked_heap {
+public:
+    explicit locked_heap(default_heap& heap, uint32_t) : heap_(heap) {
+    }
+
+    void* alloc(uint32_t, uint64_t size) {
+        spinlock_guard lock{lock_};
+        return heap_.alloc(size);
+    }
+
+    void free(uint32_t, void* ptr) {
+        spinlock_guard lock{lock_};
+        heap_.free(ptr);
+    }
+
+private:
+    default_heap& heap_;
+    spinlock      lock_;
+};
+
+// Each thread stands in for a CPU and runs its own random alloc/free mix. Every 16th block is handed to the next
+// thread to free, like a packet buffer allocated by one CPU and consumed by another.
+template<typename Cache>
+double run_threaded(uint32_t thread_count, uint32_t ops_per_thread) {
+    constexpr uint32_t live_slots = 1024;
+    std::unique_ptr<uint8_t[]> arena{new uint8_t[arena_size]};
+    default_heap heap{arena.get(), arena_size};
+    std::unique_ptr<Cache> cache{new Cache{heap, thread_count}};
+
+    struct alignas(64) handoff {
+        spinlock           lock;
+        std::vector<void*> blocks;
+    };
+    std::unique_ptr<handoff[]> handoffs{new handoff[thread_count]};
+
+    auto worker = [&](uint32_t cpu) {
+        std::mt19937 rng{cpu};
+        std::vector<void*> slots(live_slots);
+        std::vector<void*> incoming;
+        auto& next = handoffs[(cpu + 1) % thread_count];
+        for (uint32_t i = 0; i < ops_per_thread; ++i) {
+            auto& slot = slots[rng() % live_slots];
+            if (slot) {
+                if (i % 16 == 0) {
+                    spinlock_guard lock{next.lock};
+                    next.blocks.push_back(slot);
+                } else {
+                    cache->free(cpu, slot);
+                }
+                slot = nullptr;
+            } else {
+                slot = cache->alloc(cpu, 16 + rng() % 256);
+            }
+            if (i % 256 == 0) {
+                {
+                    spinlock_guard lock{handoffs[cpu].lock};
+                    incoming.swap(handoffs[cpu].blocks);
+                }
+                for (auto p : incoming) cache->free(cpu, p);
+                incoming.clear();
+            }
+        }
+        for (auto p : slots) {
+            if (p) cache->free(cpu, p);
+        }
+    };
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t cpu = 0; cpu < thread_count; ++cpu) {
+        threads.emplace_back(worker, cpu);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+    for (uint32_t cpu = 0; cpu < thread_count; ++cpu) {
+        for (auto p : handoffs[cpu].blocks) cache->free(cpu, p);
+    }
+    cache.reset();
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ops_per_thread;
+}
+
+int main() {
+    constexpr uint32_t op_count = 2'000'000;
+    std::cout << std::setw(10) << "live" << std::setw(18) << "first-fit ns/op" << std::setw(18) << "size-class ns/op" << "\n";
+    for (const uint32_t live_slots : { 16, 256, 4096, 16384 }) {
+        const auto ops = make_workload(live_slots, op_count);
+        const auto ff = run<first_fit_heap>(ops, live_slots);
+        const auto sc = run<default_heap>(ops, live_slots);
+        std::cout << std::setw(10) << live_slots << std::fixed << std::setprecision(1) << std::setw(18) << ff << std::setw(18) << sc << "\n";
+    }
+
+    constexpr uint32_t ops_per_thread = 2'000'000;
+    std::cout << "\n" << std::setw(10) << "threads" << std::setw(18) << "locked ns/op" << std::setw(18) << "magazine ns/op" << "\n";
+    for (const uint32_t thread_count : { 1, 2, 4, 8 }) {
+        const auto locked = run_threaded<locked_heap>(thread_count, ops_per_thread);
+        const auto mag    = run_threaded<magazine_cache>(thread_count, ops_per_thread);
+        std::cout << std::setw(10) << thread_count << std::fixed << std::setprecision(1) << std::setw(18) << locked << std::setw(18) << mag << "\n";
+    }
+}
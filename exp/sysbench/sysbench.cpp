@@ -0,0 +1,34 @@
+// Syscall micro-benchmark. Start it from userexe with "X SYSBENCH" (it's loaded over TFTP).
+#include <attos/out_stream.h>
+#include <attos/cpu.h>
+#include <attos/sysuser.h>
+
+using namespace attos;
+
+// Prints the cycles per call of `f' (kernel entry, the handler and the return to user mode)
+template<typename F>
+void measure(const char* name, uint64_t rounds, F f)
+{
+    uint64_t min = UINT64_MAX, total = 0;
+    for (uint64_t i = 0; i < rounds; ++i) {
+        const auto start = __rdtsc();
+        f();
+        const auto cycles = __rdtsc() - start;
+        min = cycles < min ? cycles : min;
+        total += cycles;
+    }
+    dbgout() << name << ": min " << min << " avg " << total / rounds << " cycles\n";
+}
+
+int main()
+{
+    constexpr uint64_t rounds = 1000;
+    sys_handle kbd{"keyboard"};
+
+    // Handled on the fast path
+    measure("debug_print (empty)", rounds, []() { syscall2(syscall_number::debug_print, reinterpret_cast<uint64_t>(""), 0); });
+    measure("monotonic_ns", rounds, []() { syscall0(syscall_number::monotonic_ns); });
+    measure("read (keyboard, 0 bytes)", rounds, [&kbd]() { read(kbd, nullptr, 0); });
+
+    return 0;
+}
@@ -1,5 +1,9 @@
 #include <assert.h>
 #include <attos/containers.h>
+#include <vector>
+#include <string.h>
+#include <random>
+#include <malloc.h>
 
 #define CATCH_CONFIG_MAIN
 #include "../catch.hpp"
@@ -146,3 +150,222 @@ TEST_CASE("kvector<movable_obj>") {
         REQUIRE(v.back().id == 1099);
     }
 }
+
+TEST_CASE("size_class_heap") {
+    using attos::size_class_heap;
+    REQUIRE(size_class_heap::class_size(1) == 32);
+    REQUIRE(size_class_heap::class_size(32) == 32);
+    REQUIRE(size_class_heap::class_size(33) == 48);
+    REQUIRE(size_class_heap::class_size(48) == 48);
+    REQUIRE(size_class_heap::class_size(49) == 64);
+    REQUIRE(size_class_heap::class_size(100) == 128);
+    REQUIRE(size_class_heap::class_size(3000) == 3072);
+    REQUIRE(size_class_heap::class_size(4096) == 4096);
+}
+
+TEST_CASE("default_heap") {
+    alignas(16) static uint8_t arena[1<<20];
+    attos::default_heap heap{arena, sizeof(arena)};
+    std::vector<uint8_t*> ptrs;
+    for (uint64_t size = 1; size < 20000; size = size * 3 / 2 + 1) {
+        auto p = static_cast<uint8_t*>(heap.alloc(size));
+        REQUIRE(p >= arena);
+        REQUIRE(p + size <= arena + sizeof(arena));
+        REQUIRE(reinterpret_cast<uintptr_t>(p) % attos::default_heap::align == 0);
+        memset(p, static_cast<int>(ptrs.size()), size);
+        ptrs.push_back(p);
+    }
+    for (size_t i = 0; i < ptrs.size(); ++i) {
+        REQUIRE(ptrs[i][0] == static_cast<uint8_t>(i));
+    }
+
+    SECTION("freed blocks are reused") {
+        auto p = heap.alloc(40);
+        heap.free(p);
+        REQUIRE(heap.alloc(40) == p);
+        heap.free(p);
+    }
+
+    for (auto p : ptrs) {
+        heap.free(p);
+    }
+}
+
+TEST_CASE("buddy_allocator") {
+    using attos::buddy_allocator;
+    constexpr uint64_t page_size = buddy_allocator::page_size;
+    constexpr uint64_t mb = 1 << 20;
+
+    // Memory map of a 32 MB machine as returned by the BIOS (see smap_entry in kernel.cpp)
+    struct smap_entry {
+        uint64_t base;
+        uint64_t length;
+        uint32_t type; // 1 = available
+    };
+    const smap_entry smap[] = {
+        { 0x00000000, 0x0009fc00, 1 },
+        { 0x0009fc00, 0x00000400, 2 },
+        { 0x000f0000, 0x00010000, 2 },
+        { 0x00100000, 0x01ee0000, 1 },
+        { 0x01fe0000, 0x00020000, 2 },
+        { 0xfffc0000, 0x00040000, 2 },
+    };
+
+    // Pick a region the same way construct_mm does
+    const smap_entry* region = nullptr;
+    for (const auto& e : smap) {
+        if (e.type == 1 && e.base >= 1 * mb && e.length >= 4 * mb) {
+            region = &e;
+            break;
+        }
+    }
+    REQUIRE(region);
+
+    // Simulate physical memory with a buffer aligned like physical address 0
+    constexpr uint64_t max_align = 8 * mb;
+    std::vector<uint8_t> memory(region->base + region->length + max_align);
+    uint8_t* const phys0 = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(memory.data()) + max_align - 1) & ~(max_align - 1));
+    auto phys = [phys0](const uint8_t* p) { return static_cast<uint64_t>(p - phys0); };
+
+    buddy_allocator buddy{phys0 + region->base, region->length};
+    const auto initial_free = buddy.free_bytes();
+    REQUIRE(initial_free == buddy.managed_bytes());
+    REQUIRE(initial_free >  region->length - 64 * 1024);
+    REQUIRE(initial_free <= region->length);
+
+    SECTION("single pages") {
+        auto p = buddy.alloc(1);
+        REQUIRE(phys(p) >= region->base);
+        REQUIRE(phys(p) % page_size == 0);
+        REQUIRE(buddy.free_bytes() == initial_free - page_size);
+        buddy.free(p, 1);
+        REQUIRE(buddy.free_bytes() == initial_free);
+    }
+
+    SECTION("2 MB blocks are naturally aligned") {
+        std::vector<uint8_t*> blocks;
+        while (buddy.free_bytes() >= 4 * mb) {
+            auto p = buddy.alloc(2 * mb);
+            REQUIRE(phys(p) % (2 * mb) == 0);
+            REQUIRE(phys(p) >= region->base);
+            REQUIRE(phys(p) + 2 * mb <= region->base + region->length);
+            blocks.push_back(p);
+        }
+        // [1 MB; 2 MB) and [30 MB; 31.875 MB) can't hold a 2 MB block
+        REQUIRE(blocks.size() == 14);
+        for (auto p : blocks) {
+            buddy.free(p, 2 * mb);
+        }
+        REQUIRE(buddy.free_bytes() == initial_free);
+    }
+
+    SECTION("odd sizes and partial frees coalesce") {
+        std::mt19937 rng{1234};
+        struct allocation {
+            uint8_t* p;
+            uint64_t size;
+        };
+        std::vector<allocation> allocs;
+        for (int i = 0; i < 1000; ++i) {
+            const uint64_t size = (1 + rng() % 7) * page_size;
+            auto p = buddy.alloc(size);
+            REQUIRE(phys(p) % page_size == 0);
+            memset(p, 0xCC, size);
+            allocs.push_back(allocation{p, size});
+        }
+        std::shuffle(allocs.begin(), allocs.end(), rng);
+        for (const auto& a : allocs) {
+            // Free the last page separately from the rest
+            if (a.size > page_size) {
+                buddy.free(a.p + a.size - page_size, page_size);
+                buddy.free(a.p, a.size - page_size);
+            } else {
+                buddy.free(a.p, a.size);
+            }
+        }
+        REQUIRE(buddy.free_bytes() == initial_free);
+        auto p = buddy.alloc(8 * mb);
+        REQUIRE(phys(p) % (8 * mb) == 0);
+        buddy.free(p, 8 * mb);
+    }
+}
+
+TEST_CASE("default_heap grows") {
+    class test_page_source : public attos::page_source {
+    public:
+        uint64_t live_bytes = 0;
+    private:
+        virtual uint8_t* do_alloc_pages(uint64_t length) override {
+            REQUIRE(length % granularity == 0);
+            live_bytes += length;
+            return static_cast<uint8_t*>(_aligned_malloc(length, granularity));
+        }
+        virtual void do_free_pages(uint8_t* ptr, uint64_t length) override {
+            live_bytes -= length;
+            _aligned_free(ptr);
+        }
+    } pages;
+
+    {
+        alignas(16) static uint8_t arena[64<<10];
+        attos::default_heap heap{arena, sizeof(arena), &pages};
+        std::vector<void*> ptrs;
+        for (int i = 0; i < 100; ++i) {
+            ptrs.push_back(heap.alloc(16<<10));
+        }
+        REQUIRE(pages.live_bytes >= 100 * (16<<10) - sizeof(arena));
+
+        auto large = heap.alloc(1<<20);
+        REQUIRE(reinterpret_cast<uintptr_t>(large) % attos::page_source::granularity == attos::default_heap::align);
+        heap.free(large);
+
+        for (auto p : ptrs) {
+            heap.free(p);
+        }
+    }
+    REQUIRE(pages.live_bytes == 0);
+}
+
+TEST_CASE("simple_heap doesn't merge adjacent regions") {
+    // Hands out consecutive chunks, like the kernel's virtual address allocator usually does
+    class adjacent_page_source : public attos::page_source {
+    public:
+        explicit adjacent_page_source() : storage(17 * granularity) {
+            base = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(storage.data()) + granularity - 1) & ~(granularity - 1));
+        }
+        std::vector<uint8_t> storage;
+        uint8_t* base;
+        uint64_t used = 0;
+        uint64_t live_bytes = 0;
+    private:
+        virtual uint8_t* do_alloc_pages(uint64_t length) override {
+            REQUIRE(used + length <= 16 * granularity);
+            auto p = base + used;
+            used += length;
+            live_bytes += length;
+            return p;
+        }
+        virtual void do_free_pages(uint8_t*, uint64_t length) override {
+            live_bytes -= length;
+        }
+    } pages;
+    const uint64_t g = attos::page_source::granularity;
+
+    {
+        alignas(16) static uint8_t arena[4096];
+        attos::simple_heap heap{arena, sizeof(arena), &pages};
+        auto a = heap.alloc(g);      // Uses up the initial region
+        auto b = heap.alloc(g);      // Grows by g:   [0, g)
+        auto c = heap.alloc(g);      // Grows by 2*g: [g, 3*g)
+        REQUIRE(b == pages.base);
+        REQUIRE(c == pages.base + g);
+        heap.free(b, g);
+        heap.free(c, g);
+        // The free blocks at [0, g) and [g, 3*g) are adjacent but in different regions
+        auto d = heap.alloc(2 * g);
+        REQUIRE(d == pages.base + g);
+        heap.free(d, 2 * g);
+        heap.free(a, g);
+    }
+    REQUIRE(pages.live_bytes == 0);
+}
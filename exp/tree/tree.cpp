@@ -180,6 +180,23 @@ TEST_CASE("more complicated removal") {
     }
 }
 
+TEST_CASE("reverse iteration") {
+    test t1{1}, t2{2}, t2b{2}, t3{3};
+    tree_type t;
+    REQUIRE(t.last() == t.end());
+    t.insert(t2);
+    t.insert(t3);
+    t.insert(t1);
+    t.insert(t2b);
+    vt v;
+    for (auto it = t.last(); it != t.end(); --it) {
+        v.push_back(&*it);
+    }
+    REQUIRE(v == V(t3, t2b, t2, t1));
+    auto it = t.upper_bound(test{2});
+    REQUIRE(&*--it == &t2b);
+}
+
 TEST_CASE("lower_bound") {
     test x3a{3}, x4a{4}, x4b{4}, x4c{4}, x4d{4}, x5a{5}, x7a{7}, x7b{7}, x7c{7}, x7d{7}, x8a{8};
     tree_type t;
@@ -273,3 +290,219 @@ TEST_CASE("overlaps test") {
     REQUIRE_OVERLAPS(10, 20, 29,  1);
     REQUIRE_OVERLAPS(10, 30, 25, 10);
 }
+
+struct interval {
+    explicit interval(uint64_t start = 0, uint64_t length = 1) : start(start), length(length), max_end(0), node() {
+    }
+    interval(const interval&) = delete;
+    interval& operator=(const interval&) = delete;
+
+    uint64_t  start;
+    uint64_t  length;
+    uint64_t  max_end;
+    tree_node node;
+
+    struct traits {
+        struct compare {
+            bool operator()(const interval& l, const interval& r) const {
+                return l.start < r.start;
+            }
+        };
+        static uint64_t start(const interval& i) { return i.start; }
+        static uint64_t end(const interval& i) { return i.start + i.length; }
+        static uint64_t& max_end(interval& i) { return i.max_end; }
+    };
+    using tree_type = interval_tree<interval, &interval::node, traits>;
+};
+
+uint64_t check_max_end(tree_node* n) {
+    if (!n) return 0;
+    auto& i = containing_record(*n, &interval::node);
+    const uint64_t expected = std::max({i.start + i.length, check_max_end(n->left), check_max_end(n->right)});
+    REQUIRE(i.max_end == expected);
+    return expected;
+}
+
+// Returns the black height
+int check_red_black(tree_node* n) {
+    if (!n) return 1;
+    if (n->red) {
+        REQUIRE(!(n->left && n->left->red));
+        REQUIRE(!(n->right && n->right->red));
+    }
+    if (n->left) REQUIRE(n->left->parent == n);
+    if (n->right) REQUIRE(n->right->parent == n);
+    const int height = check_red_black(n->left);
+    REQUIRE(check_red_black(n->right) == height);
+    return height + (n->red ? 0 : 1);
+}
+
+int tree_height(tree_node* n) {
+    return n ? 1 + std::max(tree_height(n->left), tree_height(n->right)) : 0;
+}
+
+const interval* brute_force_overlap(interval::tree_type& t, uint64_t start, uint64_t length) {
+    for (const auto& i : t) {
+        if (memory_areas_overlap(start, length, i.start, i.length)) {
+            return &i;
+        }
+    }
+    return nullptr;
+}
+
+const interval* tree_overlap(interval::tree_type& t, uint64_t start, uint64_t length) {
+    auto it = t.find_overlap(start, start + length);
+    return it == t.end() ? nullptr : &*it;
+}
+
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+
+TEST_CASE("interval_tree randomized") {
+    constexpr int num_intervals = 1000;
+    std::mt19937 rng{42};
+    std::unique_ptr<interval[]> intervals{new interval[num_intervals]};
+    std::vector<bool> present(num_intervals);
+    std::vector<uint64_t> insert_order(num_intervals); // For checking the order of equal elements
+    uint64_t insert_count = 0;
+    interval::tree_type t;
+
+    auto rand_between = [&rng](uint64_t lo, uint64_t hi) { return std::uniform_int_distribution<uint64_t>{lo, hi}(rng); };
+
+    for (int round = 0; round < 20000; ++round) {
+        const int idx = static_cast<int>(rand_between(0, num_intervals - 1));
+        auto& i = intervals[idx];
+        if (present[idx]) {
+            t.remove(i);
+            present[idx] = false;
+            REQUIRE(i.node.parent == nullptr);
+            REQUIRE(i.node.left == nullptr);
+            REQUIRE(i.node.right == nullptr);
+        } else {
+            i.start  = rand_between(0, 10000);
+            i.length = rand_between(1, 200);
+            t.insert(i);
+            present[idx] = true;
+            insert_order[idx] = insert_count++;
+        }
+
+        if (round % 97 == 0) {
+            // Sorted, equal elements in insertion order, and nothing lost
+            size_t count = 0;
+            const interval* prev = nullptr;
+            for (const auto& e : t) {
+                if (prev) {
+                    REQUIRE(prev->start <= e.start);
+                    if (prev->start == e.start) {
+                        REQUIRE(insert_order[prev - intervals.get()] < insert_order[&e - intervals.get()]);
+                    }
+                }
+                prev = &e;
+                ++count;
+            }
+            REQUIRE(count == static_cast<size_t>(std::count(present.begin(), present.end(), true)));
+            REQUIRE(!(t.debug_get_root() && t.debug_get_root()->red));
+            check_red_black(t.debug_get_root());
+            check_max_end(t.debug_get_root());
+            // A red-black tree is at most 2*log2(n+1) high
+            REQUIRE(tree_height(t.debug_get_root()) <= 2 * static_cast<int>(std::ceil(std::log2(count + 1))));
+        }
+
+        const uint64_t qstart = rand_between(0, 10300);
+        const uint64_t qlength = rand_between(1, 100);
+        REQUIRE(tree_overlap(t, qstart, qlength) == brute_force_overlap(t, qstart, qlength));
+    }
+
+    for (int idx = 0; idx < num_intervals; ++idx) {
+        if (present[idx]) {
+            t.remove(intervals[idx]);
+        }
+    }
+    REQUIRE(t.begin() == t.end());
+}
+
+TEST_CASE("interval_tree sequential") {
+    // Sorted insertion degenerates an unbalanced tree into a list
+    constexpr int num_intervals = 4096;
+    std::unique_ptr<interval[]> intervals{new interval[num_intervals]};
+    interval::tree_type t;
+    for (int idx = 0; idx < num_intervals; ++idx) {
+        intervals[idx].start  = idx * 0x1000;
+        intervals[idx].length = 0x1000;
+        t.insert(intervals[idx]);
+    }
+    REQUIRE(tree_height(t.debug_get_root()) <= 2 * 13);
+    check_red_black(t.debug_get_root());
+    check_max_end(t.debug_get_root());
+    REQUIRE(tree_overlap(t, 0x1000 * 100 + 10, 1) == &intervals[100]);
+    REQUIRE(tree_overlap(t, 0x1000 * 100 - 1, 2) == &intervals[99]);
+    REQUIRE(tree_overlap(t, 0x1000 * num_intervals, 1) == nullptr);
+    for (int idx = 0; idx < num_intervals; idx += 2) {
+        t.remove(intervals[idx]);
+    }
+    check_max_end(t.debug_get_root());
+    REQUIRE(tree_overlap(t, 0x1000 * 100, 0x1000) == nullptr);
+    REQUIRE(tree_overlap(t, 0x1000 * 100, 0x1001) == &intervals[101]);
+    for (int idx = 1; idx < num_intervals; idx += 2) {
+        t.remove(intervals[idx]);
+    }
+    REQUIRE(t.debug_get_root() == nullptr);
+}
+
+#include <chrono>
+
+TEST_CASE("interval_tree timing", "[.][benchmark]") {
+    // Page granular mappings like the ones memory_manager_base keeps
+    constexpr int num_mappings = 100000;
+    constexpr int num_queries  = 1000;
+    std::unique_ptr<interval[]> intervals{new interval[num_mappings]};
+    std::vector<int> order(num_mappings);
+    for (int idx = 0; idx < num_mappings; ++idx) {
+        order[idx] = idx;
+        intervals[idx].start  = 0xFFFF8000'00000000ULL + idx * 0x3000ULL;
+        intervals[idx].length = 0x1000ULL << (idx % 2);
+    }
+    std::mt19937 rng{1234};
+    std::shuffle(order.begin(), order.end(), rng);
+
+    using clock = std::chrono::high_resolution_clock;
+    auto ms_since = [](clock::time_point start) { return std::chrono::duration<double, std::milli>(clock::now() - start).count(); };
+
+    interval::tree_type t;
+    auto start = clock::now();
+    for (int idx : order) {
+        t.insert(intervals[idx]);
+    }
+    const double insert_ms = ms_since(start);
+
+    std::vector<uint64_t> queries(num_queries);
+    for (auto& q : queries) {
+        q = intervals[std::uniform_int_distribution<int>{0, num_mappings - 1}(rng)].start + 0x1800;
+    }
+
+    int found = 0;
+    start = clock::now();
+    for (auto q : queries) {
+        found += tree_overlap(t, q, 0x1000) != nullptr;
+    }
+    const double tree_ms = ms_since(start);
+
+    int brute_found = 0;
+    start = clock::now();
+    for (auto q : queries) {
+        brute_found += brute_force_overlap(t, q, 0x1000) != nullptr;
+    }
+    const double brute_ms = ms_since(start);
+    REQUIRE(found == brute_found);
+
+    start = clock::now();
+    for (int idx : order) {
+        t.remove(intervals[idx]);
+    }
+    const double remove_ms = ms_since(start);
+
+    std::cout << num_mappings << " mappings: insert " << insert_ms << " ms, remove " << remove_ms << " ms\n";
+    std::cout << num_queries << " overlap queries: tree " << tree_ms << " ms, linear " << brute_ms << " ms\n";
+}
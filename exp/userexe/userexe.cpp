@@ -3,35 +3,77 @@
 #include <attos/cpu.h>
 #include <attos/string.h>
 #include <attos/sysuser.h>
+#include <attos/log.h>
 
 using namespace attos;
 using namespace attos::net;
 
+mem_map_info get_mem_map_info(const sys_handle& h) {
+    mem_map_info info;
+    syscall2(syscall_number::mem_map_info, h.id(), reinterpret_cast<uint64_t>(&info));
+    return info;
+}
+
 class my_ethernet_device : public ethernet_device {
 public:
-    explicit my_ethernet_device() : handle_("ethdev") {
+    explicit my_ethernet_device()
+        : handle_("ethdev")
+        , rx_map_(get_mem_map_info(handle_))
+        , rx_pool_(rx_map_.addr.in_current_address_space<uint8_t>(), static_cast<uint32_t>(rx_map_.length / ethdev_rx_buffer_size), ethdev_rx_buffer_size, [this](uint32_t index) { release(index); }) {
     }
     virtual ~my_ethernet_device() override {
+        ring_.enter(); // Run the queued releases
     }
 private:
-    sys_handle handle_;
+    static constexpr int      rx_batch = net::default_rx_budget;
+    static constexpr uint64_t tag_release = 0;
+    static constexpr uint64_t tag_receive = 1;
+
+    sys_handle   handle_;
+    sys_ring     ring_;
+    mem_map_info rx_map_;  // The kernel's receive buffers (read-only)
+    packet_pool  rx_pool_;
+
+    // Called when a received frame is no longer referenced. The buffer is handed back on the next kernel entry.
+    void release(uint32_t index) {
+        if (!ring_.submit(syscall_number::ethdev_release, tag_release, handle_.id(), index)) {
+            syscall2(syscall_number::ethdev_release, handle_.id(), index);
+        }
+    }
 
     virtual mac_address do_hw_address() const override {
         mac_address ma;
         syscall2(syscall_number::ethdev_hw_address, handle_.id(), (uint64_t)&ma);
         return ma;
     }
-    virtual void do_send_packet(const void* data, uint32_t length) override {
+    virtual void do_send_packet(const void* data, uint32_t length, checksum_offload insert) override {
+        REQUIRE(insert == checksum_offload::none);
         write(handle_, data, length);
     }
-    virtual void do_process_packets(const packet_process_function& ppf, int max_packets) override {
-        for (int i = 0; i < max_packets; ++i) {
-            uint8_t  buffer[2048];
-            if (const uint32_t len = read(handle_, buffer, sizeof(buffer))) {
-                ppf(buffer, static_cast<uint32_t>(len));
+    virtual void do_receive_packets(const packet_receive_function& prf, int max_packets) override {
+        // Queue the receives after the pending releases and enter the kernel once for all of them.
+        // The frames are read directly from the kernel's buffers.
+        const int count = max_packets < rx_batch ? max_packets : rx_batch;
+        for (int i = 0; i < count && ring_.submit(syscall_number::ethdev_receive, tag_receive, handle_.id()); ++i) {
+        }
+        ring_.enter();
+        ring_completion c;
+        while (ring_.complete(c)) {
+            if (c.user_data == tag_receive && c.result) {
+                prf(rx_pool_.lend(ethdev_rx_frame_index(c.result), ethdev_rx_frame_length(c.result), static_cast<checksum_offload>(ethdev_rx_frame_verified(c.result))));
             }
         }
     }
+    virtual const packet_pool* do_rx_pool() const override {
+        return &rx_pool_;
+    }
+    virtual offload_features do_features() const override {
+        // Frames are sent with write(), which can't ask the kernel's device to insert checksums
+        return { checksum_offload::ipv4 | checksum_offload::udp, checksum_offload::none };
+    }
+    virtual void do_set_receive_notify(const function<void ()>&) override {
+        REQUIRE(!"Not supported. Use wait() on the handle instead");
+    }
 };
 
 class my_keyboard : public singleton<my_keyboard> {
@@ -49,7 +91,7 @@ public:
 
     uint8_t read_key() {
         while (key == no_key) {
-            yield();
+            wait(handle_); // Sleep until there's keyboard input
             poll();
         }
         const auto c = static_cast<uint8_t>(key);
@@ -144,6 +186,16 @@ int main()
                 if (string_equal(cmd.begin(), "EXIT")) {
                     dbgout() << "Exit\n";
                     break;
+                } else if (string_equal(cmd.begin(), "TRACE")) {
+                    dbgout() << "User trace:\n";
+                    trace_dump(dbgout());
+                    dbgout() << "Kernel trace:\n";
+                    syscall0(syscall_number::trace_dump);
+                } else if (cmd.size() == 6 && cmd[0] == 'L' && cmd[1] == 'O' && cmd[2] == 'G' && cmd[3] == ' ' && cmd[4] >= '0' && cmd[4] <= '2') {
+                    // LOG 0 (errors only), 1 (info) or 2 (debug) for all categories
+                    const auto level = static_cast<log_level>(cmd[4] - '0');
+                    log_set_level_all(level);
+                    syscall2(syscall_number::log_level, static_cast<uint64_t>(log_category::count), static_cast<uint64_t>(level));
                 } else if (cmd.size() > 3 && cmd[0] == 'X' && cmd[1] == ' ') {
                     // automatically append .EXE
                     cmd.pop_back();
@@ -0,0 +1,218 @@
+#include "apic.h"
+#include "isr.h"
+#include "mm.h"
+#include <attos/out_stream.h>
+
+namespace attos { namespace apic {
+
+// Local APIC registers
+constexpr uint32_t lapic_reg_id            = 0x020;
+constexpr uint32_t lapic_reg_eoi           = 0x0B0;
+constexpr uint32_t lapic_reg_svr           = 0x0F0; // Spurious interrupt vector register
+constexpr uint32_t lapic_reg_icr_low       = 0x300; // Interrupt command register
+constexpr uint32_t lapic_reg_icr_high      = 0x310;
+constexpr uint32_t lapic_reg_lvt_timer     = 0x320;
+constexpr uint32_t lapic_reg_timer_initial = 0x380;
+constexpr uint32_t lapic_reg_timer_current = 0x390;
+constexpr uint32_t lapic_reg_timer_divide  = 0x3E0;
+
+constexpr uint32_t lapic_svr_enable       = 0x100;
+constexpr uint32_t lapic_icr_send_pending = 0x1000;
+constexpr uint32_t lapic_lvt_masked       = 0x10000;
+constexpr uint32_t lapic_lvt_periodic     = 0x20000;
+constexpr uint32_t lapic_timer_divide_16  = 0x3;
+
+// I/O APIC registers (accessed indirectly through IOREGSEL/IOWIN)
+constexpr uint32_t ioapic_ioregsel       = 0x00;
+constexpr uint32_t ioapic_iowin          = 0x10;
+constexpr uint32_t ioapic_reg_version    = 0x01;
+constexpr uint32_t ioapic_reg_redirect   = 0x10; // Two registers per entry
+
+constexpr uint32_t ioapic_redirect_active_low = 0x2000;
+constexpr uint32_t ioapic_redirect_level      = 0x8000;
+constexpr uint32_t ioapic_redirect_masked     = 0x10000;
+
+constexpr uint64_t msi_address_base = 0xFEE00000;
+
+class controller_impl : public controller, public singleton<controller_impl> {
+public:
+    explicit controller_impl(const config& cfg)
+        : cfg_(cfg)
+        , lapic_(static_cast<volatile uint32_t*>(iomem_map(cfg.local_apic_base, memory_manager::page_size)))
+        , ioapic_(static_cast<volatile uint32_t*>(iomem_map(cfg.io_apic_base, memory_manager::page_size))) {
+        spurious_reg_ = register_vector_handler(spurious_vector, []() {}); // Spurious interrupts aren't acknowledged
+        old_svr_ = lapic_reg(lapic_reg_svr);
+        redirect_count_ = ((ioapic_reg(ioapic_reg_version) >> 16) & 0xFF) + 1;
+        for (uint32_t i = 0; i < redirect_count_; ++i) {
+            write_redirect(i, ioapic_redirect_masked);
+        }
+        enable_local();
+        dbgout() << "[apic] Local APIC id " << as_hex(local_id()) << " I/O APIC with " << redirect_count_ << " inputs at GSI " << cfg_.io_apic_gsi_base << "\n";
+    }
+
+    ~controller_impl() {
+        timer_stop();
+        for (uint32_t i = 0; i < redirect_count_; ++i) {
+            write_redirect(i, ioapic_redirect_masked);
+        }
+        lapic_reg(lapic_reg_svr, old_svr_);
+        spurious_reg_.reset();
+        iomem_unmap(ioapic_, memory_manager::page_size);
+        iomem_unmap(lapic_, memory_manager::page_size);
+    }
+
+    uint32_t local_id() const {
+        return lapic_reg(lapic_reg_id) >> 24;
+    }
+
+    void enable_local() {
+        lapic_reg(lapic_reg_svr, lapic_svr_enable | spurious_vector);
+    }
+
+    void eoi() {
+        lapic_reg(lapic_reg_eoi, 0);
+    }
+
+    void send_ipi(uint32_t apic_id, uint32_t command) {
+        lapic_reg(lapic_reg_icr_high, apic_id << 24);
+        lapic_reg(lapic_reg_icr_low, command);
+        while (lapic_reg(lapic_reg_icr_low) & lapic_icr_send_pending) {
+            _mm_pause();
+        }
+    }
+
+    void route_isa_irq(uint8_t irq, uint8_t vector, uint32_t apic_id) {
+        const auto& route = cfg_.isa_irqs[irq];
+        uint32_t low = vector | ioapic_redirect_masked; // Fixed delivery, physical destination
+        if ((route.flags & inti_polarity_mask) == inti_polarity_active_low) {
+            low |= ioapic_redirect_active_low;
+        }
+        if ((route.flags & inti_trigger_mask) == inti_trigger_level) {
+            low |= ioapic_redirect_level;
+        }
+        const auto index = redirect_index(irq);
+        write_redirect(index, low, apic_id << 24);
+    }
+
+    void mask_isa_irq(uint8_t irq, bool masked) {
+        const auto index = redirect_index(irq);
+        const auto low = ioapic_reg(ioapic_reg_redirect + index * 2);
+        write_redirect(index, masked ? low | ioapic_redirect_masked : low & ~ioapic_redirect_masked, ioapic_reg(ioapic_reg_redirect + index * 2 + 1));
+    }
+
+    void timer_start(uint8_t vector, uint32_t initial_count, timer_mode mode) {
+        lapic_reg(lapic_reg_timer_divide, lapic_timer_divide_16);
+        lapic_reg(lapic_reg_lvt_timer, vector | (mode == timer_mode::periodic ? lapic_lvt_periodic : 0));
+        lapic_reg(lapic_reg_timer_initial, initial_count); // Starts the timer
+    }
+
+    void timer_stop() {
+        lapic_reg(lapic_reg_timer_initial, 0);
+        lapic_reg(lapic_reg_lvt_timer, lapic_lvt_masked);
+    }
+
+    uint32_t timer_current_count() const {
+        return lapic_reg(lapic_reg_timer_current);
+    }
+
+private:
+    config                cfg_;
+    volatile uint32_t*    lapic_;
+    volatile uint32_t*    ioapic_;
+    uint32_t              old_svr_;
+    uint32_t              redirect_count_;
+    isr_registration_ptr  spurious_reg_;
+
+    uint32_t lapic_reg(uint32_t offset) const {
+        return lapic_[offset / 4];
+    }
+
+    void lapic_reg(uint32_t offset, uint32_t value) {
+        lapic_[offset / 4] = value;
+    }
+
+    uint32_t ioapic_reg(uint32_t reg) const {
+        ioapic_[ioapic_ioregsel / 4] = reg;
+        return ioapic_[ioapic_iowin / 4];
+    }
+
+    void ioapic_reg(uint32_t reg, uint32_t value) {
+        ioapic_[ioapic_ioregsel / 4] = reg;
+        ioapic_[ioapic_iowin / 4] = value;
+    }
+
+    uint32_t redirect_index(uint8_t irq) const {
+        REQUIRE(irq < 16);
+        const auto gsi = cfg_.isa_irqs[irq].gsi;
+        REQUIRE(gsi >= cfg_.io_apic_gsi_base && gsi - cfg_.io_apic_gsi_base < redirect_count_);
+        return gsi - cfg_.io_apic_gsi_base;
+    }
+
+    void write_redirect(uint32_t index, uint32_t low, uint32_t high = 0) {
+        // Mask the entry while it's being changed
+        ioapic_reg(ioapic_reg_redirect + index * 2, ioapic_redirect_masked);
+        ioapic_reg(ioapic_reg_redirect + index * 2 + 1, high);
+        ioapic_reg(ioapic_reg_redirect + index * 2, low);
+    }
+};
+
+object_buffer<controller_impl> controller_buffer;
+
+owned_ptr<controller, destruct_deleter> init(const config& cfg) {
+    return owned_ptr<controller, destruct_deleter>{controller_buffer.construct(cfg).release()};
+}
+
+bool available() {
+    return controller_impl::has_instance();
+}
+
+uint32_t local_id() {
+    return controller_impl::instance().local_id();
+}
+
+void enable_local() {
+    controller_impl::instance().enable_local();
+}
+
+void eoi() {
+    controller_impl::instance().eoi();
+}
+
+void send_ipi(uint32_t apic_id, uint32_t command) {
+    controller_impl::instance().send_ipi(apic_id, command);
+}
+
+void route_isa_irq(uint8_t irq, uint8_t vector, uint32_t apic_id) {
+    controller_impl::instance().route_isa_irq(irq, vector, apic_id);
+}
+
+void mask_isa_irq(uint8_t irq) {
+    controller_impl::instance().mask_isa_irq(irq, true);
+}
+
+void unmask_isa_irq(uint8_t irq) {
+    controller_impl::instance().mask_isa_irq(irq, false);
+}
+
+uint64_t msi_address(uint32_t apic_id) {
+    REQUIRE(apic_id < 256);
+    return msi_address_base | (apic_id << 12); // Physical destination mode, no redirection hint
+}
+
+uint16_t msi_data(uint8_t vector) {
+    return vector; // Fixed delivery, edge triggered
+}
+
+void timer_start(uint8_t vector, uint32_t initial_count, timer_mode mode) {
+    controller_impl::instance().timer_start(vector, initial_count, mode);
+}
+
+void timer_stop() {
+    controller_impl::instance().timer_stop();
+}
+
+uint32_t timer_current_count() {
+    return controller_impl::instance().timer_current_count();
+}
+
+} } // namespace attos::apic
@@ -0,0 +1,70 @@
+#ifndef ATTOS_APIC_H
+#define ATTOS_APIC_H
+
+#include <attos/mem.h>
+
+namespace attos { namespace apic {
+
+// MPS INTI flags (from MADT interrupt source overrides)
+constexpr uint16_t inti_polarity_mask        = 0x03;
+constexpr uint16_t inti_polarity_active_low  = 0x03;
+constexpr uint16_t inti_trigger_mask         = 0x0C;
+constexpr uint16_t inti_trigger_level        = 0x0C;
+
+struct isa_irq_route {
+    uint32_t gsi;   // Global system interrupt
+    uint16_t flags; // MPS INTI flags, 0 means conforming to the bus (edge triggered, active high for ISA)
+};
+
+// Interrupt controllers described by the MADT
+struct config {
+    physical_address local_apic_base{};
+    physical_address io_apic_base{};
+    uint32_t         io_apic_gsi_base = 0;
+    isa_irq_route    isa_irqs[16]; // Identity mapped unless overridden
+};
+
+class __declspec(novtable) controller {
+public:
+    virtual ~controller() = 0 {}
+};
+
+constexpr uint8_t spurious_vector = 0xFF;
+
+// Maps the local APIC and the I/O APIC and enables the local APIC of the boot processor. All I/O APIC inputs
+// start out masked.
+owned_ptr<controller, destruct_deleter> init(const config& cfg);
+
+bool available();
+
+// Local APIC of the calling processor
+uint32_t local_id();
+void     enable_local(); // For application processors
+void     eoi();
+
+constexpr uint32_t icr_delivery_init    = 0x500;
+constexpr uint32_t icr_delivery_startup = 0x600;
+constexpr uint32_t icr_level_assert     = 0x4000;
+
+// Sends `command' (a vector or a delivery mode) to the processor with `apic_id' and waits until it has been accepted
+void send_ipi(uint32_t apic_id, uint32_t command);
+
+// Routes the ISA `irq' to `vector' on the processor with `apic_id', the entry is left masked
+void route_isa_irq(uint8_t irq, uint8_t vector, uint32_t apic_id);
+void mask_isa_irq(uint8_t irq);
+void unmask_isa_irq(uint8_t irq);
+
+// Address/data pair for a message signaled interrupt delivered to `vector' on the processor with `apic_id'
+uint64_t msi_address(uint32_t apic_id);
+uint16_t msi_data(uint8_t vector);
+
+// The local APIC timer counts down from `initial_count' at the bus frequency divided by 16. A one-shot timer
+// interrupts once when reaching zero, a periodic timer reloads `initial_count'.
+enum class timer_mode { one_shot, periodic };
+void     timer_start(uint8_t vector, uint32_t initial_count, timer_mode mode);
+void     timer_stop();
+uint32_t timer_current_count();
+
+} } // namespace attos::apic
+
+#endif
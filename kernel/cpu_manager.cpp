@@ -1,5 +1,6 @@
 #include "cpu_manager.h"
 #include <attos/out_stream.h>
+#include <attos/containers.h>
 
 namespace attos {
 
@@ -74,73 +75,66 @@ inline F* make_fun(const char* code) {
 #define C_LTR_CX            "\x0F\x00\xD9"
 
 const auto read_cs = make_fun<uint16_t ()>(C_MOV_AX_CS C_RET);
-const auto ltr = make_fun<void (uint16_t)>(C_LTR_CX C_RET);
-
-// RIP, CS, EFLAGS, Old RSP, SS
-const auto iretq = make_fun<void (uint64_t)>(
-    C_MOV_RAX_RSP
-    C_PUSH_IMM8 "\x00"      // ss
-    C_ADD_RAX_IMM8 "\x08"   // 4883C008          add rax,byte +0x8
-    C_PUSH_RAX              // rsp
-    C_ADD_RAX_IMM8 "\xF8"   // 4883C0F8          add rax,byte -0x8
-    C_PUSH_IMM8 "\x02"      // eflags (bit 1 is always set)
-    C_PUSH_RCX              // cs
-    C_PUSH_QWORD_RAX        // rip
-    C_IRETQ
-);
 
 // cpu_manager_util.asm
+// Application processors run with NX enabled from the start, so code used to load the GDT can't live in data
+extern "C" void load_tr(uint16_t selector);
+extern "C" void reload_cs(uint16_t cs); // Reloads CS with an IRETQ to the caller
 extern "C" void switch_to(registers& regs, uint64_t& saved_rsp);
 extern "C" void switch_to_restore(uint64_t& saved_rsp);
 extern "C" void syscall_handler(void);
 
-class cpu_manager_impl : public cpu_manager, public singleton<cpu_manager_impl> {
+// GDT, TSS and per-CPU data of one processor
+class cpu_state {
 public:
-    cpu_manager_impl() : old_cs_(read_cs()) {
-        dbgout() << "[cpu] Initializing. Old CS=" << as_hex(old_cs_) << "\n";
-
-        gdt_descriptor gdt_desc = { sizeof(gdt)-1, virtual_address::in_current_address_space(&gdt) };
+    explicit cpu_state(uint32_t index, uint32_t apic_id) {
+        data_.self              = &data_;
+        data_.syscall_stack_top = static_cast<uint64_t>(virtual_address::in_current_address_space(syscall_stack_ + sizeof(syscall_stack_))) & ~15ULL;
+        data_.user_rsp          = 0;
+        data_.index             = index;
+        data_.apic_id           = apic_id;
+        data_.fpu_owner         = nullptr;
+        data_.fpu_current       = nullptr;
+        data_.fpu_trap          = 0;
+        data_.reserved          = 0;
+
+        memset(&tss_, 0, sizeof(tss_));
 
         constexpr uint64_t tss_limit = sizeof(tss)-1;
         constexpr uint64_t tss_type  = 0x89; // Type=64 bit TSS (available) + present
         const auto tss_base = static_cast<uint64_t>(virtual_address::in_current_address_space(&tss_));
-        gdt[gdt_null]      = gdt_entry(0x0000, 0, 0x00000); // 0x00 null
-        gdt[gdt_kernel_cs] = gdt_entry(0xa09a, 0, 0xfffff); // 0x08 kernel code
-        gdt[gdt_kernel_ds] = gdt_entry(0x8092, 0, 0xfffff); // 0x10 kernel data
-        gdt[gdt_user_ds]   = gdt_entry(0x80f2, 0, 0xfffff); // 0x18 user data
-        gdt[gdt_user_cs]   = gdt_entry(0xa0fa, 0, 0xfffff); // 0x20 user code
-        gdt[gdt_tss0_low]  = (tss_limit & 0xFFFF) | ((tss_base & 0xFFFFFF) << 16) | (tss_type << 40) | ((tss_limit & 0xF0000) << 32) | ((tss_base & 0xFF000000) << 32);
-        gdt[gdt_tss0_high] = tss_base >> 32;
+        gdt_[gdt_null]      = gdt_entry(0x0000, 0, 0x00000); // 0x00 null
+        gdt_[gdt_kernel_cs] = gdt_entry(0xa09a, 0, 0xfffff); // 0x08 kernel code
+        gdt_[gdt_kernel_ds] = gdt_entry(0x8092, 0, 0xfffff); // 0x10 kernel data
+        gdt_[gdt_user_ds]   = gdt_entry(0x80f2, 0, 0xfffff); // 0x18 user data
+        gdt_[gdt_user_cs]   = gdt_entry(0xa0fa, 0, 0xfffff); // 0x20 user code
+        gdt_[gdt_tss0_low]  = (tss_limit & 0xFFFF) | ((tss_base & 0xFFFFFF) << 16) | (tss_type << 40) | ((tss_limit & 0xF0000) << 32) | ((tss_base & 0xFF000000) << 32);
+        gdt_[gdt_tss0_high] = tss_base >> 32;
+    }
 
-        _sgdt(&old_gdt_desc_);
+    cpu_state(const cpu_state&) = delete;
+    cpu_state& operator=(const cpu_state&) = delete;
+
+    // Loads the GDT and TSS on the calling processor and points GS to the per-CPU data
+    void load() {
+        gdt_descriptor gdt_desc = { sizeof(gdt_)-1, virtual_address::in_current_address_space(&gdt_) };
         _lgdt(&gdt_desc);
-        ltr(gdt_tss0_low * 8);
-        iretq(kernel_cs);
+        load_tr(gdt_tss0_low * 8);
+        reload_cs(kernel_cs);
 
-        // Enable NX (after using all the dirty functions)
-        old_efer_ = __readmsr(msr_efer);
-        __writemsr(msr_efer, old_efer_ | efer_mask_nxe);
+        __writemsr(msr_gs_base, virtual_address::in_current_address_space(&data_));
+        __writemsr(msr_kernel_gs_base, 0);
     }
 
-    ~cpu_manager_impl() {
-        dbgout() << "[cpu] Shutting down. Restoring GDT to limit " << as_hex(old_gdt_desc_.limit) << " base " << as_hex(old_gdt_desc_.base) << " CS " << as_hex(old_cs_) << "\n";
-        // Restore EFER first (disabling NX) first
-        __writemsr(msr_efer, old_efer_);
-        _lgdt(&old_gdt_desc_);
-        iretq(old_cs_);
+    cpu_data& data() {
+        return data_;
     }
 
-    void restore_original_context() {
-        REQUIRE(tss_.rsp0 != 0);
-        switch_to_restore(tss_.rsp0);
+    tss& task_state() {
+        return tss_;
     }
 
 private:
-    gdt_descriptor old_gdt_desc_;
-    uint16_t       old_cs_;
-    tss            tss_;
-    uint64_t       old_efer_;
-
     enum gdt_entries {
         gdt_null,
         gdt_kernel_cs,
@@ -158,16 +152,85 @@ private:
     static_assert(gdt_user_cs*8+3 == user_cs, "");
     static_assert(gdt_user_ds*8+3 == user_ds, "");
 
-    uint64_t gdt[gdt_entries_count];
+    static constexpr uint32_t syscall_stack_size = 4096;
+
+    cpu_data data_;
+    uint64_t gdt_[gdt_entries_count];
+    tss      tss_;
+    uint8_t  syscall_stack_[syscall_stack_size];
+};
+
+class cpu_manager_impl : public cpu_manager, public singleton<cpu_manager_impl> {
+public:
+    cpu_manager_impl() : old_cs_(read_cs()), boot_cpu_(0, 0) {
+        dbgout() << "[cpu] Initializing. Old CS=" << as_hex(old_cs_) << "\n";
+
+        _sgdt(&old_gdt_desc_);
+        old_gs_base_ = __readmsr(msr_gs_base);
+        cpus_[0] = &boot_cpu_;
+        boot_cpu_.load();
+
+        // Enable NX (after using all the dirty functions)
+        old_efer_ = __readmsr(msr_efer);
+        __writemsr(msr_efer, old_efer_ | efer_mask_nxe);
+    }
+
+    ~cpu_manager_impl() {
+        dbgout() << "[cpu] Shutting down. Restoring GDT to limit " << as_hex(old_gdt_desc_.limit) << " base " << as_hex(old_gdt_desc_.base) << " CS " << as_hex(old_cs_) << "\n";
+        REQUIRE(cpu_count_ == 1);
+        // Restore EFER first (disabling NX) first
+        __writemsr(msr_efer, old_efer_);
+        __writemsr(msr_gs_base, old_gs_base_);
+        _lgdt(&old_gdt_desc_);
+        reload_cs(old_cs_);
+    }
+
+    void restore_original_context() {
+        auto& tss = current().task_state();
+        REQUIRE(tss.rsp0 != 0);
+        switch_to_restore(tss.rsp0);
+    }
+
+    void ap_init(cpu_data& data) {
+        REQUIRE(data.index > 0 && data.index < cpu_count_);
+        cpus_[data.index]->load();
+    }
+
+private:
+    gdt_descriptor old_gdt_desc_;
+    uint16_t       old_cs_;
+    uint64_t       old_efer_;
+    uint64_t       old_gs_base_;
+    cpu_state      boot_cpu_;
+    cpu_state*     cpus_[max_cpus];
+    uint32_t       cpu_count_ = 1;
+
+    cpu_state& current() {
+        return *cpus_[current_cpu()];
+    }
 
     void do_switch_to_context(registers& regs) {
-        REQUIRE(tss_.rsp0 == 0);
-        REQUIRE(tss_.rsp1 == 0);
-        REQUIRE(tss_.rsp2 == 0);
-        switch_to(regs, tss_.rsp0);
-        tss_.rsp0 = 0;
+        auto& tss = current().task_state();
+        REQUIRE(tss.rsp0 == 0);
+        REQUIRE(tss.rsp1 == 0);
+        REQUIRE(tss.rsp2 == 0);
+        switch_to(regs, tss.rsp0);
+        tss.rsp0 = 0;
     }
 
+    virtual cpu_data& do_add_processor(uint32_t apic_id) override {
+        REQUIRE(cpu_count_ < max_cpus);
+        auto state = knew<cpu_state>(cpu_count_, apic_id).release();
+        cpus_[cpu_count_++] = state;
+        return state->data();
+    }
+
+    virtual void do_remove_processors() override {
+        REQUIRE(current_cpu() == 0);
+        for (; cpu_count_ > 1; --cpu_count_) {
+            kfree_deleter{}(cpus_[cpu_count_ - 1]);
+        }
+    }
 };
 
 object_buffer<cpu_manager_impl> cpu_manager_buffer;
@@ -180,30 +243,48 @@ void restore_original_context() {
     cpu_manager_impl::instance().restore_original_context();
 }
 
-syscall_handler_t syscall_handler_;
+void cpu_ap_init(cpu_data& data) {
+    cpu_manager_impl::instance().ap_init(data);
+}
+
+// Used by syscall_handler
+extern "C" {
+const syscall_table_entry* syscall_dispatch_table;
+uint64_t                   syscall_dispatch_count;
+}
 
 extern "C" void syscall_service_routine(registers& regs)
 {
-    REQUIRE(syscall_handler_);
+    const auto n = regs.rax;
+    if (n >= syscall_dispatch_count || !syscall_dispatch_table[n].full) {
+        dbgout() << "Got syscall 0x" << as_hex(n).width(0) << " from " << as_hex(regs.rcx) << " flags = " << as_hex(regs.r11) << "!\n";
+        REQUIRE(!"Unimplemented syscall");
+    }
     // The lowlevle syscall doesn't fill/use cs/rip/ss/flags, so handle them manually
     regs.cs     = user_cs;
     regs.rip    = regs.rcx;
     regs.ss     = user_ds;
     regs.eflags = static_cast<uint32_t>(regs.r11);
-    syscall_handler_(regs);
+    // The rest of the machine frame is left over stack contents, clear it so the context can be resumed with IRETQ
+    memset(regs.reserved3, 0, sizeof(regs.reserved3));
+    memset(regs.reserved4, 0, sizeof(regs.reserved4));
+    memset(regs.reserved5, 0, sizeof(regs.reserved5));
+    regs.rax = 0; // Default return value
+    syscall_dispatch_table[n].full(regs);
+    _disable(); // The handler may have enabled interrupts
     // TODO: Don't allow switching privilege levels
     REQUIRE(regs.cs == user_cs);
     REQUIRE(regs.ss == user_ds);
     // TODO: More checks
-    regs.rcx = regs.rip;
-    regs.r11 = regs.eflags;
+    // If rcx/r11 don't match rip/eflags (e.g. when switching to a preempted process) IRETQ is used to return
 }
 
-syscall_enabler::syscall_enabler(syscall_handler_t handler) {
+syscall_enabler::syscall_enabler(array_view<syscall_table_entry> table) {
     REQUIRE(!(__readmsr(msr_efer) & efer_mask_sce));
 
-    REQUIRE(!syscall_handler_);
-    syscall_handler_ = handler;
+    REQUIRE(!syscall_dispatch_table);
+    syscall_dispatch_table = table.begin();
+    syscall_dispatch_count = table.size();
 
     // Enable SYSCALL
     static_assert(kernel_cs + 8 == kernel_ds, "");
@@ -217,7 +298,8 @@ syscall_enabler::syscall_enabler(syscall_handler_t handler) {
 syscall_enabler::~syscall_enabler() {
     REQUIRE(__readmsr(msr_efer) & efer_mask_sce);
     __writemsr(msr_efer, __readmsr(msr_efer) & ~efer_mask_sce);
-    syscall_handler_ = syscall_handler_t{};
+    syscall_dispatch_table = nullptr;
+    syscall_dispatch_count = 0;
 }
 
 } // namespace attos
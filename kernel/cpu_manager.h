@@ -1,8 +1,10 @@
 #ifndef ATTOS_CPU_MANAGER_H
 #define ATTOS_CPU_MANAGER_H
 
+#include <stddef.h>
 #include <attos/cpu.h>
 #include <attos/function.h>
+#include <attos/array_view.h>
 
 namespace attos {
 
@@ -11,6 +13,33 @@ static constexpr uint16_t kernel_ds = 0x10;
 static constexpr uint16_t user_cs   = 0x23;
 static constexpr uint16_t user_ds   = 0x1b;
 
+static constexpr uint32_t max_cpus  = 16;
+
+namespace fpu { class state; }
+
+// Per-CPU data. While in kernel mode GS points to it (the user mode GS base is swapped in with SWAPGS).
+// Must match the structure in kernel.inc
+struct cpu_data {
+    cpu_data*   self;
+    uint64_t    syscall_stack_top;  // Kernel stack used by SYSCALL
+    uint64_t    user_rsp;           // User stack pointer while in SYSCALL
+    uint32_t    index;              // 0 is the boot processor
+    uint32_t    apic_id;
+    fpu::state* fpu_owner;          // Context whose x87/SSE registers are loaded (nullptr for the kernel)
+    fpu::state* fpu_current;        // User context being run
+    uint32_t    fpu_trap;           // CR0.TS is set
+    uint32_t    reserved;
+};
+
+inline cpu_data& this_cpu() {
+    return *reinterpret_cast<cpu_data*>(__readgsqword(offsetof(cpu_data, self)));
+}
+
+// Index of the CPU executing the calling code
+inline uint32_t current_cpu() {
+    return __readgsdword(offsetof(cpu_data, index));
+}
+
 class __declspec(novtable) cpu_manager {
 public:
     virtual ~cpu_manager() = 0 {}
@@ -19,18 +48,45 @@ public:
         do_switch_to_context(regs);
     }
 
+    // Allocates the GDT, TSS and per-CPU data for another processor, which loads them with cpu_ap_init
+    cpu_data& add_processor(uint32_t apic_id) {
+        return do_add_processor(apic_id);
+    }
+
+    // Frees the state of all application processors, they must have been stopped
+    void remove_processors() {
+        do_remove_processors();
+    }
+
 private:
     virtual void do_switch_to_context(registers& regs) = 0;
+    virtual cpu_data& do_add_processor(uint32_t apic_id) = 0;
+    virtual void do_remove_processors() = 0;
 };
 
 owned_ptr<cpu_manager, destruct_deleter> cpu_init();
 
 void restore_original_context();
 
-using syscall_handler_t = function<void (registers&)>;
+// Called on an application processor to load its GDT, TSS and GS base
+void cpu_ap_init(cpu_data& data);
+
+// Handles a syscall that doesn't switch contexts. Called with the arguments (rdx, r8, r9), the result is returned
+// in rax. Only what a function call may change is saved, so nothing is copied to a registers structure.
+using fast_syscall_handler_t = uint64_t (*)(uint64_t arg0, uint64_t arg1, uint64_t arg2);
+// Handles a syscall with the complete user context (rax is 0 on entry), which may be replaced to run another context
+using syscall_handler_t = void (*)(registers& regs);
+
+// Must match the structure in cpu_manager_util.asm
+struct syscall_table_entry {
+    fast_syscall_handler_t fast; // Used if set
+    syscall_handler_t      full;
+};
+
+// Dispatches SYSCALLs through `table' (indexed by the syscall number in rax), which must stay alive
 class syscall_enabler {
 public:
-    explicit syscall_enabler(syscall_handler_t handler);
+    explicit syscall_enabler(array_view<syscall_table_entry> table);
     ~syscall_enabler();
 };
 
@@ -6,11 +6,16 @@
 %include "attos/pe.inc"
 %include "kernel.inc"
 
+    global load_tr
+    global reload_cs
     global switch_to
     global switch_to_restore
     global syscall_handler
 
     extern syscall_service_routine   ; void syscall_service_routine(registers&)
+    extern syscall_dispatch_table    ; const syscall_table_entry*
+    extern syscall_dispatch_count    ; uint64_t
+    extern fpu_eager_switching       ; uint32_t
 
 %macro restore_registers_rcx_last 1
     mov rax, [%1 + registers.rax]
@@ -27,11 +32,28 @@
     mov r13, [%1 + registers.r13]  ; volatile
     mov r14, [%1 + registers.r14]  ; volatile
     mov r15, [%1 + registers.r15]  ; volatile
-    fxrstor [%1 + registers.fx_state] ; xmm6-xmm15 volatile
     mov rcx, [%1 + registers.rcx]
 %endmacro
 
-switch_to_stack_adjust equ registers_size + 8
+; void load_tr(uint16_t selector)
+load_tr:
+    ltr cx
+    ret
+
+; void reload_cs(uint16_t cs)
+reload_cs:
+    mov rax, rsp
+    push 0              ; ss
+    add rax, 8
+    push rax            ; rsp after returning
+    pushfq              ; rflags
+    movzx ecx, cx
+    push rcx            ; cs
+    push qword [rax-8]  ; rip = return address
+    iretq
+
+switch_to_fx_offset    equ registers_size ; The complete x87/SSE state of the original context
+switch_to_stack_adjust equ registers_size + 512 + 8
 
 ; void switch_to(registers& regs, uint64_t& saved_rsp)
 win64_proc switch_to
@@ -68,7 +90,7 @@ win64_proc switch_to
     mov [rsp + registers.rsp], rsp
     mov [rsp + registers.cs], ss
 
-    fxsave [rsp + registers.fx_state] ; xmm6-xmm15 volatile
+    fxsave [rsp + switch_to_fx_offset] ; xmm6-xmm15 volatile
 
     mov [rdx], rsp
 
@@ -92,8 +114,24 @@ win64_proc switch_to
     mov rax, [rcx+registers.ss]
     mov [rsp+0x20], rax
 
+    ; No interrupts until IRETQ (which restores IF) as they'd see a kernel mode context with CR0.TS set or
+    ; with the user GS base.
+    cli
+    fpu_eager_load_current rax
+    restore_fpu_volatile rcx
+    test byte [rsp+0x08], 3
+    jz .kernel_fpu
+    fpu_return_to_user rax
+.kernel_fpu:
+
     restore_registers_rcx_last rcx
 
+    ; Switch to the user GS base when entering user mode
+    test byte [rsp+0x08], 3
+    jz .kernel
+    swapgs
+.kernel:
+
     ; Before IRETQ
     ;
     ; rsp + 0x20  ss
@@ -110,6 +148,7 @@ win64_proc switch_to_restore
     win64_prologue_alloc_unwind switch_to_stack_adjust
     win64_prologue_end
     mov rsp, [rcx]
+    fxrstor [rsp + switch_to_fx_offset]
     restore_registers_rcx_last rsp
     push qword [rsp + registers.rflags]
     popfq
@@ -117,9 +156,10 @@ win64_proc switch_to_restore
     ret
 win64_proc_end
 
-%define syscall_local_size (32) ; 32 bytes for the shadow space
+%define syscall_local_size (32+512) ; 32 bytes for the shadow space, 512 for fpu_eager_save
 %define syscall_common_stack_alloc registers_size + syscall_local_size
 %define syscall_registers_offset syscall_local_size
+%define syscall_fx_offset 32
 %define syscall_common_reg_offset(REG)  syscall_registers_offset + registers.%+REG
 
 %macro syscall_save_reg 1
@@ -128,11 +168,81 @@ win64_proc_end
 
 %define syscall_unwind_hack_stack_adjust 5*8 ; Size of machine frame
 
+; Must match the structure in cpu_manager.h
+struc syscall_table_entry
+    .fast            resq 1
+    .full            resq 1
+endstruc
+
+    align 16
+syscall_handler:
+    ; switch to the kernel GS base and the kernel stack of this processor
+    swapgs
+    mov [gs:cpu_data.user_rsp], rsp
+    mov rsp, [gs:cpu_data.syscall_stack_top]
+
+    ; dispatch on the syscall number in rax, r10 is free to use (SYSCALL clobbers rcx and r11 instead)
+    cmp rax, [syscall_dispatch_count]
+    jae syscall_full
+    mov r10, rax
+    shl r10, 4 ; * syscall_table_entry_size
+    add r10, [syscall_dispatch_table]
+    mov r10, [r10 + syscall_table_entry.fast]
+    test r10, r10
+    jnz syscall_fast
+    jmp syscall_full
+
+%define syscall_fast_local_size (32+512+8) ; 32 bytes for the shadow space, 512 for fpu_eager_save, 8 bytes to keep the stack aligned
+%define syscall_fast_frame_offset(REG) syscall_fast_local_size + registers.%+REG - registers.rip
+
+; Calls the fast handler in r10 with the arguments in rdx, r8 and r9. Only the user rip, rflags and rsp are saved,
+; the called function preserves the non-volatile registers and the syscall may change the volatile ones.
     align 16
-win64_proc syscall_handler
-    ; switch to kernel stack
-    xchg [syscall_stack_ptr], rsp
+win64_proc syscall_fast
+    ; the same unwind hack as syscall_full, with rip and rsp of the machine frame filled in
+    win64_prologue_push_machineframe_unwind
+    win64_prologue_alloc syscall_fast_local_size
+    sub rsp, syscall_unwind_hack_stack_adjust
+    win64_prologue_end
 
+    mov [rsp+syscall_fast_frame_offset(rip)], rcx
+    mov [rsp+syscall_fast_frame_offset(rflags)], r11
+    mov rax, [gs:cpu_data.user_rsp]
+    mov [rsp+syscall_fast_frame_offset(rsp)], rax
+
+    fpu_enter_from_user
+    fpu_eager_save rsp+syscall_fx_offset
+    mov rcx, rdx
+    mov rdx, r8
+    mov r8, r9
+    call r10 ; result in rax
+    cli      ; the handler may have enabled interrupts
+    fpu_eager_restore rsp+syscall_fx_offset, rcx
+
+    ; don't leak kernel data through the volatile registers
+    xor edx, edx
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    pxor xmm0, xmm0
+    pxor xmm1, xmm1
+    pxor xmm2, xmm2
+    pxor xmm3, xmm3
+    pxor xmm4, xmm4
+    pxor xmm5, xmm5
+    fpu_return_to_user rcx
+
+    ; restore user stack and GS base
+    mov rcx, [rsp+syscall_fast_frame_offset(rip)]
+    mov r11, [rsp+syscall_fast_frame_offset(rflags)]
+    mov rsp, [gs:cpu_data.user_rsp]
+    swapgs
+    o64 sysret
+win64_proc_end
+
+; Saves the complete user context in a registers structure for syscall_service_routine
+    align 16
+win64_proc syscall_full
     ; hack up some unwind codes to allow proper stack traces
     win64_prologue_push_machineframe_unwind
     win64_prologue_alloc syscall_common_stack_alloc-syscall_unwind_hack_stack_adjust
@@ -156,38 +266,50 @@ win64_proc syscall_handler
     win64_prologue_end
 
     ; Save user stack pointer in registers struct
-    mov rax, [syscall_stack_ptr]
+    mov rax, [gs:cpu_data.user_rsp]
     mov [rsp+syscall_common_reg_offset(rsp)], rax
 
-    ; save fx state
-    fxsave [rsp+syscall_common_reg_offset(fx_state)]
+    ; save the x87/SSE registers kernel code may use, the rest are only switched on demand (see fpu.cpp)
+    fpu_enter_from_user
+    save_fpu_volatile rsp+syscall_registers_offset
+    fpu_eager_save rsp+syscall_fx_offset
 
     lea  rcx, [rsp+syscall_registers_offset] ; arg = registers&
     call syscall_service_routine
 
-    ; restore fx state
-    fxrstor [rsp+syscall_common_reg_offset(fx_state)]
+    ; restore them (possibly for another context), interrupts are disabled until returning to user mode
+    fpu_eager_restore rsp+syscall_fx_offset, rax
+    restore_fpu_volatile rsp+syscall_registers_offset
+    fpu_return_to_user rax
+
+    ; SYSRET returns to rcx with rflags from r11. Contexts where that isn't the case (e.g. a process that
+    ; was preempted by an interrupt) are resumed with IRETQ instead.
+    mov rax, [rsp+syscall_common_reg_offset(rcx)]
+    cmp rax, [rsp+syscall_common_reg_offset(rip)]
+    jne .iret
+    mov eax, [rsp+syscall_common_reg_offset(r11)]
+    cmp eax, [rsp+syscall_common_reg_offset(rflags)]
+    jne .iret
 
     ; Restore user stack pointer from registers structure (in case it was changed)
     mov rax, [rsp+syscall_common_reg_offset(rsp)]
-    mov [syscall_stack_ptr], rax
+    mov [gs:cpu_data.user_rsp], rax
 
     ; restore registers
     win64_epilogue
     add rsp, syscall_unwind_hack_stack_adjust
 
-    ; restore user stack
-    xchg [syscall_stack_ptr], rsp
+    ; restore user stack and GS base
+    mov rsp, [gs:cpu_data.user_rsp]
+    swapgs
 
     ; Force REX.W prefix to ensure 64-bit return
     o64 sysret
 
-win64_proc_end
-
-    section .data
-    syscall_stack_ptr dq syscall_kernel_stack_top
+.iret:
+    ; restore registers, rip/cs/rflags/rsp/ss at the end of the registers structure form the IRETQ frame
+    win64_epilogue
+    swapgs
+    iretq
 
-    section .bss
-    align 4096
-    resb 4096
-syscall_kernel_stack_top:
+win64_proc_end
@@ -0,0 +1,96 @@
+#include "fpu.h"
+#include "isr.h"
+#include "cpu_manager.h"
+#include <attos/out_stream.h>
+
+namespace attos { namespace fpu {
+
+constexpr uint32_t fxsave_fcw_offset   = 0;
+constexpr uint32_t fxsave_mxcsr_offset = 24;
+constexpr uint16_t fcw_default         = 0x037F; // All exceptions masked, 64-bit precision, round to nearest
+
+// Used by the kernel entry code (kernel.inc)
+extern "C" {
+uint32_t fpu_eager_switching;
+}
+
+class controller_impl : public controller, public singleton<controller_impl> {
+public:
+    explicit controller_impl(bool eager) {
+        const auto cr0 = __readcr0();
+        REQUIRE((cr0 & cr0_mask_mp) && !(cr0 & cr0_mask_em));
+        static_assert(offsetof(state, buffer_) == 0, "fpu_state_area in kernel.inc depends on this");
+        reg_ = register_device_not_available_handler([this]() { return on_device_not_available(); });
+        fpu_eager_switching = eager;
+        if (eager) {
+            dbgout() << "[fpu] Saving x87/SSE registers on every kernel entry\n";
+        }
+    }
+
+    ~controller_impl() {
+        REQUIRE(!this_cpu().fpu_current);
+        fpu_eager_switching = false;
+        reg_.reset();
+        dbgout() << "[fpu] x87/SSE registers loaded " << loads_ << " times for " << deferred_ << " switches to a context that didn't have them loaded\n";
+    }
+
+    void set_current(state* s) {
+        auto& cpu = this_cpu();
+        cpu.fpu_current = s;
+        if (s && s != cpu.fpu_owner) {
+            ++deferred_;
+        }
+    }
+
+    static void init_area(uint8_t* area) {
+        memset(area, 0, 512);
+        *reinterpret_cast<uint16_t*>(area + fxsave_fcw_offset)   = fcw_default;
+        *reinterpret_cast<uint32_t*>(area + fxsave_mxcsr_offset) = mxcsr_default;
+    }
+
+private:
+    isr_registration_ptr reg_;
+    uint64_t             loads_ = 0;
+    uint64_t             deferred_ = 0;
+
+    // CR0.TS was cleared on kernel entry and stays clear, as the registers now belong to the current context.
+    // The volatile registers of both contexts are in their `registers', so the values saved/loaded here don't matter.
+    bool on_device_not_available() {
+        auto& cpu = this_cpu();
+        auto current = cpu.fpu_current;
+        if (!current || current == cpu.fpu_owner) {
+            return false;
+        }
+        if (auto owner = cpu.fpu_owner) {
+            _fxsave64(owner->area());
+        }
+        _fxrstor64(current->area());
+        cpu.fpu_owner = current;
+        ++loads_;
+        return true;
+    }
+};
+
+object_buffer<controller_impl> controller_buffer;
+
+owned_ptr<controller, destruct_deleter> init(bool eager) {
+    return owned_ptr<controller, destruct_deleter>{controller_buffer.construct(eager).release()};
+}
+
+state::state() {
+    controller_impl::init_area(area());
+}
+
+state::~state() {
+    auto& cpu = this_cpu();
+    REQUIRE(cpu.fpu_current != this);
+    if (cpu.fpu_owner == this) {
+        cpu.fpu_owner = nullptr; // The registers are left as they are, nothing else depends on them
+    }
+}
+
+void set_current(state* s) {
+    controller_impl::instance().set_current(s);
+}
+
+} } // namespace attos::fpu
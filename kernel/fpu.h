@@ -0,0 +1,48 @@
+#ifndef ATTOS_FPU_H
+#define ATTOS_FPU_H
+
+#include <attos/mem.h>
+
+namespace attos { namespace fpu {
+
+class __declspec(novtable) controller {
+public:
+    virtual ~controller() = 0 {}
+};
+
+constexpr uint32_t mxcsr_default = 0x1F80; // All exceptions masked, round to nearest
+
+class controller_impl;
+
+// x87/SSE registers of a user context other than xmm0-xmm5 and MXCSR (which are saved in `registers' on every
+// kernel entry like the general purpose registers, as kernel code may use them). They stay loaded while other
+// contexts run and are only saved when another context executes an x87/SSE instruction.
+class state {
+public:
+    explicit state();
+    ~state();
+    state(const state&) = delete;
+    state& operator=(const state&) = delete;
+
+private:
+    uint8_t buffer_[512 + 15]; // FXSAVE area (16 byte aligned)
+
+    uint8_t* area() {
+        return reinterpret_cast<uint8_t*>((reinterpret_cast<uint64_t>(buffer_) + 15) & ~15ULL);
+    }
+
+    friend controller_impl;
+};
+
+// Handles the device not available exceptions (#NM) raised when a user context executes an x87/SSE instruction
+// while another context's registers are loaded. With `eager' set the complete state is instead saved and restored
+// on every kernel entry and a context's registers are loaded when switching to it (to compare the two).
+owned_ptr<controller, destruct_deleter> init(bool eager);
+
+// Sets the context that is run when returning to user mode on this processor (nullptr when switching away).
+// Unless its registers are loaded, CR0.TS is set on the way out.
+void set_current(state* s);
+
+} } // namespace attos::fpu
+
+#endif
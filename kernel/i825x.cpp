@@ -1,7 +1,9 @@
 #include "i825x.h"
 #include <attos/cpu.h>
 #include <attos/out_stream.h>
+#include <attos/log.h>
 #include "isr.h"
+#include "timer.h"
 
 namespace attos { namespace net { namespace i825x {
 
@@ -218,6 +220,7 @@ constexpr uint32_t RXD_STAT_IXSM           = 0x04;         /* Ignore checksum */
 constexpr uint32_t RXD_STAT_VP             = 0x08;         /* IEEE VLAN Packet */
 constexpr uint32_t RXD_STAT_UDPCS          = 0x10;         /* UDP xsum calculated */
 constexpr uint32_t RXD_STAT_TCPCS          = 0x20;         /* TCP xsum calculated */
+constexpr uint32_t RXD_STAT_IPCS           = 0x40;         /* IP xsum calculated */
 constexpr uint32_t RXD_ERR_CE              = 0x01;         /* CRC Error */
 constexpr uint32_t RXD_ERR_SE              = 0x02;         /* Symbol Error */
 constexpr uint32_t RXD_ERR_SEQ             = 0x04;         /* Sequence Error */
@@ -226,6 +229,10 @@ constexpr uint32_t RXD_ERR_TCPE            = 0x20;         /* TCP/UDP Checksum E
 constexpr uint32_t RXD_ERR_IPE             = 0x40;         /* IP Checksum Error */
 constexpr uint32_t RXD_ERR_RXE             = 0x80;         /* Rx Data Error */
 
+/* Receive Checksum Control */
+constexpr uint32_t RXCSUM_IPOFL            = 0x00000100;   /* IPv4 checksum offload */
+constexpr uint32_t RXCSUM_TUOFL            = 0x00000200;   /* TCP / UDP checksum offload */
+
 /* Transmit Control */
 constexpr uint32_t TCTL_EN                 = 0x00000002;   /* enable Tx */
 constexpr uint32_t TCTL_PSP                = 0x00000008;   /* pad short packets */
@@ -262,6 +269,8 @@ constexpr uint32_t TXD_STAT_TU             = 0x00000008;   /* Transmit underrun
 constexpr uint32_t TXD_CMD_TCP             = 0x01000000;   /* TCP packet */
 constexpr uint32_t TXD_CMD_IP              = 0x02000000;   /* IP packet */
 constexpr uint32_t TXD_CMD_TSE             = 0x04000000;   /* TCP Seg enable */
+constexpr uint32_t TXD_DTYP_C              = 0x00000000;   /* Context Descriptor */
+constexpr uint32_t TXD_DTYP_D              = 0x00100000;   /* Data Descriptor */
 
 /* Interrupt Cause Read */
 constexpr uint32_t ICR_TXDW                = 0x00000001;/* Transmit desc written back */
@@ -271,6 +280,13 @@ constexpr uint32_t ICR_RXSEQ               = 0x00000008;/* Rx sequence error */
 constexpr uint32_t ICR_RXDMT0              = 0x00000010;/* Rx desc min. threshold (0) */
 constexpr uint32_t ICR_RXT0                = 0x00000080;/* Rx timer intr (ring 0) */
 
+constexpr uint32_t ICR_RX_MASK             = ICR_RXT0 | ICR_RXDMT0; /* Masked while polling */
+
+/* Interrupt moderation. Timers count in units of 1.024 us (RDTR/RADV) and 256 ns (ITR) */
+constexpr uint32_t rx_delay_us             = 8;    /* RDTR: wait this long for more frames after one arrives */
+constexpr uint32_t rx_abs_delay_us         = 64;   /* RADV: but interrupt no later than this after the first one */
+constexpr uint32_t max_interrupt_rate      = 8000; /* ITR: interrupts per second */
+
 /* Receive Descriptor */
 struct alignas(16) rx_desc {
 	uint64_t buffer_addr; /* Address of the descriptor's data buffer */
@@ -304,13 +320,20 @@ struct alignas(16) tx_desc {
 };
 static_assert(sizeof(tx_desc) == 128/8, "");
 
-void delay_microseconds(uint32_t count)
-{
-    // Should be around 1us...
-    while (count--) {
-        __outbyte(0x80, 0);
-    }
-}
+/* Transmit Context Descriptor (where the checksums of the following data descriptors go) */
+struct alignas(16) tx_context_desc {
+    uint8_t  ipcss;          /* IP checksum start */
+    uint8_t  ipcso;          /* IP checksum offset */
+    uint16_t ipcse;          /* IP checksum end (inclusive) */
+    uint8_t  tucss;          /* TCP/UDP checksum start */
+    uint8_t  tucso;          /* TCP/UDP checksum offset */
+    uint16_t tucse;          /* TCP/UDP checksum end (inclusive, 0 = end of packet) */
+    uint32_t cmd_and_length;
+    uint8_t  status;         /* Descriptor status */
+    uint8_t  hdr_len;        /* Header length (TSO) */
+    uint16_t mss;            /* Maximum segment size (TSO) */
+};
+static_assert(sizeof(tx_context_desc) == 128/8, "");
 
 constexpr uint16_t i825x0em_a = 0x100e; // desktop
 constexpr uint16_t i825x5em_a = 0x100f; // copper
@@ -320,22 +343,36 @@ class i825x_ethernet_device : public ethernet_device {
 public:
     static constexpr uint32_t io_mem_size = 128<<10; // 128K
 
-    explicit i825x_ethernet_device(const pci::device_info& dev_info) : mac_addr_{ 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 }, dev_addr_{dev_info.address} {
+    explicit i825x_ethernet_device(const pci::device_info& dev_info)
+        : mac_addr_{ 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 }
+        , dev_addr_{dev_info.address}
+        , rx_mem_{alloc_physical(num_rx_buffers * rx_buffer_size)}
+        , rx_pool_{static_cast<uint8_t*>(rx_mem_.address()), num_rx_buffers, rx_buffer_size, [this](uint32_t index) { rx_free_.push_back(index); }} {
         REQUIRE(!(dev_info.bars[0].address & pci::bar_is_io_mask)); // Register base address
         REQUIRE(dev_info.bars[0].size == io_mem_size);
 
         const uint64_t iobase = dev_info.bars[0].address&pci::bar_mem_address_mask;
 
         reg_base_ = static_cast<volatile uint32_t*>(iomem_map(physical_address{iobase}, io_mem_size));
-        dbgout() << "[i825x] Initializing. IOBASE = " << as_hex(iobase).width(8) << " IRQ# " << dev_info.config.header0.intr_line << "\n";
-        reg_ = register_irq_handler(dev_info.config.header0.intr_line, [this]() { isr(); });
+        LOG(ethdev, info) << "i825x initializing. IOBASE = " << as_hex(iobase).width(8) << " IRQ# " << dev_info.config.header0.intr_line << "\n";
+        reg_ = pci::register_msi_handler(dev_info, [this]() { isr(); });
+        if (!reg_) {
+            reg_ = register_irq_handler(dev_info.config.header0.intr_line, [this]() { isr(); });
+        }
 
         reset();
         pci::bus_master(dev_addr_, true);
     }
 
     virtual ~i825x_ethernet_device() override {
-        dbgout() << "[i825x] Shutting down\n";
+        LOG(ethdev, info) << "Shutting down\n";
+        wait_tx_space(0); // Let the queued packets go out before their buffers disappear
+        ioreg(reg::TCTL, ioreg(reg::TCTL) & ~TCTL_EN);
+        ioreg(reg::RCTL, ioreg(reg::RCTL) & ~RCTL_EN);
+        LOG(ethdev, info) << tx_packets_ << " packets sent, " << tx_errors_ << " errors, waited for a free descriptor " << tx_full_waits_ << " times\n";
+        LOG(ethdev, info) << "Receive left in the ring " << rx_starved_ << " times as all buffers were lent out\n";
+        LOG(ethdev, info) << rx_interrupts_ << " receive interrupts, " << rx_polls_ << " polls\n";
+        LOG(ethdev, info) << "Checksums inserted in " << tx_offloaded_ << " sent and verified in " << rx_verified_ << " received packets, " << rx_csum_errors_ << " bad\n";
         // TODO: Stop device
         pci::bus_master(dev_addr_, false);
         iomem_unmap(reg_base_, io_mem_size);
@@ -344,19 +381,43 @@ public:
 private:
     // The number of descriptors must be a multiple of 8 (size divisible by 128b)
     static constexpr uint32_t num_rx_descriptors = 16; // Must be at least 8
-    static constexpr uint32_t num_tx_descriptors = 16; // Must be at least 16
+    static constexpr uint32_t num_rx_buffers     = 64; // The ones not in the ring can be lent out
+    static constexpr uint32_t rx_buffer_size     = 2048;
+    static constexpr uint32_t num_tx_descriptors = 32; // Must be at least 16
+    static constexpr uint32_t tx_buffer_size     = 2048;
+    static constexpr uint64_t tx_timeout_ns      = 100 * ns_per_ms;
+    static constexpr uint32_t no_tx_context      = UINT32_MAX;
+    static constexpr bool     offload_checksums  = true; // Set to false to compute all checksums in software
 
     mac_address             mac_addr_;
     pci::device_address     dev_addr_;
     volatile uint32_t*      reg_base_;
 #pragma warning(suppress: 4324) // struct was padded due to alignment specifier
     volatile rx_desc        rx_desc_[num_rx_descriptors];
-    uint8_t                 rx_buffer_[num_rx_descriptors][2048];
+    physical_allocation     rx_mem_;                       // Receive buffers (physically contiguous)
+    packet_pool             rx_pool_;
+    kvector<uint32_t>       rx_free_;                      // Buffers neither in the ring nor lent out
+    uint32_t                rx_slot_[num_rx_descriptors];  // Buffer used by each descriptor
     uint32_t                rx_head_ = 0;
+    bool                    rx_polling_ = false; // Receive interrupts are masked until the ring has been drained
+    uint64_t                rx_starved_ = 0;
+    uint64_t                rx_interrupts_ = 0;
+    uint64_t                rx_polls_ = 0;
 #pragma warning(suppress: 4324) // struct was padded due to alignment specifier
     volatile tx_desc        tx_desc_[num_tx_descriptors];
-    uint32_t                tx_tail_ = 0;
+    uint8_t                 tx_buffer_[num_tx_descriptors][tx_buffer_size]; // Packets are copied here, so the caller's buffer can be reused right away
+    uint64_t                tx_buffer_phys_[num_tx_descriptors];
+    uint32_t                tx_context_ = no_tx_context; // Offsets of the last context descriptor (see tx_context_key)
+    uint32_t                tx_tail_ = 0;  // Next descriptor to fill in
+    uint32_t                tx_clean_ = 0; // Oldest descriptor not yet reaped (tx_clean_ == tx_tail_ when none are in flight)
+    uint64_t                tx_packets_ = 0;
+    uint64_t                tx_errors_ = 0;
+    uint64_t                tx_full_waits_ = 0;
+    uint64_t                tx_offloaded_ = 0;
+    uint64_t                rx_verified_ = 0;
+    uint64_t                rx_csum_errors_ = 0;
     isr_registration_ptr    reg_;
+    function<void ()>       receive_notify_;
 
     uint32_t ioreg(reg r) {
         return reg_base_[static_cast<uint32_t>(r)>>2];
@@ -369,7 +430,7 @@ private:
     void phy_reset() {
         const auto orig = ioreg(reg::CTRL);
         ioreg(reg::CTRL, orig | CTRL_RST | CTRL_PHY_RST);
-        delay_microseconds(4); // Should be held high for at least 3 us. NOTE: Should be held high for 10ms(!) for 82546GB
+        timer::delay_microseconds(4); // Should be held high for at least 3 us. NOTE: Should be held high for 10ms(!) for 82546GB
         ioreg(reg::CTRL, orig & ~CTRL_PHY_RST);
     }
 
@@ -379,7 +440,7 @@ private:
         ioreg(reg::CTRL, ioreg(reg::CTRL) | CTRL_RST);
         for (int timeout = 0; ; ++timeout) {
             REQUIRE(timeout < 1000 && "Failed to reset i825x device");
-            delay_microseconds(2); // Need to delay at least 1us before reading status after a reset
+            timer::delay_microseconds(2); // Need to delay at least 1us before reading status after a reset
             if (!(ioreg(reg::CTRL) & CTRL_RST)) {
                 break;
             }
@@ -403,7 +464,12 @@ private:
         // Program the Interrupt Mask Set/Read (IMS) register
         ioreg(reg::IMC, ~0U); // Inhibit interrupts
         ioreg(reg::ICR, ~0U); // Clear pending interrupts
-        ioreg(reg::IMS, ICR_TXDW | ICR_LSC | ICR_RXDMT0 | ICR_RXT0); // Enable interrupts
+        ioreg(reg::IMS, ICR_TXDW | ICR_LSC | ICR_RX_MASK); // Enable interrupts
+
+        // Interrupt moderation: a single frame is reported quickly, a burst only raises a few interrupts
+        ioreg(reg::RDTR, rx_delay_us * 1000 / 1024);
+        ioreg(reg::RADV, rx_abs_delay_us * 1000 / 1024);
+        ioreg(reg::ITR, static_cast<uint32_t>(ns_per_s / (max_interrupt_rate * 256)));
 
         // Program the Receive Descriptor Base Address
         const uint64_t rx_desc_phys = virt_to_phys((const void*)&rx_desc_[0]);
@@ -418,8 +484,15 @@ private:
         ioreg(reg::RDT0, num_rx_descriptors-1);
 
         memset((void*)rx_desc_, 0, sizeof(rx_desc_));
+        rx_free_.clear();
+        rx_free_.reserve(num_rx_buffers); // So returning buffers never allocates
+        for (uint32_t i = num_rx_buffers; i--;) {
+            rx_free_.push_back(i);
+        }
         for (uint32_t i = 0; i < num_rx_descriptors; ++i) {
-            rx_desc_[i].buffer_addr = virt_to_phys(rx_buffer_[i]);
+            rx_slot_[i] = rx_free_.back();
+            rx_free_.pop_back();
+            rx_desc_[i].buffer_addr = rx_buffer_phys(rx_slot_[i]);
             rx_desc_[i].status = 0;
         }
 
@@ -430,7 +503,9 @@ private:
                            | RCTL_MPE // bad packets
                            | RCTL_BAM // and multicast..
                            | RCTL_SZ_2048);
+        ioreg(reg::RXCSUM, offload_checksums ? RXCSUM_IPOFL | RXCSUM_TUOFL : 0);
         rx_head_ = 0;
+        rx_polling_ = false;
 
         // Enable TX
         memset((void*)tx_desc_, 0, sizeof(tx_desc_));
@@ -449,92 +524,233 @@ private:
         ioreg(reg::TDT0, 0);
         ioreg(reg::TCTL, ioreg(reg::TCTL) | TCTL_EN | TCTL_PSP);
 
+        for (uint32_t i = 0; i < num_tx_descriptors; ++i) {
+            tx_buffer_phys_[i] = virt_to_phys(tx_buffer_[i]);
+        }
         tx_tail_ = 0;
+        tx_clean_ = 0;
+        tx_context_ = no_tx_context;
+    }
+
+    uint64_t rx_buffer_phys(uint32_t index) const {
+        return static_cast<uint64_t>(rx_mem_.address()) + index * rx_buffer_size;
+    }
+
+    uint32_t tx_in_flight() const {
+        return (tx_tail_ + num_tx_descriptors - tx_clean_) % num_tx_descriptors;
+    }
+
+    // Frees the descriptors the device is done with. Called with interrupts disabled, on sends and TXDW interrupts.
+    void reap_tx() {
+        for (; tx_clean_ != tx_tail_; tx_clean_ = (tx_clean_ + 1) % num_tx_descriptors) {
+            auto& td = tx_desc_[tx_clean_];
+            const auto status = td.upper.fields.status;
+            if (!(status & TXD_STAT_DD)) {
+                break;
+            }
+            if (status & (TXD_STAT_EC | TXD_STAT_LC | TXD_STAT_TU)) {
+                ++tx_errors_;
+            }
+            td.upper.data = 0; // Mark ready for re-use
+        }
+    }
+
+    // Waits until at most `max_in_flight' descriptors are in use (one is always kept free to tell a full ring
+    // from an empty one). Returns false on timeout.
+    bool wait_tx_space(uint32_t max_in_flight) {
+        auto reaped_enough = [this, max_in_flight]() {
+            interrupt_disabler id{};
+            reap_tx();
+            return tx_in_flight() <= max_in_flight;
+        };
+        if (reaped_enough()) {
+            return true;
+        }
+        ++tx_full_waits_;
+        // The descriptors are written back whether or not the interrupt is serviced, so just poll them
+        for (const auto start = monotonic_ns(); monotonic_ns() - start < tx_timeout_ns;) {
+            _mm_pause();
+            if (reaped_enough()) {
+                return true;
+            }
+        }
+        LOG(ethdev, error) << "Transfer NOT done. Timed out! STATUS = " << as_hex(ioreg(reg::STATUS)) << " TDH = " << ioreg(reg::TDH0) << " TDT " << ioreg(reg::TDT0) << "\n";
+        return false;
     }
 
     void isr() {
         const auto icr = ioreg(reg::ICR);
         ioreg(reg::ICR, icr); // clear pending interrupts
         constexpr uint32_t ICR_INT_ASSERTED = 1U << 31; // Reported by bochs
-        if (icr & ~(ICR_RXT0 | ICR_TXDW | ICR_INT_ASSERTED)) {
+        if (icr & ~(ICR_RX_MASK | ICR_TXDW | ICR_INT_ASSERTED)) {
             // Only report interesting IRQs
-            dbgout() << "[i825x] IRQ. ICR = " << as_hex(icr) << "\n";
+            LOG(ethdev, info) << "IRQ. ICR = " << as_hex(icr) << "\n";
+        }
+        if (icr & ICR_TXDW) {
+            reap_tx();
+        }
+        if ((icr & ICR_RX_MASK) && !rx_polling_) {
+            // Leave the rest to the receiver, which polls (do_receive_packets) until the ring is empty
+            ioreg(reg::IMC, ICR_RX_MASK);
+            trace(log_category::ethdev, "rx interrupt", icr);
+            rx_polling_ = true;
+            ++rx_interrupts_;
+            if (receive_notify_) {
+                receive_notify_();
+            }
+        }
+    }
+
+    // Called when a poll found fewer frames than it asked for
+    void rx_poll_done() {
+        interrupt_disabler id{};
+        if (!rx_polling_) {
+            return;
+        }
+        rx_polling_ = false;
+        trace(log_category::ethdev, "rx drained", rx_head_);
+        ioreg(reg::IMS, ICR_RX_MASK);
+        if (rx_desc_[rx_head_].status & RXD_STAT_DD) {
+            // A frame arrived after the ring was checked but before the interrupt was unmasked
+            ioreg(reg::ICS, ICR_RXT0);
         }
     }
 
+    virtual void do_set_receive_notify(const function<void ()>& notify) override {
+        interrupt_disabler id{};
+        receive_notify_ = notify;
+    }
+
     virtual mac_address do_hw_address() const {
         return mac_addr_;
     }
 
-    virtual void do_send_packet(const void* data, uint32_t length) override {
+    // Identifies the checksum offsets of a context descriptor, so it only has to be sent when they change
+    static uint32_t tx_context_key(checksum_offload insert, uint32_t ip_header_length) {
+        return static_cast<uint32_t>(insert) | ip_header_length << 8;
+    }
+
+    virtual void do_send_packet(const void* data, uint32_t length, checksum_offload insert) override {
         REQUIRE(length <= 1500);
 
         if (!(ioreg(reg::STATUS) & STATUS_LU)) {
-            dbgout() << "[i825x] Link not up. Dropping packet\n";
+            LOG(ethdev, info) << "Link not up. Dropping packet\n";
+            return;
+        }
+
+        uint32_t ip_header_length = 0, popts = 0;
+        if (static_cast<uint32_t>(insert)) {
+            REQUIRE(static_cast<uint32_t>(insert) <= static_cast<uint32_t>(checksum_offload::ipv4 | checksum_offload::udp));
+            const auto& eh = *static_cast<const ethernet_header*>(data);
+            REQUIRE(length >= sizeof(ethernet_header) + sizeof(ipv4_header) && eh.type == ethertype::ipv4);
+            ip_header_length = reinterpret_cast<const ipv4_header*>(&eh + 1)->ihl * 4;
+            REQUIRE(length >= sizeof(ethernet_header) + ip_header_length + (static_cast<uint32_t>(insert & checksum_offload::udp) ? sizeof(udp_header) : 0));
+            popts = (static_cast<uint32_t>(insert & checksum_offload::ipv4) ? TXD_POPTS_IXSM : 0) | (static_cast<uint32_t>(insert & checksum_offload::udp) ? TXD_POPTS_TXSM : 0);
+        }
+        const bool new_context = popts && tx_context_key(insert, ip_header_length) != tx_context_;
+
+        if (!wait_tx_space(num_tx_descriptors - (new_context ? 3 : 2))) {
             return;
         }
 
-        // prepare descriptor
+        // prepare descriptor(s) (the interrupt handler only frees descriptors, so there's still room)
+        interrupt_disabler id{};
+        if (new_context) {
+            // Applies to the following data descriptors until the next context descriptor
+            auto& cd = reinterpret_cast<volatile tx_context_desc&>(tx_desc_[tx_tail_]);
+            const uint32_t ip_start = sizeof(ethernet_header), udp_start = ip_start + ip_header_length;
+            cd.ipcss          = static_cast<uint8_t>(ip_start);
+            cd.ipcso          = static_cast<uint8_t>(ip_start + offsetof(ipv4_header, checksum));
+            cd.ipcse          = static_cast<uint16_t>(udp_start - 1);
+            cd.tucss          = static_cast<uint8_t>(udp_start);
+            cd.tucso          = static_cast<uint8_t>(udp_start + offsetof(udp_header, checksum));
+            cd.tucse          = 0;
+            cd.cmd_and_length = TXD_DTYP_C | TXD_CMD_DEXT | TXD_CMD_IP | TXD_CMD_RS; // IPv4 and not TCP (i.e. UDP)
+            cd.status         = 0;
+            cd.hdr_len        = 0;
+            cd.mss            = 0;
+            tx_tail_ = (tx_tail_ + 1) % num_tx_descriptors;
+            tx_context_ = tx_context_key(insert, ip_header_length);
+        }
         auto& td = tx_desc_[tx_tail_];
+        memcpy(tx_buffer_[tx_tail_], data, length);
+        td.buffer_addr = tx_buffer_phys_[tx_tail_]; // May have been overwritten by a context descriptor
+        if (popts) {
+            td.lower.data = length | TXD_DTYP_D | TXD_CMD_DEXT | TXD_CMD_RS | TXD_CMD_EOP | TXD_CMD_IFCS;
+            td.upper.data = popts << 8;
+            ++tx_offloaded_;
+        } else {
+            td.lower.data = length | TXD_CMD_RS | TXD_CMD_EOP | TXD_CMD_IFCS;
+            td.upper.data = 0;
+        }
         tx_tail_ = (tx_tail_ + 1) % num_tx_descriptors;
-        REQUIRE(td.upper.fields.status == 0);
-        td.buffer_addr = virt_to_phys(data);
-        td.lower.data = length | TXD_CMD_RS | TXD_CMD_EOP | TXD_CMD_IFCS;
-        td.upper.data = 0;
         _mm_mfence();
         ioreg(reg::TDT0, tx_tail_);
-
-        //dbgout() << "Waiting for packet to be sent.\n";
-        for (uint32_t timeout = 100; !td.upper.fields.status; ) {
-            __halt();
-            if (!timeout--) {
-#if 0
-                // Dump stats
-                constexpr uint32_t nstats = 0x100 / 4;
-                static uint32_t stats[nstats];
-                for (uint32_t i = 0; i < nstats; ++i) {
-                    stats[i] += ioreg(static_cast<reg>(0x4000 + i * 4));
-                    dbgout() << as_hex(stats[i]);
-                    dbgout() << ((i % 8 == 7) ? '\n' : ' ');
-                }
-#endif
-                dbgout() << "Transfer NOT done. Timed out! STATUS = " << as_hex(ioreg(reg::STATUS)) << " TDH = " << ioreg(reg::TDH0) << " TDT " <<  ioreg(reg::TDT0) << "\n";
-#if 0
-                for (uint32_t i = 0; i < num_tx_descriptors; ++i) {
-                    dbgout() << as_hex(tx_desc_[i].buffer_addr) << " ";
-                    dbgout() << as_hex(tx_desc_[i].lower.data) << " ";
-                    dbgout() << as_hex(tx_desc_[i].upper.data) << " ";
-                    dbgout() << ((i % 3 == 2) ? '\n' : ' ');
-                }
-                dbgout() << "\n";
-#endif
-                return;
-            }
-        }
-        //dbgout() << "[i825x] TX Status = " << as_hex(td.upper.fields.status) << "\n";
-        REQUIRE(td.upper.fields.status == TXD_STAT_DD);
-        td.upper.data = 0; // Mark ready for re-use
-        REQUIRE(ioreg(reg::TDH0) == ioreg(reg::TDT0));
-
+        trace(log_category::ethdev, "tx", length, tx_tail_);
+        ++tx_packets_;
     }
 
-    virtual void do_process_packets(const packet_process_function& ppf, int max_packets) override {
+    virtual void do_receive_packets(const packet_receive_function& prf, int max_packets) override {
         REQUIRE(max_packets >= 1);
+        ++rx_polls_;
         for (int i = 0; i < max_packets; ++i) {
             auto& rd = rx_desc_[rx_head_];
             if (!(rd.status & RXD_STAT_DD)) {
+                rx_poll_done(); // Within budget, wait for the next interrupt
+                break;
+            }
+            if (rx_free_.empty()) {
+                // Everything is lent out. The frame stays in the ring until a buffer is returned (polling continues).
+                ++rx_starved_;
                 break;
             }
             REQUIRE(rd.status & RXD_STAT_EOP);
-            dbgout() << "[i825x] RX Status = " << as_hex(rd.status) << " length = " << as_hex(rd.length) << " idx = " << rx_head_ << " error = " << as_hex(rd.errors) << "\n";
-            if (!rd.errors) {
-                ppf(rx_buffer_[rx_head_], rd.length);
+            trace(log_category::ethdev, "rx", rd.length, rd.status | rd.errors << 8);
+            const auto index  = rx_slot_[rx_head_];
+            const auto length = rd.length;
+            // Frames failing the checksum checks (RXCSUM) are passed on unverified, so the stack decides what
+            // to drop in the same way as when the device doesn't check them
+            const bool ok     = !(rd.errors & ~(RXD_ERR_IPE | RXD_ERR_TCPE));
+            checksum_offload verified = checksum_offload::none;
+            if (!(rd.status & RXD_STAT_IXSM)) {
+                if ((rd.status & RXD_STAT_IPCS) && !(rd.errors & RXD_ERR_IPE)) {
+                    verified = verified | checksum_offload::ipv4;
+                }
+                if ((rd.status & RXD_STAT_UDPCS) && !(rd.errors & RXD_ERR_TCPE)) {
+                    verified = verified | checksum_offload::udp;
+                }
+            }
+            if (rd.errors & (RXD_ERR_IPE | RXD_ERR_TCPE)) {
+                ++rx_csum_errors_;
             }
+
+            // Give the descriptor a new buffer, the frame's buffer goes to the receiver
+            rx_slot_[rx_head_] = rx_free_.back();
+            rx_free_.pop_back();
+            rd.buffer_addr = rx_buffer_phys(rx_slot_[rx_head_]);
             rd.status = 0;              // Mark available for SW
             ioreg(reg::RDT0, rx_head_); // Mark available for HW
             rx_head_ = (rx_head_ + 1) % num_rx_descriptors;
+
+            if (ok) {
+                if (static_cast<uint32_t>(verified)) {
+                    ++rx_verified_;
+                }
+                prf(rx_pool_.lend(index, length, verified));
+            } else {
+                rx_free_.push_back(index);
+            }
         }
     }
+
+    virtual const packet_pool* do_rx_pool() const override {
+        return &rx_pool_;
+    }
+
+    virtual offload_features do_features() const override {
+        constexpr auto offloaded = offload_checksums ? checksum_offload::ipv4 | checksum_offload::udp : checksum_offload::none;
+        return { offloaded, offloaded };
+    }
 };
 
 kowned_ptr<ethernet_device> probe(const pci::device_info& dev_info)
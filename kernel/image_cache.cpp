@@ -0,0 +1,125 @@
+#include "image_cache.h"
+#include <attos/out_stream.h>
+#include <attos/string.h>
+
+namespace attos {
+
+// FNV-1a
+uint64_t hash_bytes(const uint8_t* data, uint32_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+shared_image::shared_image(uint64_t hash, const uint8_t* data, uint32_t size, uint32_t image_size)
+    : hash_(hash)
+    , size_(size)
+    , contents_(alloc_physical(size, physical_allocation_flags::no_zero)) {
+    pages_.resize(round_up(image_size, memory_manager::page_size) / memory_manager::page_size);
+    memcpy(static_cast<uint8_t*>(contents_.address()), data, size);
+}
+
+bool shared_image::same_contents(const uint8_t* data, uint32_t size) const {
+    return size == size_ && memcmp(static_cast<const uint8_t*>(contents_.address()), data, size) == 0;
+}
+
+shared_image::~shared_image() {
+    REQUIRE(refs_ == 0);
+}
+
+class image_cache {
+public:
+    // Unreferenced images kept around in case they're started again
+    static constexpr uint32_t max_unused_images = 4;
+
+    static shared_image_ptr acquire(const pe::IMAGE_DOS_HEADER& image) {
+        const auto data = reinterpret_cast<const uint8_t*>(&image);
+        const auto size = pe::file_size_from_header(image);
+        const auto hash = hash_bytes(data, size);
+        shared_image* e = first_;
+        while (e && (e->hash_ != hash || !e->same_contents(data, size))) {
+            e = e->next_;
+        }
+        if (e) {
+            dbgout() << "[image] Reusing " << as_hex(hash) << "\n";
+            if (!e->refs_) {
+                lru_remove(*e);
+            }
+        } else {
+            e = knew<shared_image>(hash, data, size, image.nt_headers().OptionalHeader.SizeOfImage).release();
+            e->next_ = first_;
+            first_ = e;
+        }
+        ++e->refs_;
+        return shared_image_ptr{e};
+    }
+
+    static void release(shared_image& e) {
+        REQUIRE(e.refs_ > 0);
+        if (--e.refs_) {
+            return;
+        }
+        // Most recently used first
+        e.lru_next_ = lru_first_;
+        if (lru_first_) {
+            lru_first_->lru_prev_ = &e;
+        } else {
+            lru_last_ = &e;
+        }
+        lru_first_ = &e;
+        if (++unused_count_ > max_unused_images) {
+            destroy(*lru_last_);
+        }
+    }
+
+    static void clear() {
+        while (lru_last_) {
+            destroy(*lru_last_);
+        }
+        REQUIRE(!first_);
+    }
+
+private:
+    static shared_image* first_;
+    static shared_image* lru_first_;
+    static shared_image* lru_last_;
+    static uint32_t      unused_count_;
+
+    static void lru_remove(shared_image& e) {
+        (e.lru_prev_ ? e.lru_prev_->lru_next_ : lru_first_) = e.lru_next_;
+        (e.lru_next_ ? e.lru_next_->lru_prev_ : lru_last_) = e.lru_prev_;
+        e.lru_prev_ = e.lru_next_ = nullptr;
+        --unused_count_;
+    }
+
+    static void destroy(shared_image& e) {
+        lru_remove(e);
+        auto p = &first_;
+        while (*p != &e) {
+            REQUIRE(*p);
+            p = &(*p)->next_;
+        }
+        *p = e.next_;
+        kowned_ptr<shared_image>{&e}.reset();
+    }
+};
+shared_image* image_cache::first_;
+shared_image* image_cache::lru_first_;
+shared_image* image_cache::lru_last_;
+uint32_t      image_cache::unused_count_;
+
+void shared_image_deleter::operator()(shared_image* image) {
+    image_cache::release(*image);
+}
+
+shared_image_ptr image_cache_acquire(const pe::IMAGE_DOS_HEADER& image) {
+    return image_cache::acquire(image);
+}
+
+void image_cache_clear() {
+    image_cache::clear();
+}
+
+} // namespace attos
@@ -0,0 +1,68 @@
+#ifndef ATTOS_IMAGE_CACHE_H
+#define ATTOS_IMAGE_CACHE_H
+
+#include <attos/cpu.h>
+#include <attos/mem.h>
+#include <attos/containers.h>
+#include <attos/pe.h>
+#include "mm.h"
+
+namespace attos {
+
+// Read-only pages of an executable shared by all processes running it. Images are identified by their contents
+// (found by hash, then compared), so starting the same file again maps the pages loaded the first time.
+class shared_image {
+public:
+    explicit shared_image(uint64_t hash, const uint8_t* data, uint32_t size, uint32_t image_size);
+    ~shared_image();
+    shared_image(const shared_image&) = delete;
+    shared_image& operator=(const shared_image&) = delete;
+
+    uint64_t hash() const { return hash_; }
+    uint32_t size() const { return size_; }
+
+    // True if the image was created from the `size' bytes at `data'
+    bool same_contents(const uint8_t* data, uint32_t size) const;
+
+    // Returns the page at `rva'. The first time `load' is called with the (uninitialized) page to fill it.
+    template<typename Load>
+    physical_address page(uint64_t rva, Load load) {
+        REQUIRE(rva < pages_.size() * memory_manager::page_size);
+        auto& p = pages_[rva / memory_manager::page_size];
+        if (!p) {
+            auto phys = alloc_physical(memory_manager::page_size, physical_allocation_flags::no_zero);
+            load(static_cast<uint8_t*>(phys.address()));
+            p = phys.address();
+            allocations_.push_back(std::move(phys));
+        }
+        return p;
+    }
+
+private:
+    uint64_t                     hash_;
+    uint32_t                     size_;
+    uint32_t                     refs_ = 0;
+    shared_image*                next_ = nullptr;     // All cached images
+    shared_image*                lru_prev_ = nullptr; // Unreferenced images, most recently used first
+    shared_image*                lru_next_ = nullptr;
+    kvector<physical_address>    pages_;              // Indexed by rva / page_size, null until loaded
+    kvector<physical_allocation> allocations_;
+    physical_allocation          contents_;           // Copy of the file, the hash alone could collide
+
+    friend class image_cache;
+};
+
+struct shared_image_deleter {
+    void operator()(shared_image* image);
+};
+using shared_image_ptr = owned_ptr<shared_image, shared_image_deleter>;
+
+// Returns the (possibly new) cache entry for `image', which must be readable in the current address space
+shared_image_ptr image_cache_acquire(const pe::IMAGE_DOS_HEADER& image);
+
+// Frees all cached images, none may be in use
+void image_cache_clear();
+
+} // namespace attos
+
+#endif
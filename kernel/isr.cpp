@@ -6,6 +6,7 @@
 #include <attos/out_stream.h>
 #include <attos/pe.h>
 #include "mm.h"
+#include "apic.h"
 
 namespace attos {
 
@@ -274,6 +275,67 @@ private:
     uint16_t old_pic_mask_;
 };
 
+// Masks, unmasks and acknowledges the legacy (ISA) IRQs
+class __declspec(novtable) interrupt_controller {
+public:
+    void mask(uint8_t irq) {
+        do_mask(irq);
+    }
+
+    void unmask(uint8_t irq) {
+        do_unmask(irq);
+    }
+
+    void eoi(uint8_t irq) {
+        do_eoi(irq);
+    }
+
+private:
+    virtual void do_mask(uint8_t irq) = 0;
+    virtual void do_unmask(uint8_t irq) = 0;
+    virtual void do_eoi(uint8_t irq) = 0;
+};
+
+class pic_controller : public interrupt_controller {
+private:
+    virtual void do_mask(uint8_t irq) override {
+        pic_mask_irq(irq);
+    }
+
+    virtual void do_unmask(uint8_t irq) override {
+        pic_unmask_irq(irq);
+    }
+
+    virtual void do_eoi(uint8_t irq) override {
+        pic_send_eoi(irq);
+    }
+};
+
+// IRQs are delivered to the boot processor with the same vectors as when using the PIC
+class apic_controller : public interrupt_controller {
+private:
+    virtual void do_mask(uint8_t irq) override {
+        apic::mask_isa_irq(irq);
+    }
+
+    virtual void do_unmask(uint8_t irq) override {
+        // Only route lines in use, e.g. IRQ0 is usually connected to the same I/O APIC input as IRQ2 would be
+        apic::route_isa_irq(irq, static_cast<uint8_t>(interrupt_number::IRQ0) + irq, apic::local_id());
+        apic::unmask_isa_irq(irq);
+    }
+
+    virtual void do_eoi(uint8_t) override {
+        apic::eoi();
+    }
+};
+
+out_stream& operator<<(out_stream& os, const latency_stats& s) {
+    if (!s.count) {
+        return os << "no samples";
+    }
+    return os << s.count << " samples min " << s.min << " avg " << s.total / s.count << " max " << s.max << " cycles";
+}
+
 struct symbol_info {
     uint64_t    address;
     const char* text;
@@ -341,7 +403,7 @@ void set_idt_entry(interrupt_gate& idt, void* code, descriptor_privilege_level d
 
 class isr_handler_impl : public isr_handler, public singleton<isr_handler_impl> {
 public:
-    explicit isr_handler_impl(const char* debug_info_text) : debug_info_(debug_info_text), irq_handlers_() {
+    explicit isr_handler_impl(const char* debug_info_text) : debug_info_(debug_info_text), irq_handlers_(), vector_handlers_() {
         __sidt(&old_idt_desc_);
         dbgout() << "[isr] Loading interrupt descriptor table.\n";
 
@@ -378,14 +440,23 @@ public:
     ~isr_handler_impl() {
         dbgout() << "[isr] Shutting down. Restoring IDT to limit " << as_hex(old_idt_desc_.limit) << " base " << as_hex(old_idt_desc_.base) << "\n";
         REQUIRE(std::none_of(irq_handlers_.begin(), irq_handlers_.end(), [](irq_handler_t h) { return !!h; }));
+        REQUIRE(!page_fault_handler_);
+        REQUIRE(!device_not_available_handler_);
+        REQUIRE(!user_return_handler_);
+        REQUIRE(std::none_of(vector_handlers_.begin(), vector_handlers_.end(), [](irq_handler_t h) { return !!h; }));
+        REQUIRE(controller_ == &pic_controller_);
+        dbgout() << "[isr] IRQ entry to EOI using the PIC: " << pic_eoi_latency_ << "\n";
+        dbgout() << "[isr] IRQ entry to EOI using the I/O APIC: " << apic_eoi_latency_ << "\n";
+        dbgout() << "[isr] Vector (local APIC timer, MSI) entry to return: " << vector_latency_ << "\n";
         _disable();
         __lidt(&old_idt_desc_);
     }
 
-    bool on_irq(uint8_t irq) {
+    bool on_irq(uint8_t irq, uint64_t entry_tsc) {
         if (auto handler = irq_handlers_[irq]) {
             handler();
-            pic_send_eoi(irq);
+            controller_->eoi(irq);
+            eoi_latency_->add(__rdtsc() - entry_tsc);
             return true;
         }
         return false;
@@ -395,13 +466,90 @@ public:
         dbgout() << "[isr] Unmasking IRQ " << irq << "\n";
         REQUIRE(!irq_handlers_[irq]);
         irq_handlers_[irq] = irq_handler;
-        pic_unmask_irq(irq);
+        controller_->unmask(irq);
         return isr_registration_ptr{knew<isr_registration_impl>(*this, irq).release()};
     }
 
+    bool on_page_fault(uint32_t error_code) {
+        return page_fault_handler_ && page_fault_handler_(__readcr2(), error_code);
+    }
+
+    isr_registration_ptr register_page_fault_handler(page_fault_handler_t page_fault_handler) {
+        REQUIRE(!page_fault_handler_);
+        page_fault_handler_ = page_fault_handler;
+        return isr_registration_ptr{knew<handler_registration_impl<page_fault_handler_t>>(page_fault_handler_).release()};
+    }
+
+    bool on_device_not_available() {
+        return device_not_available_handler_ && device_not_available_handler_();
+    }
+
+    isr_registration_ptr register_device_not_available_handler(device_not_available_handler_t device_not_available_handler) {
+        REQUIRE(!device_not_available_handler_);
+        device_not_available_handler_ = device_not_available_handler;
+        return isr_registration_ptr{knew<handler_registration_impl<device_not_available_handler_t>>(device_not_available_handler_).release()};
+    }
+
+    void on_user_return(registers& r) {
+        if (user_return_handler_) {
+            user_return_handler_(r);
+        }
+    }
+
+    isr_registration_ptr register_user_return_handler(user_return_handler_t user_return_handler) {
+        REQUIRE(!user_return_handler_);
+        user_return_handler_ = user_return_handler;
+        return isr_registration_ptr{knew<handler_registration_impl<user_return_handler_t>>(user_return_handler_).release()};
+    }
+
+    bool on_vector(uint8_t vector, uint64_t entry_tsc) {
+        if (vector >= first_free_vector) {
+            if (auto handler = vector_handlers_[vector - first_free_vector]) {
+                handler(); // Signals EOI itself
+                if (current_cpu() == 0) {
+                    vector_latency_.add(__rdtsc() - entry_tsc);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    isr_registration_ptr register_vector_handler(uint8_t vector, irq_handler_t vector_handler) {
+        REQUIRE(vector >= first_free_vector);
+        auto& handler = vector_handlers_[vector - first_free_vector];
+        REQUIRE(!handler);
+        handler = vector_handler;
+        return isr_registration_ptr{knew<handler_registration_impl<irq_handler_t>>(handler).release()};
+    }
+
+    uint8_t find_free_vector() const {
+        // Search upwards, the local APIC prioritizes interrupts by the upper 4 bits of the vector
+        for (int i = 0; i < idt_count - first_free_vector; ++i) {
+            if (!vector_handlers_[i]) {
+                return static_cast<uint8_t>(first_free_vector + i);
+            }
+        }
+        REQUIRE(false && "No free interrupt vectors");
+        return 0;
+    }
+
+    isr_registration_ptr use_apic() {
+        REQUIRE(apic::available());
+        REQUIRE(controller_ == &pic_controller_);
+        dbgout() << "[isr] Routing IRQs through the I/O APIC\n";
+        switch_controller(apic_controller_, apic_eoi_latency_);
+        return isr_registration_ptr{knew<apic_registration_impl>(*this).release()};
+    }
+
+    void ap_init() {
+        __lidt(&idt_desc_);
+    }
+
 private:
-    static constexpr int idt_count     = 256;
-    static constexpr int isr_code_size = 9;
+    static constexpr int idt_count         = 256;
+    static constexpr int first_free_vector = static_cast<int>(interrupt_number::IRQF) + 1;
+    static constexpr int isr_code_size     = 9;
     static_assert(isr_code_size * idt_count <= memory_manager::page_size, "");
 
     debug_info_manager              debug_info_;
@@ -411,6 +559,30 @@ private:
     idt_descriptor                  idt_desc_;
     uint8_t                         isr_code_[isr_code_size * idt_count];
     std::array<irq_handler_t, 16>   irq_handlers_;
+    page_fault_handler_t            page_fault_handler_;
+    device_not_available_handler_t  device_not_available_handler_;
+    user_return_handler_t           user_return_handler_;
+    std::array<irq_handler_t, idt_count - first_free_vector> vector_handlers_;
+    pic_controller                  pic_controller_;
+    apic_controller                 apic_controller_;
+    interrupt_controller*           controller_ = &pic_controller_;
+    latency_stats                   pic_eoi_latency_;
+    latency_stats                   apic_eoi_latency_;
+    latency_stats*                  eoi_latency_ = &pic_eoi_latency_;
+    latency_stats                   vector_latency_; // Only measured on the boot processor
+
+    // Moves the IRQs with handlers to `controller'
+    void switch_controller(interrupt_controller& controller, latency_stats& eoi_latency) {
+        interrupt_disabler disabler{};
+        for (uint8_t irq = 0; irq < irq_handlers_.size(); ++irq) {
+            if (irq_handlers_[irq]) {
+                controller_->mask(irq);
+                controller.unmask(irq);
+            }
+        }
+        controller_  = &controller;
+        eoi_latency_ = &eoi_latency;
+    }
 
     class isr_registration_impl : public isr_registration {
     public:
@@ -419,7 +591,7 @@ private:
         }
         ~isr_registration_impl() {
             dbgout() << "isr_registration_impl::~isr_registration_impl() irq = " << irq_ << "\n";
-            pic_mask_irq(irq_);
+            parent_.controller_->mask(irq_);
             REQUIRE(!!parent_.irq_handlers_[irq_]);
             parent_.irq_handlers_[irq_] = nullptr;
         }
@@ -429,6 +601,36 @@ private:
         isr_handler_impl& parent_;
         uint8_t           irq_;
     };
+
+    class apic_registration_impl : public isr_registration {
+    public:
+        explicit apic_registration_impl(isr_handler_impl& parent) : parent_(parent) {
+        }
+        ~apic_registration_impl() {
+            dbgout() << "[isr] Routing IRQs through the PIC\n";
+            parent_.switch_controller(parent_.pic_controller_, parent_.pic_eoi_latency_);
+        }
+        apic_registration_impl(const apic_registration_impl&) = delete;
+        apic_registration_impl& operator=(const apic_registration_impl&) = delete;
+    private:
+        isr_handler_impl& parent_;
+    };
+
+    // Clears a (non-IRQ) handler when destroyed
+    template<typename Handler>
+    class handler_registration_impl : public isr_registration {
+    public:
+        explicit handler_registration_impl(Handler& handler) : handler_(handler) {
+        }
+        ~handler_registration_impl() {
+            REQUIRE(!!handler_);
+            handler_ = nullptr;
+        }
+        handler_registration_impl(const handler_registration_impl&) = delete;
+        handler_registration_impl& operator=(const handler_registration_impl&) = delete;
+    private:
+        Handler& handler_;
+    };
 };
 
 pe::IMAGE_DOS_HEADER* user_image;
@@ -520,8 +722,20 @@ __declspec(noreturn) void unhandled_interrupt(const registers& r)
 
 void interrupt_service_routine(registers& r)
 {
-    if (is_irq(r.interrupt_no) && isr_handler_impl::instance().on_irq(irq_number(r.interrupt_no))) {
-        // Handled
+    const auto entry_tsc = __rdtsc();
+    if (is_irq(r.interrupt_no) && isr_handler_impl::instance().on_irq(irq_number(r.interrupt_no), entry_tsc)) {
+        if ((r.cs & 3) == 3) {
+            isr_handler_impl::instance().on_user_return(r);
+        }
+    } else if (isr_handler_impl::instance().on_vector(static_cast<uint8_t>(r.interrupt_no), entry_tsc)) {
+        // Inter-processor interrupt, local APIC timer, MSI etc.
+        if ((r.cs & 3) == 3) {
+            isr_handler_impl::instance().on_user_return(r);
+        }
+    } else if (r.interrupt_no == interrupt_number::PF && isr_handler_impl::instance().on_page_fault(static_cast<uint32_t>(r.error_code))) {
+        // Page was faulted in
+    } else if (r.interrupt_no == interrupt_number::NM && (r.cs & 3) == 3 && isr_handler_impl::instance().on_device_not_available()) {
+        // x87/SSE registers of the current context were loaded
     } else {
         unhandled_interrupt(r);
     }
@@ -538,4 +752,39 @@ isr_registration_ptr register_irq_handler(uint8_t irq, irq_handler_t irq_handler
     return isr_handler_impl::instance().register_irq_handler(irq, irq_handler);
 }
 
+isr_registration_ptr register_page_fault_handler(page_fault_handler_t page_fault_handler)
+{
+    return isr_handler_impl::instance().register_page_fault_handler(page_fault_handler);
+}
+
+isr_registration_ptr register_device_not_available_handler(device_not_available_handler_t device_not_available_handler)
+{
+    return isr_handler_impl::instance().register_device_not_available_handler(device_not_available_handler);
+}
+
+isr_registration_ptr register_user_return_handler(user_return_handler_t user_return_handler)
+{
+    return isr_handler_impl::instance().register_user_return_handler(user_return_handler);
+}
+
+isr_registration_ptr register_vector_handler(uint8_t vector, irq_handler_t vector_handler)
+{
+    return isr_handler_impl::instance().register_vector_handler(vector, vector_handler);
+}
+
+uint8_t find_free_vector()
+{
+    return isr_handler_impl::instance().find_free_vector();
+}
+
+isr_registration_ptr isr_use_apic()
+{
+    return isr_handler_impl::instance().use_apic();
+}
+
+void isr_ap_init()
+{
+    isr_handler_impl::instance().ap_init();
+}
+
 } // namespace attos
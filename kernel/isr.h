@@ -1,8 +1,10 @@
 #ifndef ATTOS_ISR_H
 #define ATTOS_ISR_H
 
+#include <algorithm>
 #include <attos/containers.h>
 #include <attos/function.h>
+#include <attos/cpu.h>
 
 namespace attos {
 
@@ -13,6 +15,13 @@ public:
 using isr_registration_ptr = kowned_ptr<isr_registration>;
 
 using irq_handler_t = function<void ()>;
+// Called with the faulting address (cr2) and the error code, returns true if the fault was resolved
+using page_fault_handler_t = function<bool (uint64_t, uint32_t)>;
+// Called when an x87/SSE instruction is executed with CR0.TS set, returns true if the registers were loaded
+using device_not_available_handler_t = function<bool ()>;
+// Called with the interrupted context after an IRQ interrupting user mode has been handled. The context may be
+// replaced to resume somewhere else (e.g. in another process).
+using user_return_handler_t = function<void (registers&)>;
 
 class __declspec(novtable) isr_handler {
 public:
@@ -22,6 +31,37 @@ public:
 owned_ptr<isr_handler, destruct_deleter> isr_init(const char* debug_info_text);
 
 isr_registration_ptr register_irq_handler(uint8_t irq, irq_handler_t irq_handler);
+isr_registration_ptr register_page_fault_handler(page_fault_handler_t page_fault_handler);
+isr_registration_ptr register_device_not_available_handler(device_not_available_handler_t device_not_available_handler);
+isr_registration_ptr register_user_return_handler(user_return_handler_t user_return_handler);
+// Handles an interrupt vector not used by exceptions or the PIC (e.g. an inter-processor interrupt). The
+// handler is responsible for signaling the end of the interrupt.
+isr_registration_ptr register_vector_handler(uint8_t vector, irq_handler_t vector_handler);
+// Returns a vector without a handler (for register_vector_handler)
+uint8_t find_free_vector();
+
+// Routes IRQs through the I/O APIC instead of the 8259 PIC until the returned registration is destroyed. Requires
+// apic::init().
+isr_registration_ptr isr_use_apic();
+
+// Min/average/max of a repeated measurement (in TSC cycles)
+struct latency_stats {
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t min   = UINT64_MAX;
+    uint64_t max   = 0;
+
+    void add(uint64_t cycles) {
+        ++count;
+        total += cycles;
+        min = std::min(min, cycles);
+        max = std::max(max, cycles);
+    }
+};
+out_stream& operator<<(out_stream& os, const latency_stats& s);
+
+// Loads the interrupt descriptor table on an application processor
+void isr_ap_init();
 
 namespace pe { struct IMAGE_DOS_HEADER; }
 void print_default_stack_trace(out_stream& os, int skip);
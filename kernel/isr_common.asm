@@ -9,6 +9,7 @@
     global isr_common
 
     extern interrupt_service_routine ; void interrupt_service_routine(registers&)
+    extern fpu_eager_switching       ; uint32_t
 
 struc interrupt_gate
     .offset_low  resw 1
@@ -20,9 +21,10 @@ struc interrupt_gate
     .reserved    resd 1
 endstruc
 
-%define isr_local_size (32) ; 32 bytes for the shadow space
+%define isr_local_size (32+512) ; 32 bytes for the shadow space, 512 for fpu_eager_save
 %define isr_common_stack_alloc registers.saved_size + isr_local_size
 %define isr_registers_offset isr_local_size
+%define isr_fx_offset 32
 
 %define isr_common_reg_offset(REG)  isr_registers_offset + registers.%+REG
 
@@ -54,8 +56,16 @@ win64_proc isr_common
     isr_save_reg r15
     win64_prologue_end
 
-    ; save fx state
-    fxsave [rsp+isr_common_reg_offset(fx_state)]
+    ; interrupted user mode, switch to the kernel GS base
+    test byte [rsp+isr_common_reg_offset(cs)], 3
+    jz .from_kernel
+    swapgs
+    fpu_enter_from_user
+.from_kernel:
+
+    ; save the x87/SSE registers kernel code may use, the rest are only switched on demand (see fpu.cpp)
+    save_fpu_volatile rsp+isr_registers_offset
+    fpu_eager_save rsp+isr_fx_offset
 
     ; ensure direction flag is cleared
     cld
@@ -63,8 +73,15 @@ win64_proc isr_common
     lea  rcx, [rsp+isr_registers_offset] ; arg = registers&
     call interrupt_service_routine
 
-    ; restore fx state
-    fxrstor [rsp+isr_common_reg_offset(fx_state)]
+    fpu_eager_restore rsp+isr_fx_offset, rax
+    restore_fpu_volatile rsp+isr_registers_offset
+
+    ; returning to user mode (possibly a different context), switch back to the user GS base
+    test byte [rsp+isr_common_reg_offset(cs)], 3
+    jz .to_kernel
+    fpu_return_to_user rax
+    swapgs
+.to_kernel:
 
     ; restore registers
     win64_epilogue
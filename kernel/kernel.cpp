@@ -13,10 +13,16 @@
 #include "text_screen.h"
 #include "i825x.h"
 #include "ps2.h"
+#include "image_cache.h"
+#include "smp.h"
+#include "apic.h"
+#include "timer.h"
+#include "fpu.h"
 #include <attos/net/tftp.h>
 #include <attos/string.h>
 #include <attos/syscall.h>
 #include <attos/in_stream.h>
+#include <attos/log.h>
 
 #define assert REQUIRE // undefined yadayda
 #include <attos/tree.h>
@@ -24,7 +30,13 @@
 namespace attos {
 
 void yield() {
-    __halt();
+    // Only halt if there was no background work to do, otherwise the caller gets to poll again right away
+    if (!mm_idle()) {
+        // There are no periodic timer interrupts, so make sure callers polling for a deadline get to run again
+        constexpr uint64_t max_halt_ns = 10 * ns_per_ms;
+        timer::ensure_wakeup(max_halt_ns);
+        __halt();
+    }
 }
 
 void fatal_error(const char* file, int line, const char* detail) {
@@ -65,7 +77,7 @@ owned_ptr<memory_manager, destruct_deleter> construct_mm(const smap_entry* smap,
     constexpr uint64_t min_len_megabytes = 4;
     constexpr uint64_t min_base = 1ULL << 20;
     constexpr uint64_t min_len  = min_len_megabytes << 20;
-    constexpr uint64_t max_base = identity_map_length - min_len_megabytes;
+    constexpr uint64_t max_base = identity_map_length - min_len;
 
     // TODO: Handle unaligned areas
     for (auto e = smap; e->type != smap_type::end_of_list; ++e) {
@@ -74,7 +86,7 @@ owned_ptr<memory_manager, destruct_deleter> construct_mm(const smap_entry* smap,
             if (!base_len) {
                 // Selected this one
                 base_addr = physical_address{e->base};
-                base_len  = e->length;
+                base_len  = std::min(e->length, identity_map_length - e->base); // Physical pages are accessed through the identity map
                 dbgout() << " *\n";
             } else {
                 // We would have selected this one
@@ -112,33 +124,15 @@ owned_ptr<memory_manager, destruct_deleter> construct_mm(const smap_entry* smap,
 
 using namespace attos;
 
-class interrupt_timer : public singleton<interrupt_timer> {
-public:
-    explicit interrupt_timer() {
-        reg_ = register_irq_handler(irq, [this]() { isr(); });
-    }
-    ~interrupt_timer() {
-        reg_.reset();
-        dbgout() << "[pit] " << pit_ticks_ << " ticks elapsed\n";
-    }
-
-private:
-    std::atomic<uint64_t> pit_ticks_{0};
-    isr_registration_ptr reg_;
-
-    static constexpr uint8_t irq = 0;
-    void isr() {
-        ++pit_ticks_;
-        ++*static_cast<uint8_t*>(physical_address{0xb8000});
-    }
-};
-
 enum class kernel_object_protocol_number {
     read,
     write,
     process,
+    wait,
 
     hack_mem_map,
+    ring,
+    ethdev,
 };
 
 template<kernel_object_protocol_number>
@@ -148,8 +142,14 @@ template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::r
 template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::write> { using type = out_stream; };
 class user_process;
 template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::process> { using type = user_process; };
+class waitable;
+template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::wait> { using type = waitable; };
 class mem_map_helper;
 template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::hack_mem_map> { using type = mem_map_helper; };
+class ko_ring;
+template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::ring> { using type = ko_ring; };
+class ko_ethdev;
+template<> struct kernel_object_protocol_traits<kernel_object_protocol_number::ethdev> { using type = ko_ethdev; };
 
 class __declspec(novtable) kernel_object {
 public:
@@ -190,6 +190,7 @@ private:
         }
     };
 
+protected:
     virtual void* do_get_protocol(kernel_object_protocol_number protocol) {
         return get_protocol_impl<protocols...>::get(static_cast<Derived*>(this), protocol);
     }
@@ -258,35 +259,56 @@ private:
     }
 };
 
-class user_process : public kernel_object_helper<user_process, kernel_object_protocol_number::process> {
+// Processes blocked until something happens (typically an interrupt delivering data)
+class wait_queue {
 public:
-    explicit user_process() : mm_(create_default_memory_manager()), context_() {
-        next_ = first_process_;
-        first_process_ = this;
+    constexpr wait_queue() = default;
+    wait_queue(const wait_queue&) = delete;
+    wait_queue& operator=(const wait_queue&) = delete;
+
+    // Makes all waiting processes ready to run, can be called from interrupt handlers
+    void wake_all();
+
+private:
+    user_process* head_ = nullptr;
+
+    friend user_process;
+    void add(user_process& p);
+    void remove(user_process& p);
+};
+
+// Kernel objects a process can block on until they have data (see syscall_number::wait)
+class __declspec(novtable) waitable {
+public:
+    // Returns true if a read would return data right away
+    bool ready() {
+        return do_ready();
     }
 
-    user_process(user_process&&) = default;
-    user_process& operator=(user_process&&) = default;
+    wait_queue& waiters() {
+        return do_waiters();
+    }
+
+private:
+    virtual bool do_ready() = 0;
+    virtual wait_queue& do_waiters() = 0;
+};
+
+class user_process : public kernel_object_helper<user_process, kernel_object_protocol_number::process> {
+public:
+    explicit user_process() : mm_(create_default_memory_manager()), context_(), timeout_([this]() { on_timeout(); }) {
+    }
 
     ~user_process() {
         REQUIRE(state_ == states::created || state_ == states::exited);
         REQUIRE(current_process_ != this);
+        REQUIRE(!ready_next_ && ready_tail_ != this);
         for (auto& o : objects_) {
             if (o) {
                 dbgout() << "[user] Warning: Unfreed object\n";
                 o.reset();
             }
         }
-        if (this == first_process_) {
-            first_process_ = next_;
-        } else {
-            auto p = first_process_;
-            while (p->next_ != this) {
-                REQUIRE(p->next_);
-                p = p->next_;
-            }
-            p->next_ = next_;
-        }
     }
 
     bool running() const {
@@ -313,20 +335,34 @@ public:
         image_base_ = image_base;
     }
 
-    void alloc_and_copy_section(virtual_address virt, uint32_t virt_size, memory_type t, const void* source, uint32_t src_size) {
+    // Sections are loaded from `image', which lives in the address space of `owner' (nullptr for kernel memory).
+    // The image must stay around until the process has exited.
+    void image_source(user_process* owner, const void* image) {
         REQUIRE(state_ == states::created);
-        constexpr auto page_mask = memory_manager::page_size-1;
-        REQUIRE((virt & page_mask) == 0);
+        source_owner_ = owner;
+        source_image_ = static_cast<const uint8_t*>(image);
+    }
 
-        const auto phys_size = round_up(virt_size, memory_manager::page_size);
-        allocations_.push_back(alloc_physical(phys_size));
-        auto& phys = allocations_.back();
+    // Read-only pages are taken from (and loaded into) `image' instead of being private to the process
+    void shared_pages(shared_image_ptr&& image) {
+        REQUIRE(state_ == states::created);
+        shared_image_ = std::move(image);
+    }
 
-        if (src_size) {
-            const auto to_copy = std::min(virt_size, src_size);
-            memcpy(static_cast<void*>(phys.address()), source, to_copy);
+    // Reserves the section, pages are loaded from the image (or zero filled) when first touched
+    void map_section(virtual_address virt, uint32_t virt_size, memory_type t, uint32_t source_offset, uint32_t src_size) {
+        REQUIRE(state_ == states::created);
+        REQUIRE((virt & page_mask) == 0);
+        const auto length = round_up(static_cast<uint64_t>(virt_size), memory_manager::page_size);
+        mm_->reserve_memory(virt, length, t);
+        sections_.push_back(lazy_section{virt, length, t, source_offset, std::min(virt_size, src_size)});
+    }
+
+    bool handle_page_fault(uint64_t address, uint32_t error_code) {
+        if (error_code & (pf_error_code_mask_p | pf_error_code_mask_r)) {
+            return false; // Protection violation, not a missing page
         }
-        mm_->map_memory(virt, phys_size, t, phys.address());
+        return fault_in(virtual_address{address & ~page_mask});
     }
 
     void start() {
@@ -338,6 +374,7 @@ public:
         REQUIRE(state_ == states::running);
         REQUIRE(current_process_ == this);
         current_process_ = nullptr;
+        fpu::set_current(nullptr);
         hack_set_user_image(nullptr);
     }
 
@@ -356,6 +393,63 @@ public:
         REQUIRE(state_ == states::running);
         exit_code_ = exit_code;
         state_ = states::exited;
+        if (waiter_) {
+            waiter_->wake(0);
+            waiter_ = nullptr;
+        }
+    }
+
+    // Blocks the (switched from) process until `child' exits
+    void wait_for_exit(user_process& child) {
+        REQUIRE(!child.waiter_ && child.state_ != states::exited);
+        block();
+        child.waiter_ = this;
+    }
+
+    // Blocks the (switched from) process on `queue' until it's woken or monotonic_ns() reaches `deadline_ns'
+    // (unless it's 0). The result of the wait (1 if woken, 0 on timeout) is returned in rax.
+    void block_on(wait_queue& queue, uint64_t deadline_ns) {
+        block();
+        queue.add(*this);
+        waiting_on_ = &queue;
+        if (deadline_ns) {
+            timer::arm(timeout_, deadline_ns);
+        }
+    }
+
+    static bool any_blocked() {
+        return blocked_count_ != 0;
+    }
+
+    // Adds a running (but switched from) process to the back of the ready queue
+    static void make_ready(user_process& p) {
+        REQUIRE(p.state_ == states::running && current_process_ != &p);
+        REQUIRE(!p.ready_next_ && ready_tail_ != &p);
+        p.ready_tsc_ = __rdtsc();
+        (ready_tail_ ? ready_tail_->ready_next_ : ready_head_) = &p;
+        ready_tail_ = &p;
+    }
+
+    // Removes the process that has been ready the longest from the queue, returns nullptr if there are none
+    static user_process* take_ready() {
+        auto p = ready_head_;
+        if (p) {
+            if (!(ready_head_ = p->ready_next_)) {
+                ready_tail_ = nullptr;
+            }
+            p->ready_next_ = nullptr;
+            dispatch_latency_.add(__rdtsc() - p->ready_tsc_);
+        }
+        return p;
+    }
+
+    static bool any_ready() {
+        return ready_head_ != nullptr;
+    }
+
+    // Cycles spent in the ready queue before running
+    static const latency_stats& dispatch_latency() {
+        return dispatch_latency_;
     }
 
     // Handle = Index + 1
@@ -385,32 +479,129 @@ public:
         return *objects_[handle - 1];
     }
 
-    static kvector<user_process*> all_processes() {
-        kvector<user_process*> res;
-        for (auto p = first_process_; p; p = p->next_) {
-            res.push_back(p);
-        }
-        return res;
-    }
-
     static user_process& current() {
         REQUIRE(current_process_ != nullptr);
         return *current_process_;
     }
 
+    static bool has_current() {
+        return current_process_ != nullptr;
+    }
+
 private:
     static constexpr int max_objects = 16;
-    enum class states { created, running, exited } state_ = states::created;
+    static constexpr uint64_t page_mask = memory_manager::page_size - 1;
+
+    struct lazy_section {
+        virtual_address virt;
+        uint64_t        length;
+        memory_type     type;
+        uint32_t        source_offset;  // Offset of the section data in the image
+        uint32_t        source_size;    // Bytes of section data, the rest of the section is zero filled
+    };
+    enum class states { created, running, blocked, exited } state_ = states::created;
     kowned_ptr<memory_manager>         mm_;
     kvector<physical_allocation>       allocations_;
+    kvector<lazy_section>              sections_;
+    user_process*                      source_owner_ = nullptr;
+    const uint8_t*                     source_image_ = nullptr;
+    shared_image_ptr                   shared_image_;
     registers                          context_;
+    fpu::state                         fpu_;                   // The rest of the x87/SSE state
     uint64_t                           exit_code_ = 0;
     kowned_ptr<kernel_object>          objects_[max_objects];
     virtual_address                    image_base_;
-    user_process*                      next_;
+    user_process*                      waiter_ = nullptr;      // Blocked until this process exits
+    user_process*                      ready_next_ = nullptr;  // Next in the ready queue
+    uint64_t                           ready_tsc_ = 0;         // When the process was made ready
+    wait_queue*                        waiting_on_ = nullptr;
+    user_process*                      wait_next_ = nullptr;   // Next in waiting_on_
+    timer::event                       timeout_;               // Armed while blocked with a timeout
+
+    friend wait_queue;
 
     static user_process*               current_process_;
-    static user_process*               first_process_;
+    static user_process*               ready_head_;
+    static user_process*               ready_tail_;
+    static latency_stats               dispatch_latency_;
+    static uint32_t                    blocked_count_;
+
+    void block() {
+        REQUIRE(state_ == states::running && current_process_ != this);
+        REQUIRE(!ready_next_ && ready_tail_ != this);
+        state_ = states::blocked;
+        ++blocked_count_;
+    }
+
+    // Makes the blocked process ready with `result' as the return value of the blocking syscall
+    void wake(uint64_t result) {
+        REQUIRE(state_ == states::blocked);
+        timer::cancel(timeout_);
+        waiting_on_ = nullptr;
+        context_.rax = result;
+        state_ = states::running;
+        --blocked_count_;
+        make_ready(*this);
+    }
+
+    void on_timeout() {
+        waiting_on_->remove(*this);
+        wake(0);
+    }
+
+    // Returns the physical address of `p' in the source image, which might have to be faulted in first
+    physical_address source_address(const uint8_t* p) {
+        if (!source_owner_) {
+            return virt_to_phys(p);
+        }
+        const auto virt = virtual_address::in_current_address_space(p);
+        physical_address phys;
+        if (!source_owner_->mm().lookup_page(virt, phys)) {
+            REQUIRE(source_owner_->fault_in(virtual_address{virt & ~page_mask}));
+            REQUIRE(source_owner_->mm().lookup_page(virt, phys));
+        }
+        return phys;
+    }
+
+    bool fault_in(virtual_address page) {
+        auto s = std::find_if(sections_.begin(), sections_.end(), [page](const lazy_section& ls) { return page >= ls.virt && page < ls.virt + ls.length; });
+        if (s == sections_.end()) {
+            return false;
+        }
+        const uint64_t offset = page - s->virt;
+        const uint64_t avail  = offset < s->source_size ? std::min(memory_manager::page_size, s->source_size - offset) : 0;
+        const uint8_t* source = source_image_ + s->source_offset + offset;
+
+        const bool read_only = !static_cast<uint32_t>(s->type & memory_type::write);
+        if (read_only && shared_image_) {
+            mm_->populate_page(page, s->type, shared_image_->page(page - image_base_, [&](uint8_t* dest) { load_page(dest, source, avail); }));
+            return true;
+        }
+
+        // Read-only pages completely covered by page aligned section data are shared with the image
+        if (read_only && avail == memory_manager::page_size && !(reinterpret_cast<uint64_t>(source) & page_mask)) {
+            mm_->populate_page(page, s->type, source_address(source));
+            return true;
+        }
+
+        allocations_.push_back(alloc_physical(memory_manager::page_size, avail ? physical_allocation_flags::no_zero : physical_allocation_flags::none));
+        auto& phys = allocations_.back();
+        if (avail) {
+            load_page(static_cast<uint8_t*>(phys.address()), source, avail);
+        }
+        mm_->populate_page(page, s->type, phys.address());
+        return true;
+    }
+
+    // Copies `avail' bytes from the source image and zero fills the rest of the page
+    void load_page(uint8_t* dest, const uint8_t* source, uint64_t avail) {
+        // The source isn't necessarily physically contiguous
+        for (uint64_t copied = 0, size; copied < avail; copied += size) {
+            size = std::min(avail - copied, memory_manager::page_size - ((reinterpret_cast<uint64_t>(source) + copied) & page_mask));
+            memcpy(dest + copied, static_cast<const uint8_t*>(source_address(source + copied)), size);
+        }
+        memset(dest + avail, 0, memory_manager::page_size - avail);
+    }
 
     void set_as_current() {
         REQUIRE(state_ == states::running);
@@ -419,17 +610,47 @@ private:
             hack_set_user_image((pe::IMAGE_DOS_HEADER*)(uint64_t)image_base_);
         }
         current_process_ = this;
+        fpu::set_current(&fpu_);
     }
 };
 user_process* user_process::current_process_ = nullptr;
-user_process* user_process::first_process_   = nullptr;
+user_process* user_process::ready_head_      = nullptr;
+user_process* user_process::ready_tail_      = nullptr;
+latency_stats user_process::dispatch_latency_;
+uint32_t      user_process::blocked_count_   = 0;
+
+void wait_queue::add(user_process& p) {
+    p.wait_next_ = head_;
+    head_ = &p;
+}
 
-class ko_ethdev : public kernel_object_helper<ko_ethdev, kernel_object_protocol_number::read, kernel_object_protocol_number::write>, public in_stream, public out_stream {
+void wait_queue::remove(user_process& p) {
+    auto n = &head_;
+    while (*n != &p) {
+        REQUIRE(*n);
+        n = &(*n)->wait_next_;
+    }
+    *n = p.wait_next_;
+    p.wait_next_ = nullptr;
+}
+
+void wait_queue::wake_all() {
+    while (auto p = head_) {
+        head_ = p->wait_next_;
+        p->wait_next_ = nullptr;
+        p->wake(1);
+    }
+}
+
+class ko_ethdev : public kernel_object_helper<ko_ethdev, kernel_object_protocol_number::read, kernel_object_protocol_number::write, kernel_object_protocol_number::wait, kernel_object_protocol_number::ethdev>, public in_stream, public out_stream, public waitable {
 public:
-    explicit ko_ethdev() {REQUIRE(dev_);}
+    explicit ko_ethdev(memory_manager& mm)
+        : rx_map_(mm, virt_to_phys(dev().rx_pool().buffer(0)), dev().rx_pool().count() * ethdev_rx_buffer_size, memory_type::read | memory_type::user) {
+        REQUIRE(dev().rx_pool().buffer_size() == ethdev_rx_buffer_size);
+    }
     virtual ~ko_ethdev() override {}
 
-    auto& dev() { return *dev_; }
+    static net::ethernet_device& dev() { REQUIRE(dev_); return *dev_; }
 
     virtual void write(const void* data, size_t n) override {
         interrupt_enabler ie{};
@@ -444,19 +665,78 @@ public:
                 memcpy(out, data, len);
                 count = len;
             }, 1);
+        if (!count) {
+            rx_pending_ = false; // Until the device signals that more packets have arrived
+        }
         return count;
     }
 
+    // The frame stays in the device's buffer (which the process has mapped) until it's released
+    uint64_t receive() {
+        uint64_t frame = 0;
+        dev_->receive_packets([&] (net::packet_ref p) {
+                REQUIRE(frame == 0);
+                frame = ethdev_rx_frame(p.index(), p.length(), static_cast<uint32_t>(p.verified()));
+                loans_.push_back(std::move(p));
+            }, 1);
+        if (!frame) {
+            rx_pending_ = false;
+        }
+        return frame;
+    }
+
+    bool release(uint32_t index) {
+        for (auto& p: loans_) {
+            if (p.index() == index) {
+                loans_.erase(&p);
+                rx_pending_ = true; // The device may have been waiting for a buffer
+                waiters_.wake_all();
+                return true;
+            }
+        }
+        return false;
+    }
+
     static void set_dev(net::ethernet_device* dev) {
+        if (dev_) {
+            dev_->set_receive_notify(nullptr);
+        }
         dev_ = dev;
+        if (dev_) {
+            dev_->set_receive_notify([]() {
+                rx_pending_ = true;
+                waiters_.wake_all();
+            });
+        }
     }
 
 private:
+    mem_map_helper               rx_map_;
+    kvector<net::packet_ref>     loans_;
     static net::ethernet_device* dev_;
+    static bool                  rx_pending_;
+    static wait_queue            waiters_;
+
+    virtual void* do_get_protocol(kernel_object_protocol_number protocol) override {
+        if (protocol == kernel_object_protocol_number::hack_mem_map) {
+            return &rx_map_;
+        }
+        return kernel_object_helper::do_get_protocol(protocol);
+    }
+
+    virtual bool do_ready() override {
+        return rx_pending_;
+    }
+
+    virtual wait_queue& do_waiters() override {
+        return waiters_;
+    }
 };
 net::ethernet_device* ko_ethdev::dev_;
+bool                  ko_ethdev::rx_pending_ = true;
+wait_queue            ko_ethdev::waiters_;
 
-class ko_keyboard : public kernel_object_helper<ko_keyboard, kernel_object_protocol_number::read>, public in_stream {
+class ko_keyboard : public kernel_object_helper<ko_keyboard, kernel_object_protocol_number::read, kernel_object_protocol_number::wait>, public in_stream, public waitable {
 public:
     explicit ko_keyboard() {
         dbgout() << "ko_keyboard::ko_keyboard\n";
@@ -474,29 +754,85 @@ public:
         }
         return n;
     }
+
+    // Called from the keyboard interrupt handler
+    static void key_notify() {
+        waiters_.wake_all();
+    }
+
+private:
+    static wait_queue waiters_;
+
+    virtual bool do_ready() override {
+        return ps2::key_available();
+    }
+
+    virtual wait_queue& do_waiters() override {
+        return waiters_;
+    }
+};
+wait_queue ko_keyboard::waiters_;
+
+// Submission/completion ring shared with the process that created it (see ring_buffer)
+class ko_ring : public kernel_object {
+public:
+    explicit ko_ring(memory_manager& mm)
+        : mem_(alloc_physical(memory_manager::page_size))
+        , map_(mm, mem_.address(), sizeof(ring_buffer), memory_type_rw | memory_type::user) {
+    }
+
+    // Runs the queued operations (while there's room for their completions), returns the number run
+    uint32_t enter();
+
 private:
+    physical_allocation mem_;
+    mem_map_helper      map_;
+
+    // Accessed through the identity map, so it doesn't matter which address space is active
+    ring_buffer& ring() {
+        return *static_cast<ring_buffer*>(mem_.address());
+    }
+
+    virtual void* do_get_protocol(kernel_object_protocol_number protocol) override {
+        if (protocol == kernel_object_protocol_number::ring) {
+            return this;
+        } else if (protocol == kernel_object_protocol_number::hack_mem_map) {
+            return &map_;
+        }
+        dbgout() << "protocol " << int(protocol) << " not supported\n";
+        REQUIRE(false);
+        return nullptr;
+    }
 };
 
-void alloc_and_map_user_exe(user_process& proc, const pe::IMAGE_DOS_HEADER& image)
+// `image' is in the address space of `source_owner' (or kernel memory if it's nullptr)
+void alloc_and_map_user_exe(user_process& proc, user_process* source_owner, const pe::IMAGE_DOS_HEADER& image)
 {
     REQUIRE(is_64bit_exe(image));
     const auto& nth = image.nt_headers();
 
     const auto image_base = virtual_address{nth.OptionalHeader.ImageBase};
 
+    // Nothing is loaded up front, pages are faulted in from the image as they're used
+    proc.image_source(source_owner, &image);
+    if (source_owner) {
+        // The image is only around while the process runs, read-only pages are kept for the next time it's started
+        proc.shared_pages(image_cache_acquire(image));
+    }
+
     // Map headers
-    proc.alloc_and_copy_section(image_base, nth.OptionalHeader.SizeOfHeaders, memory_type::read | memory_type::user, &image, nth.OptionalHeader.SizeOfHeaders);
+    proc.map_section(image_base, nth.OptionalHeader.SizeOfHeaders, memory_type::read | memory_type::user, 0, nth.OptionalHeader.SizeOfHeaders);
 
     // Map sections
     for (const auto& s : nth.sections()) {
         const memory_type t = pe::section_memory_type(s.Characteristics) | memory_type::user;
-        proc.alloc_and_copy_section(image_base + s.VirtualAddress, s.Misc.VirtualSize, t, reinterpret_cast<const uint8_t*>(&image) + s.PointerToRawData, s.SizeOfRawData);
+        proc.map_section(image_base + s.VirtualAddress, s.Misc.VirtualSize, t, s.PointerToRawData, s.SizeOfRawData);
     }
 
     // Map stack
-    const uint64_t stack_size = 0x1000 * 8;
+    const uint32_t stack_size = 0x1000 * 8;
     REQUIRE(nth.OptionalHeader.SizeOfStackCommit <= stack_size);
-    proc.alloc_and_copy_section(image_base - stack_size, stack_size, memory_type_rw | memory_type::user, nullptr, 0);
+    proc.map_section(image_base - stack_size, stack_size, memory_type_rw | memory_type::user, 0, 0);
 
     proc.image_base(image_base);
 
@@ -505,9 +841,88 @@ void alloc_and_map_user_exe(user_process& proc, const pe::IMAGE_DOS_HEADER& imag
     context.rip = image_base + image.nt_headers().OptionalHeader.AddressOfEntryPoint;
     context.ss  = user_ds;
     context.rsp = static_cast<uint64_t>(image_base) - 0x28;
-    context.eflags = rflag_mask_res1;
+    context.eflags = rflag_mask_res1 | rflag_mask_if; // Interrupts are enabled in user mode, so the process can be preempted
+    context.mxcsr  = fpu::mxcsr_default;
 }
 
+// Round-robin scheduling of user processes. A process is preempted (when returning to user mode from an interrupt)
+// once it has used its time slice and another process is ready to run.
+class scheduler : public singleton<scheduler> {
+public:
+    explicit scheduler() : slice_timer_([this]() { slice_expired_ = true; }) {
+        reg_ = register_user_return_handler([this](registers& regs) { on_user_return(regs); });
+    }
+
+    ~scheduler() {
+        reg_.reset();
+        dbgout() << "[sched] " << switches_ << " switches, " << preemptions_ << " preemptions. Dispatch latency: " << user_process::dispatch_latency() << "\n";
+    }
+
+    scheduler(const scheduler&) = delete;
+    scheduler& operator=(const scheduler&) = delete;
+
+    // Loads the context of `next' (the current process must have been switched from)
+    void run(registers& regs, user_process& next) {
+        next.switch_to(regs);
+        slice_expired_ = false;
+        timer::arm(slice_timer_, monotonic_ns() + time_slice_ns);
+        ++switches_;
+    }
+
+    // Runs the next ready process, returns false if there are none
+    bool run_next(registers& regs) {
+        auto next = user_process::take_ready();
+        if (!next) {
+            return false;
+        }
+        run(regs, *next);
+        return true;
+    }
+
+    // Runs the next ready process, halting until one becomes ready if there are none
+    void run_next_or_idle(registers& regs) {
+        while (!user_process::any_ready()) {
+            REQUIRE(user_process::any_blocked());
+            _enable();
+            attos::yield();
+            _disable();
+        }
+        run_next(regs);
+    }
+
+    // Moves the current process (with context `regs') to the back of the ready queue if any other process is ready
+    bool yield(registers& regs) {
+        if (!user_process::any_ready()) {
+            return false;
+        }
+        auto& current = user_process::current();
+        current.context() = regs;
+        current.switch_from();
+        user_process::make_ready(current);
+        return run_next(regs);
+    }
+
+private:
+    static constexpr uint64_t time_slice_ns = 10 * ns_per_ms;
+
+    isr_registration_ptr reg_;
+    timer::event         slice_timer_;
+    bool                 slice_expired_ = false;
+    uint64_t             switches_ = 0;
+    uint64_t             preemptions_ = 0;
+
+    void on_user_return(registers& regs) {
+        if (!user_process::has_current() || !slice_expired_) {
+            return;
+        }
+        // With nothing else to run the slice stays expired (without a timer), so the process is preempted on the
+        // first interrupt after another one becomes ready
+        if (yield(regs)) {
+            ++preemptions_;
+        }
+    }
+};
+
 template<typename T, typename... Args>
 uint64_t create_object(Args&&... args) {
     return user_process::current().object_open(kowned_ptr<kernel_object>{knew<T>(static_cast<Args&&>(args)...).release()});
@@ -516,116 +931,246 @@ uint64_t create_object(Args&&... args) {
 physical_address hack_dsdt_phys;
 uint32_t hack_dsdt_len;
 
-void syscall_handler(registers& regs)
+// Syscalls are dispatched through syscall_table (indexed by syscall_number). Those that can't switch to another
+// context take the fast path and only get the arguments (rdx, r8, r9), the others get the complete user context.
+
+void sys_exit(registers& regs)
 {
-    // TODO: Check user addresses...
-    const auto n = static_cast<syscall_number>(regs.rax);
-    regs.rax = 0; // Default return value
-    switch (n) {
-        case syscall_number::exit:
-            {
-                dbgout() << "[user] Exiting with error code " << as_hex(regs.rdx) << "\n";
-                auto& last = user_process::current();
-                last.switch_from();
-                last.exit(regs.rdx);
-
-                user_process* next = nullptr;
-                for (auto p : user_process::all_processes()) {
-                    if (p->running()) {
-                        next = p;
-                        break;
-                    }
-                }
-                if (!next) {
-                    dbgout() << "[user] All processes exited!\n";
-                    kmemory_manager().switch_to(); // Switch back to pure kernel memory manager before restoring the original context
-                    restore_original_context();
-                    REQUIRE(false);
-                }
-                next->switch_to(regs);
-                break;
-            }
-        case syscall_number::debug_print:
-            dbgout().write(reinterpret_cast<const char*>(regs.rdx), regs.r8);
-            break;
-        case syscall_number::yield:
-            _enable();
-            yield();
-            break;
-        case syscall_number::create:
-            {
-                const char* name = reinterpret_cast<const char*>(regs.rdx);
-                dbgout() << "[user] create '" << name << "'\n";
-                if (string_equal(name, "ethdev")) {
-                    regs.rax = create_object<ko_ethdev>();
-                } else if (string_equal(name, "keyboard")) {
-                    regs.rax = create_object<ko_keyboard>();
-                } else if(string_equal(name, "process")) {
-                    regs.rax = create_object<user_process>();
-                } else if(string_equal(name, "hack-acpi-dsdt")) {
-                    REQUIRE(hack_dsdt_phys && hack_dsdt_len);
-                    regs.rax = create_object<mem_map_helper>(user_process::current().mm(), hack_dsdt_phys, hack_dsdt_len, memory_type::read | memory_type::user);
-                } else {
-                    REQUIRE(!"Unknown device");
-                }
-                dbgout() << "[user] handle = " << as_hex(regs.rax) << "\n";
-            }
-            break;
-        case syscall_number::destroy:
-            user_process::current().object_close(regs.rdx);
-            break;
-        case syscall_number::write:
-            {
-                auto& os = user_process::current().object_get(regs.rdx).get_protocol<kernel_object_protocol_number::write>();
-                os.write(reinterpret_cast<const void*>(regs.r8), static_cast<uint32_t>(regs.r9));
-                break;
-            }
-        case syscall_number::read:
-            {
-                auto& is = user_process::current().object_get(regs.rdx).get_protocol<kernel_object_protocol_number::read>();
-                regs.rax = is.read(reinterpret_cast<void*>(regs.r8), static_cast<uint32_t>(regs.r9));
-                break;
-            }
-        case syscall_number::ethdev_hw_address:
-            {
-                auto& dev = static_cast<ko_ethdev&>(user_process::current().object_get(regs.rdx)).dev();
-                const auto hw_address = dev.hw_address();
-                memcpy(reinterpret_cast<void*>(regs.r8), &hw_address, sizeof(hw_address));
-                break;
-            }
-        case syscall_number::start_exe:
-            {
-                dbgout() << "[user] Request to start executable @ " << as_hex(regs.r8) << " process handle " << as_hex(regs.rdx).width(2) << "\n";
-                auto& proc = user_process::current().object_get(regs.rdx).get_protocol<kernel_object_protocol_number::process>();
-                alloc_and_map_user_exe(proc, *reinterpret_cast<pe::IMAGE_DOS_HEADER*>(regs.r8));
-                // Save original context
-                user_process::current().context() = regs;
-                user_process::current().switch_from();
-                // Set new context
-                proc.start();
-                proc.switch_to(regs);
-            }
-            break;
-        case syscall_number::process_exit_code:
-            {
-                auto& proc = user_process::current().object_get(regs.rdx).get_protocol<kernel_object_protocol_number::process>();
-                regs.rax = proc.exit_code();
-                break;
-            }
-        case syscall_number::mem_map_info:
-            {
-                auto& mem_map = user_process::current().object_get(regs.rdx).get_protocol<kernel_object_protocol_number::hack_mem_map>();
-                uint64_t* ptr = reinterpret_cast<uint64_t*>(regs.r8);
-                ptr[0] = reinterpret_cast<uint64_t>(mem_map.ptr());
-                ptr[1] = mem_map.length();
-                ptr[2] = static_cast<uint64_t>(mem_map.type());
-                break;
-            }
-        default:
-            dbgout() << "Got syscall 0x" << as_hex(regs.rax).width(0) << " from " << as_hex(regs.rcx) << " flags = " << as_hex(regs.r11) << "!\n";
-            REQUIRE(!"Unimplemented syscall");
+    dbgout() << "[user] Exiting with error code " << as_hex(regs.rdx) << "\n";
+    auto& last = user_process::current();
+    last.switch_from();
+    last.exit(regs.rdx);
+
+    if (!user_process::any_ready() && !user_process::any_blocked()) {
+        dbgout() << "[user] All processes exited!\n";
+        kmemory_manager().switch_to(); // Switch back to pure kernel memory manager before restoring the original context
+        restore_original_context();
+        REQUIRE(false);
+    }
+    scheduler::instance().run_next_or_idle(regs);
+}
+
+uint64_t sys_debug_print(uint64_t text, uint64_t length, uint64_t)
+{
+    dbgout().write(reinterpret_cast<const char*>(text), length);
+    return 0;
+}
+
+void sys_yield(registers& regs)
+{
+    if (!scheduler::instance().yield(regs)) {
+        _enable();
+        yield();
+    }
+}
+
+uint64_t sys_create(uint64_t name_ptr, uint64_t, uint64_t)
+{
+    const char* name = reinterpret_cast<const char*>(name_ptr);
+    dbgout() << "[user] create '" << name << "'\n";
+    uint64_t handle = 0;
+    if (string_equal(name, "ethdev")) {
+        handle = create_object<ko_ethdev>(user_process::current().mm());
+    } else if (string_equal(name, "keyboard")) {
+        handle = create_object<ko_keyboard>();
+    } else if(string_equal(name, "process")) {
+        handle = create_object<user_process>();
+    } else if(string_equal(name, "ring")) {
+        handle = create_object<ko_ring>(user_process::current().mm());
+    } else if(string_equal(name, "hack-acpi-dsdt")) {
+        REQUIRE(hack_dsdt_phys && hack_dsdt_len);
+        handle = create_object<mem_map_helper>(user_process::current().mm(), hack_dsdt_phys, hack_dsdt_len, memory_type::read | memory_type::user);
+    } else {
+        REQUIRE(!"Unknown device");
+    }
+    dbgout() << "[user] handle = " << as_hex(handle) << "\n";
+    return handle;
+}
+
+uint64_t sys_destroy(uint64_t handle, uint64_t, uint64_t)
+{
+    user_process::current().object_close(handle);
+    return 0;
+}
+
+uint64_t sys_read(uint64_t handle, uint64_t data, uint64_t length)
+{
+    auto& is = user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::read>();
+    return is.read(reinterpret_cast<void*>(data), static_cast<uint32_t>(length));
+}
+
+uint64_t sys_write(uint64_t handle, uint64_t data, uint64_t length)
+{
+    auto& os = user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::write>();
+    os.write(reinterpret_cast<const void*>(data), static_cast<uint32_t>(length));
+    return 0;
+}
+
+uint64_t sys_ethdev_hw_address(uint64_t handle, uint64_t dest, uint64_t)
+{
+    auto& dev = user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::ethdev>().dev();
+    const auto hw_address = dev.hw_address();
+    memcpy(reinterpret_cast<void*>(dest), &hw_address, sizeof(hw_address));
+    return 0;
+}
+
+void sys_start_exe(registers& regs)
+{
+    dbgout() << "[user] Request to start executable @ " << as_hex(regs.r8) << " process handle " << as_hex(regs.rdx).width(2) << "\n";
+    auto& proc = user_process::current().object_get(regs.rdx).get_protocol<kernel_object_protocol_number::process>();
+    alloc_and_map_user_exe(proc, &user_process::current(), *reinterpret_cast<pe::IMAGE_DOS_HEADER*>(regs.r8));
+    // Save original context, the parent is blocked until the new process exits
+    auto& parent = user_process::current();
+    parent.context() = regs;
+    parent.switch_from();
+    parent.wait_for_exit(proc);
+    // Set new context
+    proc.start();
+    scheduler::instance().run(regs, proc);
+}
+
+uint64_t sys_process_exit_code(uint64_t handle, uint64_t, uint64_t)
+{
+    auto& proc = user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::process>();
+    return proc.exit_code();
+}
+
+uint64_t sys_mem_map_info(uint64_t handle, uint64_t dest, uint64_t)
+{
+    auto& mem_map = user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::hack_mem_map>();
+    uint64_t* ptr = reinterpret_cast<uint64_t*>(dest);
+    ptr[0] = reinterpret_cast<uint64_t>(mem_map.ptr());
+    ptr[1] = mem_map.length();
+    ptr[2] = static_cast<uint64_t>(mem_map.type());
+    return 0;
+}
+
+void sys_wait(registers& regs)
+{
+    auto& current = user_process::current();
+    auto& w = current.object_get(regs.rdx).get_protocol<kernel_object_protocol_number::wait>();
+    if (w.ready()) {
+        regs.rax = 1;
+        return;
+    }
+    // Interrupts are disabled, so the object can't become ready before the process is blocked
+    current.context() = regs;
+    current.switch_from();
+    uint64_t deadline_ns = 0;
+    if (regs.r8) {
+        // The timeout comes from the process, saturate rather than wrap around to a deadline in the past
+        const auto now = monotonic_ns();
+        const auto max_timeout_ms = (UINT64_MAX - now) / ns_per_ms;
+        deadline_ns = regs.r8 < max_timeout_ms ? now + regs.r8 * ns_per_ms : UINT64_MAX;
+    }
+    current.block_on(w.waiters(), deadline_ns);
+    scheduler::instance().run_next_or_idle(regs);
+}
+
+uint64_t sys_monotonic_ns(uint64_t, uint64_t, uint64_t)
+{
+    return monotonic_ns();
+}
+
+uint64_t sys_ethdev_receive(uint64_t handle, uint64_t, uint64_t)
+{
+    return user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::ethdev>().receive();
+}
+
+uint64_t sys_ethdev_release(uint64_t handle, uint64_t index, uint64_t)
+{
+    return user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::ethdev>().release(static_cast<uint32_t>(index));
+}
+
+uint64_t sys_trace_dump(uint64_t, uint64_t, uint64_t)
+{
+    trace_dump(dbgout());
+    return 0;
+}
+
+uint64_t sys_log_level(uint64_t category, uint64_t level, uint64_t)
+{
+    REQUIRE(category <= static_cast<uint64_t>(log_category::count) && level <= static_cast<uint64_t>(log_level::debug));
+    if (category == static_cast<uint64_t>(log_category::count)) {
+        log_set_level_all(static_cast<log_level>(level));
+        return 0;
     }
-    _disable(); // Disable interrupts again
+    return static_cast<uint64_t>(log_set_level(static_cast<log_category>(category), static_cast<log_level>(level)));
+}
+
+uint64_t sys_ring_enter(uint64_t handle, uint64_t, uint64_t)
+{
+    return user_process::current().object_get(handle).get_protocol<kernel_object_protocol_number::ring>().enter();
+}
+
+const syscall_table_entry syscall_table[] = {
+    { nullptr,                &sys_exit },       // exit
+    { &sys_debug_print,       nullptr },         // debug_print
+    { nullptr,                &sys_yield },      // yield
+    { &sys_create,            nullptr },         // create
+    { &sys_destroy,           nullptr },         // destroy
+    { &sys_read,              nullptr },         // read
+    { &sys_write,             nullptr },         // write
+    { &sys_ethdev_hw_address, nullptr },         // ethdev_hw_address
+    { nullptr,                &sys_start_exe },  // start_exe
+    { &sys_process_exit_code, nullptr },         // process_exit_code
+    { &sys_mem_map_info,      nullptr },         // mem_map_info
+    { nullptr,                &sys_wait },       // wait
+    { &sys_monotonic_ns,      nullptr },         // monotonic_ns
+    { &sys_ring_enter,        nullptr },         // ring_enter
+    { &sys_ethdev_receive,    nullptr },         // ethdev_receive
+    { &sys_ethdev_release,    nullptr },         // ethdev_release
+    { &sys_trace_dump,        nullptr },         // trace_dump
+    { &sys_log_level,         nullptr },         // log_level
+};
+static_assert(sizeof(syscall_table) / sizeof(*syscall_table) == static_cast<size_t>(syscall_number::count), "");
+
+uint32_t ko_ring::enter()
+{
+    // The process can change the ring at any time, so the indices are read once and checked
+    auto& r = ring();
+    uint32_t       sq_head = r.sq_head;
+    const uint32_t sq_tail = r.sq_tail;
+    uint32_t       cq_tail = r.cq_tail;
+    const uint32_t cq_head = r.cq_head;
+    if (sq_tail - sq_head > ring_entries || cq_tail - cq_head > ring_entries) {
+        return 0;
+    }
+    uint32_t count = 0;
+    for (; sq_head != sq_tail && cq_tail - cq_head < ring_entries; ++count) {
+        const auto s = r.sq[sq_head & (ring_entries - 1)]; // Copied for the same reason
+        const auto n = static_cast<uint64_t>(s.op);
+        // Only the fast path syscalls can be queued, as they don't switch processes. destroy could free the ring
+        // (or an object an earlier operation is still using) while it's being drained.
+        const bool allowed = n < static_cast<uint64_t>(syscall_number::count) && syscall_table[n].fast && s.op != syscall_number::ring_enter && s.op != syscall_number::destroy;
+        auto& c = r.cq[cq_tail & (ring_entries - 1)];
+        c.user_data = s.user_data;
+        c.result    = allowed ? syscall_table[n].fast(s.args[0], s.args[1], s.args[2]) : ring_error;
+        r.cq_tail = ++cq_tail;
+        r.sq_head = ++sq_head;
+    }
+    return count;
+}
+
+// Measures the cycles from sending an IPI to this processor until its handler has returned (interrupt entry,
+// saving/restoring state and IRETQ)
+void interrupt_round_trip_test()
+{
+    constexpr uint32_t rounds = 1000;
+    const auto vector = find_free_vector();
+    const auto id = apic::local_id();
+    volatile uint32_t handled = 0;
+    auto reg = register_vector_handler(vector, [&handled]() { ++handled; apic::eoi(); });
+    latency_stats stats;
+    for (uint32_t i = 1; i <= rounds; ++i) {
+        const auto start = __rdtsc();
+        apic::send_ipi(id, vector);
+        while (handled != i) {
+            _mm_pause();
+        }
+        stats.add(__rdtsc() - start);
+    }
+    dbgout() << "[isr] Self-IPI round trip: " << stats << "\n";
 }
 
 void usermode_test(cpu_manager& cpum, const pe::IMAGE_DOS_HEADER& image)
@@ -638,17 +1183,24 @@ void usermode_test(cpu_manager& cpum, const pe::IMAGE_DOS_HEADER& image)
         context.ss  = kernel_ds;
         context.rsp = (uint64_t)physical_address{6<<20};
         context.eflags = static_cast<uint32_t>(__readeflags());
+        context.mxcsr  = _mm_getcsr();
         cpum.switch_to_context(context);
     }
 
-    syscall_enabler syscall_enabler_{&syscall_handler};
+    syscall_enabler syscall_enabler_{make_array_view(syscall_table, sizeof(syscall_table) / sizeof(*syscall_table))};
+    scheduler sched{};
+    ps2::set_key_notify(&ko_keyboard::key_notify);
+    auto page_fault_registration = register_page_fault_handler([](uint64_t address, uint32_t error_code) {
+        return user_process::has_current() && user_process::current().handle_page_fault(address, error_code);
+    });
 
     user_process proc;
-    alloc_and_map_user_exe(proc, image);
+    alloc_and_map_user_exe(proc, nullptr, image);
     proc.start();
     dbgout() << "Doing magic!\n";
     proc.switch_to(cpum);
     dbgout() << "Bach from magic!\n";
+    ps2::set_key_notify(nullptr);
     if (proc.exit_code()) {
         dbgout() << "Process exit code " << as_hex(proc.exit_code()) << " - press any key.\n";
         ps2::read_key();
@@ -862,7 +1414,13 @@ kvector<uint8_t> get_description(physical_address phys) {
     return kvector<uint8_t>{mapping.ptr(), mapping.ptr() + desc.length};
 }
 
-void handle(const acpi::multiple_apic_description& madt) {
+// Processors and interrupt controllers found in the MADT
+struct madt_info {
+    kvector<uint8_t> apic_ids;      // Enabled processors
+    apic::config     controllers{}; // io_apic_base is 0 if there's no I/O APIC
+};
+
+void handle(const acpi::multiple_apic_description& madt, madt_info& info) {
     enum class icst_type : uint8_t { // Interrupt Controller Structure Type
         processor_local_apic      = 0x00,
         io_apic                   = 0x01,
@@ -875,6 +1433,10 @@ void handle(const acpi::multiple_apic_description& madt) {
     const uint8_t* const end = desc_begin + madt.length;
 
     dbgout() << madt << "\n";
+    info.controllers.local_apic_base = physical_address{madt.local_interrupt_controller_address};
+    for (uint8_t irq = 0; irq < 16; ++irq) {
+        info.controllers.isa_irqs[irq] = apic::isa_irq_route{irq, 0};
+    }
     for (auto p = beg; p != end;) {
         REQUIRE(p + 2 <= end);
         const auto type = static_cast<icst_type>(p[0]);
@@ -887,18 +1449,35 @@ void handle(const acpi::multiple_apic_description& madt) {
                     const auto flags = *reinterpret_cast<const uint32_t*>(p + 4);
                     REQUIRE(flags == 0 || flags == 1);
                     dbgout() << " Processor Local APIC processor id " << as_hex(p[2]) << " APIC id " << as_hex(p[3]) << " " << (flags?"Enabled":"Disabled") << "\n";
+                    if (flags) {
+                        info.apic_ids.push_back(p[3]);
+                    }
                     break;
                 }
             case icst_type::io_apic:
                 REQUIRE(len == 12);
                 REQUIRE(p[3] == 0);
-                dbgout() << " I/O APIC id " << as_hex(p[2]) << " address " << as_hex(*reinterpret_cast<const uint32_t*>(p+4)) << " interrupt base " << as_hex(*reinterpret_cast<const uint32_t*>(p+8)) << "\n";
-                break;
+                {
+                    const auto address  = *reinterpret_cast<const uint32_t*>(p+4);
+                    const auto gsi_base = *reinterpret_cast<const uint32_t*>(p+8);
+                    dbgout() << " I/O APIC id " << as_hex(p[2]) << " address " << as_hex(address) << " interrupt base " << as_hex(gsi_base) << "\n";
+                    if (gsi_base == 0) { // Only the I/O APIC handling the ISA IRQs is used
+                        info.controllers.io_apic_base     = physical_address{address};
+                        info.controllers.io_apic_gsi_base = gsi_base;
+                    }
+                    break;
+                }
             case icst_type::interrupt_source_override:
                 REQUIRE(len == 10);
                 REQUIRE(p[2] == 0); // Bus must be ISA
-                dbgout() << " Interrupt source override IRQ#" << as_hex(p[3]) << " global interrupt " << as_hex(*reinterpret_cast<const uint32_t*>(p+4)) << " flags " << as_hex(*reinterpret_cast<const uint16_t*>(p+8)) << "\n";
-                break;
+                {
+                    const auto gsi   = *reinterpret_cast<const uint32_t*>(p+4);
+                    const auto flags = *reinterpret_cast<const uint16_t*>(p+8);
+                    dbgout() << " Interrupt source override IRQ#" << as_hex(p[3]) << " global interrupt " << as_hex(gsi) << " flags " << as_hex(flags) << "\n";
+                    REQUIRE(p[3] < 16);
+                    info.controllers.isa_irqs[p[3]] = apic::isa_irq_route{gsi, flags};
+                    break;
+                }
             case icst_type::local_apic_nmi:
                 REQUIRE(len == 6);
                 dbgout () << " Local APIC NMI processor id " << as_hex(p[2]) << " flags " << as_hex(*reinterpret_cast<const uint16_t*>(p+3)) << " LINT# " << as_hex(p[5]) << "\n";
@@ -931,7 +1510,7 @@ void handle(const acpi::fixed_acpi_description& facp) {
     hack_dsdt_len  = dsdt_desc.length;
 }
 
-void acpi_test() {
+void acpi_test(madt_info& info) {
     using namespace attos::acpi;
 
     const auto& ebda_segment = *fixed_physical_address<uint16_t, 0x40E>;
@@ -983,7 +1562,7 @@ void acpi_test() {
     for (const auto& entry_bytes : rsdt_entries) {
         const auto& desc = *reinterpret_cast<const description*>(entry_bytes.begin());
         if (auto madt = match_structure<multiple_apic_description>(desc)) {
-            handle(*madt);
+            handle(*madt, info);
         } else if (auto facp = match_structure<fixed_acpi_description>(desc)) {
             handle(*facp);
         } else {
@@ -992,6 +1571,17 @@ void acpi_test() {
     }
 }
 
+// Set to false to use the 8259 PIC and PIT (e.g. to compare the interrupt latency printed at shutdown)
+constexpr bool prefer_apic = true;
+
+// Set to true to save the complete x87/SSE state on every kernel entry instead of switching it on demand (e.g. to
+// compare the interrupt and syscall round trip times printed by interrupt_round_trip_test and userexe)
+constexpr bool eager_fpu = false;
+
+// Map/unmap iterations of the memory manager test at startup (checks that memory usage stays flat). Enough to
+// create and free page tables at every level, use 1000000 for a proper stress test or 0 to skip it.
+constexpr int mm_test_iterations = 4096;
+
 void stage3_entry(const arguments& args)
 {
     // First make sure we can output debug information
@@ -1014,7 +1604,26 @@ void stage3_entry(const arguments& args)
 
     auto ih = isr_init(debug_info_text);
 
-    interrupt_timer timer{}; // IRQ0 PIT
+    // x87/SSE context switching (on demand unless eager_fpu is set)
+    auto fpuc = fpu::init(eager_fpu);
+
+    madt_info madt;
+    acpi_test(madt);
+
+    // Route interrupts through the local APIC and I/O APIC rather than the PIC when possible
+    owned_ptr<apic::controller, destruct_deleter> apicc{};
+    isr_registration_ptr apic_routing{};
+    if (prefer_apic && static_cast<uint64_t>(madt.controllers.io_apic_base)) {
+        apicc = apic::init(madt.controllers);
+        apic_routing = isr_use_apic();
+    }
+
+    // Clock and timer interrupts (local APIC timer or PIT)
+    auto timers = timer::init();
+
+    if (apicc) {
+        interrupt_round_trip_test();
+    }
 
     // PS2 controller
     auto ps2c = ps2::init();
@@ -1025,7 +1634,15 @@ void stage3_entry(const arguments& args)
     // ATA
     //ata::test();
 
-    acpi_test();
+    if (mm_test_iterations) {
+        mm_test(mm_test_iterations);
+    }
+
+    // Start the other processors
+    owned_ptr<smp::controller, destruct_deleter> smpc{};
+    if (apicc && madt.apic_ids.size() > 1) {
+        smpc = smp::init(*cpu, make_array_view(madt.apic_ids.begin(), madt.apic_ids.size()));
+    }
 
     // Networking
     kowned_ptr<net::ethernet_device> netdev{};
@@ -1047,5 +1664,6 @@ void stage3_entry(const arguments& args)
 
     // User mode
     usermode_test(*cpu, user_exe);
+    image_cache_clear();
     ko_ethdev::set_dev(nullptr);
 }
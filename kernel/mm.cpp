@@ -1,6 +1,8 @@
 #include "mm.h"
+#include "cpu_manager.h"
 #include <attos/cpu.h>
 #include <attos/out_stream.h>
+#include <attos/magazine.h>
 
 #define assert(expr)
 #include <attos/tree.h>
@@ -8,8 +10,14 @@
 
 namespace attos {
 
+constexpr uint32_t kernel_pml4 = 0x1ff;
+
+// Entries pointing to a page table keep the number of present entries in that table in the bits ignored by the CPU
+constexpr uint32_t table_count_shift = 52;
+constexpr uint64_t table_count_mask  = 0x3FFULL << table_count_shift;
+
 inline uint64_t* table_entry(uint64_t table_value) {
-    return static_cast<uint64_t*>(physical_address{table_value & ~(PAGEF_NX | (memory_manager::page_size - 1))});
+    return static_cast<uint64_t*>(physical_address{table_value & ~(PAGEF_NX | table_count_mask | (memory_manager::page_size - 1))});
 }
 
 inline uint64_t* present_table_entry(uint64_t table_value) {
@@ -17,43 +25,265 @@ inline uint64_t* present_table_entry(uint64_t table_value) {
     return table_entry(table_value);
 }
 
-template<uint64_t Alignment>
-class no_free_heap {
+void free_physical_page(physical_address addr);
+void free_physical_range(physical_address addr, uint64_t length);
+
+constexpr uint64_t page_size_2mb = 2 << 20;
+constexpr uint64_t page_size_1gb = 1 << 30;
+
+bool                  one_gb_pages_supported;
+page_mapping_stats    all_live_pages;
+tlb_shootdown_handler shootdown_handler;
+bool                  log_mappings = true; // Print each map/unmap (turned off while mm_test runs)
+
+uint64_t& page_count(page_mapping_stats& stats, uint64_t size) {
+    return size == page_size_1gb ? stats.pages_1gb : size == page_size_2mb ? stats.pages_2mb : stats.pages_4k;
+}
+
+bool cpu_has_1gb_pages() {
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if (static_cast<uint32_t>(regs[0]) < 0x80000001) {
+        return false;
+    }
+    __cpuid(regs, 0x80000001);
+    return (regs[3] >> 26) & 1; // EDX.Page1GB
+}
+
+// Objects of type T allocated from whole pages. Destroyed objects are reused before more pages are allocated.
+template<typename T>
+class fixed_size_object_heap {
 public:
-    explicit no_free_heap(uint8_t* base, uint64_t length) : base_(base), end_(base + length), cur_(base) {
-        REQUIRE(!((uint64_t)base & (Alignment-1)));
-        REQUIRE(length >= Alignment);
+    explicit fixed_size_object_heap() {
+    }
+    fixed_size_object_heap(const fixed_size_object_heap&) = delete;
+    fixed_size_object_heap& operator=(const fixed_size_object_heap&) = delete;
+
+    ~fixed_size_object_heap() {
+        while (pages_) {
+            auto page = pages_;
+            pages_ = page->next;
+            free_physical_page(physical_address::from_identity_mapped_ptr(page));
+        }
     }
-    no_free_heap(const no_free_heap&) = delete;
-    no_free_heap& operator=(const no_free_heap&) = delete;
 
-    uint8_t* alloc(uint64_t size) {
-        size = round_up(size, Alignment);
-        REQUIRE(cur_ + size <= end_);
-        auto ptr = cur_;
-        cur_ += size;
-        return ptr;
+    template<typename... Args>
+    T* construct(Args&&... args) {
+        void* ptr;
+        if (free_list_) {
+            ptr = free_list_;
+            free_list_ = free_list_->next;
+        } else {
+            if (cur_ == end_) {
+                add_page();
+            }
+            ptr = cur_;
+            cur_ += object_size;
+        }
+        return new (ptr) T(static_cast<Args&&>(args)...);
+    }
+
+    void destroy(T* obj) {
+        obj->~T();
+        auto f = reinterpret_cast<free_object*>(obj);
+        f->next = free_list_;
+        free_list_ = f;
     }
 
 private:
-    uint8_t* const base_;
-    uint8_t* const end_;
-    uint8_t* cur_;
+    struct page_header {
+        page_header* next;
+    };
+    struct free_object {
+        free_object* next;
+    };
+    static constexpr uint64_t object_size = round_up(sizeof(T) < sizeof(free_object) ? sizeof(free_object) : sizeof(T), alignof(T));
+    static constexpr uint64_t first_object_offset = round_up(sizeof(page_header), alignof(T));
+    static_assert(first_object_offset + object_size <= memory_manager::page_size, "Object too large");
+
+    page_header* pages_     = nullptr;
+    free_object* free_list_ = nullptr;
+    uint8_t*     cur_       = nullptr;
+    uint8_t*     end_       = nullptr;
+
+    void add_page() {
+        auto page = static_cast<page_header*>(alloc_physical(memory_manager::page_size).release());
+        page->next = pages_;
+        pages_ = page;
+        cur_ = reinterpret_cast<uint8_t*>(page) + first_object_offset;
+        end_ = cur_ + (memory_manager::page_size - first_object_offset) / object_size * object_size;
+    }
 };
 
-template<typename T>
-class fixed_size_object_heap {
+// The unused parts of a range of virtual address space. Free extents are kept both by address (to merge
+// neighbours) and by size (for best fit allocation).
+class virtual_range_allocator {
 public:
-    explicit fixed_size_object_heap(uint8_t* base, uint64_t length) : heap_{base, length} {
+    explicit virtual_range_allocator(virtual_address base, uint64_t length)
+        : base_{base}
+        , end_{base + length} {
+        REQUIRE(!(base & (memory_manager::page_size - 1)));
+        REQUIRE(!(length & (memory_manager::page_size - 1)));
+        REQUIRE(end_ > base_);
+        insert_extent(base_, length);
+    }
+    virtual_range_allocator(const virtual_range_allocator&) = delete;
+    virtual_range_allocator& operator=(const virtual_range_allocator&) = delete;
+
+    // Reserves `length' bytes aligned to `alignment'. The smallest free extent that fits is used unless `high'
+    // is set, in which case the range is placed as high as possible. Returns false if there's no suitable range.
+    bool try_alloc(uint64_t length, uint64_t alignment, bool high, virtual_address& result) {
+        REQUIRE(length && !(length & (memory_manager::page_size - 1)));
+        REQUIRE(alignment >= memory_manager::page_size && !(alignment & (alignment - 1)));
+        if (high) {
+            for (auto it = by_address_.last(); it != by_address_.end(); --it) {
+                if (it->length() < length) continue;
+                const uint64_t start = (it->end() - length) & ~(alignment - 1);
+                if (start >= it->address()) {
+                    carve(*it, start, length);
+                    result = virtual_address{start};
+                    return true;
+                }
+            }
+        } else {
+            for (auto it = by_size_.lower_bound(length, size_key_compare{}); it != by_size_.end(); ++it) {
+                const uint64_t start = round_up(it->address(), alignment);
+                if (start >= it->address() && start + length <= it->end()) {
+                    carve(*it, start, length);
+                    result = virtual_address{start};
+                    return true;
+                }
+            }
+        }
+        return false;
     }
 
-    template<typename... Args>
-    T* construct(Args&&... args) {
-        return new (heap_.alloc(sizeof(T))) T(static_cast<Args&&>(args)...);
+    virtual_address alloc(uint64_t length, uint64_t alignment, bool high) {
+        virtual_address result;
+        if (!try_alloc(length, alignment, high, result)) {
+            dbgout() << "[mem] No free virtual range of length " << as_hex(length) << " alignment " << as_hex(alignment) << "\n";
+            FATAL_ERROR("Out of virtual address space");
+        }
+        return result;
+    }
+
+    // Marks an explicitly chosen range as used. The parts outside the managed range are ignored.
+    void reserve(virtual_address addr, uint64_t length) {
+        uint64_t start, end;
+        if (!clip(addr, length, start, end)) {
+            return;
+        }
+        auto it = by_address_.upper_bound(start, address_key_compare{});
+        it = it == by_address_.end() ? by_address_.last() : --it;
+        REQUIRE(it != by_address_.end() && it->address() <= start && end <= it->end());
+        carve(*it, start, end - start);
+    }
+
+    // Returns a range previously reserved
+    void free(virtual_address addr, uint64_t length) {
+        uint64_t start, end;
+        if (!clip(addr, length, start, end)) {
+            return;
+        }
+        auto next = by_address_.lower_bound(start, address_key_compare{});
+        auto prev = next;
+        prev = next == by_address_.end() ? by_address_.last() : --prev;
+        if (prev != by_address_.end()) {
+            REQUIRE(prev->end() <= start);
+            if (prev->end() == start) {
+                start = prev->address();
+                remove_extent(*prev);
+            }
+        }
+        if (next != by_address_.end()) {
+            REQUIRE(next->address() >= end);
+            if (next->address() == end) {
+                end = next->end();
+                remove_extent(*next);
+            }
+        }
+        insert_extent(start, end - start);
     }
 
 private:
-    no_free_heap<alignof(T)> heap_;
+    class free_extent {
+    private:
+        uint64_t     addr_;
+        uint64_t     length_;
+        tree_node    address_link_;
+        tree_node    size_link_;
+
+    public:
+        explicit free_extent(uint64_t addr, uint64_t length) : addr_(addr), length_(length), address_link_(), size_link_() {
+        }
+        free_extent(const free_extent&) = delete;
+        free_extent& operator=(const free_extent&) = delete;
+
+        uint64_t address() const { return addr_; }
+        uint64_t length() const { return length_; }
+        uint64_t end() const { return addr_ + length_; }
+
+        struct address_compare {
+            bool operator()(const free_extent& l, const free_extent& r) const {
+                return l.addr_ < r.addr_;
+            }
+        };
+
+        struct size_compare {
+            bool operator()(const free_extent& l, const free_extent& r) const {
+                return l.length_ < r.length_ || (l.length_ == r.length_ && l.addr_ < r.addr_);
+            }
+        };
+
+        using address_tree_type = tree<free_extent, &free_extent::address_link_, address_compare>;
+        using size_tree_type = tree<free_extent, &free_extent::size_link_, size_compare>;
+    };
+
+    struct address_key_compare {
+        bool operator()(const free_extent& e, uint64_t addr) const { return e.address() < addr; }
+        bool operator()(uint64_t addr, const free_extent& e) const { return addr < e.address(); }
+    };
+
+    struct size_key_compare {
+        bool operator()(const free_extent& e, uint64_t length) const { return e.length() < length; }
+    };
+
+    fixed_size_object_heap<free_extent>      extents_;
+    free_extent::address_tree_type           by_address_;
+    free_extent::size_tree_type              by_size_;
+    const virtual_address                    base_;
+    const virtual_address                    end_;
+
+    bool clip(virtual_address addr, uint64_t length, uint64_t& start, uint64_t& end) const {
+        start = std::max<uint64_t>(addr, base_);
+        end = std::min<uint64_t>(addr + length, end_);
+        return start < end;
+    }
+
+    void insert_extent(uint64_t addr, uint64_t length) {
+        auto e = extents_.construct(addr, length);
+        by_address_.insert(*e);
+        by_size_.insert(*e);
+    }
+
+    void remove_extent(free_extent& e) {
+        by_address_.remove(e);
+        by_size_.remove(e);
+        extents_.destroy(&e);
+    }
+
+    // Takes [start; start+length) out of `e'
+    void carve(free_extent& e, uint64_t start, uint64_t length) {
+        const uint64_t e_start = e.address();
+        const uint64_t e_end = e.end();
+        remove_extent(e);
+        if (e_start < start) {
+            insert_extent(e_start, start - e_start);
+        }
+        if (start + length < e_end) {
+            insert_extent(start + length, e_end - (start + length));
+        }
+    }
 };
 
 class memory_mapping {
@@ -61,10 +291,12 @@ private:
     virtual_address addr_;
     uint64_t        length_;
     memory_type     type_;
+    bool            demand_paged_; // Pages are supplied one at a time by populate_page
+    uint64_t        max_end_; // Highest end address in the subtree rooted here
     tree_node       link_;
 
 public:
-    explicit memory_mapping(virtual_address addr, uint64_t length, memory_type type) : addr_(addr), length_(length), type_(type), link_() {
+    explicit memory_mapping(virtual_address addr, uint64_t length, memory_type type, bool demand_paged) : addr_(addr), length_(length), type_(type), demand_paged_(demand_paged), max_end_(0), link_() {
         REQUIRE(length != 0);
     }
     memory_mapping(const memory_mapping&) = delete;
@@ -73,33 +305,37 @@ public:
     virtual_address address() const { return addr_; }
     uint64_t        length()  const { return length_; }
     memory_type     type()    const { return type_; }
+    bool            demand_paged() const { return demand_paged_; }
 
     struct compare {
         bool operator()(const memory_mapping& l, const memory_mapping& r) const {
             return l.addr_ < r.addr_;
         }
     };
-    using tree_type = tree<memory_mapping, &memory_mapping::link_, compare>;
+    struct interval_traits {
+        using compare = memory_mapping::compare;
+        static uint64_t start(const memory_mapping& m) { return m.addr_; }
+        static uint64_t end(const memory_mapping& m) { return m.addr_ + m.length_; }
+        static uint64_t& max_end(memory_mapping& m) { return m.max_end_; }
+    };
+    using tree_type = interval_tree<memory_mapping, &memory_mapping::link_, interval_traits>;
 };
 
 auto find_mapping(memory_mapping::tree_type& t, virtual_address addr, uint64_t length) {
-    //auto it = memory_map_tree_.lower_bound(memory_mapping{addr, length, memory_type_rwx});
-    //or something smarter
-    return std::find_if(t.begin(), t.end(), [addr, length](const auto& m) { return memory_areas_overlap(addr, length, m.address(), m.length()); });
+    return t.find_overlap(addr, addr + length);
 }
 
-void free_physical_page(physical_address addr);
-
 class memory_manager_base : public memory_manager {
 public:
-    explicit memory_manager_base(virtual_address free_virt_base)
-        : memory_mappings_phys_{alloc_physical(page_size)}
-        , memory_mappings_{memory_mappings_phys_.address(), memory_mappings_phys_.length()}
-        , pml4_{alloc_table()}
-        , free_virt_base_{free_virt_base} {
+    explicit memory_manager_base(virtual_address virt_base, uint64_t virt_length)
+        : pml4_{alloc_table()}
+        , virtual_ranges_{virt_base, virt_length} {
     }
 
     ~memory_manager_base() {
+        all_live_pages.pages_4k  -= live_pages_.pages_4k;
+        all_live_pages.pages_2mb -= live_pages_.pages_2mb;
+        all_live_pages.pages_1gb -= live_pages_.pages_1gb;
         for (uint32_t l4 = 0; l4 < table_size; ++l4) {
             if (!(pml4_[l4] & PAGEF_PRESENT)) continue;
             auto pdpt = table_entry(pml4_[l4]);
@@ -126,16 +362,46 @@ public:
 
     static constexpr uint32_t table_size = 512;
 
+    // Up to this many pages are invalidated one by one, beyond that the whole TLB is flushed
+    static constexpr uint32_t max_pending_invalidations = 32;
+
+    // Memory that may still be reachable through stale TLB (or paging-structure cache) entries is held until the
+    // invalidations are done. With more than this many ranges pending the flush is done early.
+    static constexpr uint32_t max_pending_frees = 64;
+
     physical_address pml4() const {
         return physical_address::from_identity_mapped_ptr(pml4_);
     }
 
+    // Frees `length' bytes at `addr' (no longer mapped) when the current transaction commits, i.e. after the
+    // TLB invalidations. Outside a transaction they're freed right away.
+    void free_after_flush(physical_address addr, uint64_t length) {
+        if (pending_free_count_ == max_pending_frees) {
+            flush_pending();
+        }
+        pending_frees_[pending_free_count_++] = pending_free{addr, length};
+        if (!transaction_depth_) {
+            flush_pending();
+        }
+    }
+
 private:
-    physical_allocation                    memory_mappings_phys_;
+    struct pending_free {
+        physical_address addr;
+        uint64_t         length;
+    };
+
     fixed_size_object_heap<memory_mapping> memory_mappings_;
+    page_mapping_stats                     live_pages_ = {};
+    uint32_t                               transaction_depth_ = 0;
+    uint32_t                               pending_count_ = 0;
+    bool                                   pending_flush_all_ = false;
+    virtual_address                        pending_pages_[max_pending_invalidations];
+    uint32_t                               pending_free_count_ = 0;
+    pending_free                           pending_frees_[max_pending_frees];
     memory_mapping::tree_type              memory_map_tree_;
     uint64_t*                              pml4_;
-    virtual_address                        free_virt_base_;
+    virtual_range_allocator                virtual_ranges_;
 
     static uint64_t* alloc_table() {
         return static_cast<uint64_t*>(alloc_physical(memory_manager::page_size).release());
@@ -145,7 +411,69 @@ private:
         free_physical_page(physical_address::from_identity_mapped_ptr(table));
     }
 
-    uint64_t* alloc_if_not_present(uint64_t& parent, uint64_t flags) {
+    // Largest page size usable at an address with the given alignment for (at most) `length' bytes
+    static uint64_t largest_page_size(uint64_t address_bits, uint64_t length) {
+        if (one_gb_pages_supported && !(address_bits & (page_size_1gb - 1)) && length >= page_size_1gb) {
+            return page_size_1gb;
+        }
+        if (!(address_bits & (page_size_2mb - 1)) && length >= page_size_2mb) {
+            return page_size_2mb;
+        }
+        return page_size;
+    }
+
+    // Returns the number of present entries in the table `parent' points to
+    static uint32_t table_count(uint64_t parent) {
+        return static_cast<uint32_t>((parent & table_count_mask) >> table_count_shift);
+    }
+
+    static void set_table_count(uint64_t& parent, uint32_t count) {
+        REQUIRE(count <= table_size);
+        parent = (parent & ~table_count_mask) | (static_cast<uint64_t>(count) << table_count_shift);
+    }
+
+    // Fills the empty `entry' in the table pointed to by `owner' (nullptr for the PML4)
+    static void set_entry(uint64_t* owner, uint64_t& entry, uint64_t value) {
+        REQUIRE(!(entry & PAGEF_PRESENT));
+        entry = value;
+        if (owner) {
+            set_table_count(*owner, table_count(*owner) + 1);
+        }
+    }
+
+    // Clears `entry' in the table pointed to by `owner' (nullptr for the PML4). Returns the number of entries left.
+    static uint32_t clear_entry(uint64_t* owner, uint64_t& entry) {
+        REQUIRE(entry & PAGEF_PRESENT);
+        entry = 0;
+        if (!owner) {
+            return table_size;
+        }
+        const auto count = table_count(*owner);
+        REQUIRE(count > 0);
+        set_table_count(*owner, count - 1);
+        return count - 1;
+    }
+
+    void set_leaf_entry(uint64_t* owner, uint64_t& entry, uint64_t value, uint64_t size) {
+        set_entry(owner, entry, value);
+        ++page_count(live_pages_, size);
+        ++page_count(all_live_pages, size);
+    }
+
+    uint32_t clear_leaf_entry(uint64_t* owner, uint64_t& entry, uint64_t size) {
+        --page_count(live_pages_, size);
+        --page_count(all_live_pages, size);
+        return clear_entry(owner, entry);
+    }
+
+    // Frees the (empty) table `entry' points to once the TLBs no longer reference it
+    uint32_t free_table_entry(uint64_t* owner, uint64_t& entry) {
+        REQUIRE(table_count(entry) == 0);
+        free_after_flush(physical_address::from_identity_mapped_ptr(table_entry(entry)), page_size);
+        return clear_entry(owner, entry);
+    }
+
+    uint64_t* alloc_if_not_present(uint64_t* owner, uint64_t& parent, uint64_t flags) {
         if (parent & PAGEF_PRESENT) {
             constexpr uint64_t check_mask = (PAGEF_NX | 0xFFF) & ~(PAGEF_ACCESSED | PAGEF_DIRTY);
             if ((parent & check_mask) != (flags & check_mask)) {
@@ -155,12 +483,12 @@ private:
             }
             return table_entry(parent);
         }
-        return alloc_table_entry(parent, flags);
+        return alloc_table_entry(owner, parent, flags);
     }
 
-    uint64_t* alloc_table_entry(uint64_t& parent, uint64_t flags) {
+    uint64_t* alloc_table_entry(uint64_t* owner, uint64_t& parent, uint64_t flags) {
         auto table = static_cast<uint64_t*>(alloc_table());
-        parent = physical_address::from_identity_mapped_ptr(table) | flags;
+        set_entry(owner, parent, physical_address::from_identity_mapped_ptr(table) | flags);
         //dbgout() << "[mem] Allocated page table. parent " << as_hex((uint64_t)&parent) << " <- " << as_hex(parent) << "\n";
         return table;
     }
@@ -169,165 +497,394 @@ private:
         __writecr3(pml4());
     }
 
-    virtual_address virtual_alloc(uint64_t length) {
-        // TODO: Improve this...
-        REQUIRE((length & (page_size-1)) == 0);
-        const auto addr = free_virt_base_;
-        free_virt_base_ += length;
-        REQUIRE(free_virt_base_ >= addr); // Make sure we didn't wrap around
-        return addr;
+    virtual void do_begin_transaction() override {
+        ++transaction_depth_;
     }
 
-protected:
-    virtual virtual_address do_map_memory(virtual_address virt, uint64_t length, memory_type type, physical_address phys) override {
-        const uint64_t map_page_size = memory_type_page_size(type);
+    virtual void do_commit_transaction() override {
+        REQUIRE(transaction_depth_ > 0);
+        if (--transaction_depth_) {
+            return;
+        }
+        flush_pending();
+    }
+
+    // Invalidates the queued TLB entries (on all CPUs) and then frees the memory they could have referenced
+    void flush_pending() {
+        if (pending_flush_all_ || pending_count_) {
+            flush_tlb(pending_pages_, pending_count_, pending_flush_all_);
+        }
+        pending_count_ = 0;
+        pending_flush_all_ = false;
+        while (pending_free_count_) {
+            const auto& f = pending_frees_[--pending_free_count_];
+            free_physical_range(f.addr, f.length);
+        }
+    }
+
+    // Kernel mappings are present in all address spaces, other mappings only matter when the address space is active
+    void queue_invalidation(virtual_address virt, bool active) {
+        if (!active && virt.pml4e() != kernel_pml4) {
+            return;
+        }
+        if (pending_count_ < max_pending_invalidations) {
+            pending_pages_[pending_count_++] = virt;
+        } else {
+            pending_flush_all_ = true;
+        }
+    }
+
+    static uint64_t table_flags(memory_type type) {
+        return PAGEF_PRESENT | PAGEF_WRITE | (static_cast<uint32_t>(type & memory_type::user) ? PAGEF_USER : 0);
+    }
+
+    static uint64_t page_flags(memory_type type) {
+        REQUIRE(static_cast<uint32_t>(type & memory_type::read));
+        return PAGEF_PRESENT
+            | (static_cast<uint32_t>(type & memory_type::user) ? PAGEF_USER : 0)
+            | (static_cast<uint32_t>(type & memory_type::write) ? PAGEF_WRITE : 0)
+            | (static_cast<uint32_t>(type & memory_type::execute) ? 0 : PAGEF_NX)
+            | (static_cast<uint32_t>(type & memory_type::cache_disable) ? PAGEF_PWT | PAGEF_PCD : 0);
+    }
 
+    // Allocates the virtual range (if needed) and records the mapping. `alignment' is preferred for allocated
+    // ranges, but only `page_alignment' is required.
+    virtual_address add_mapping(virtual_address virt, uint64_t length, memory_type type, uint64_t alignment, uint64_t page_alignment, bool demand_paged) {
         // Check length
         REQUIRE(length > 0);
-        REQUIRE((length & (map_page_size - 1)) == 0);
-
-        // Check physical address alignment
-        REQUIRE((phys & (map_page_size - 1)) == 0);
-        REQUIRE(phys < 1ULL<<32); // Probably more work required before we support > 4GB addresses
+        REQUIRE((length & (page_alignment - 1)) == 0);
 
         // Alloc virtual address (if needed)
-        if (virt == memory_manager::map_alloc_virt) {
-            virt = virtual_alloc(length);
-        } else if (virt == memory_manager::map_alloc_virt_close_to_kernel) {
-            virt = virtual_alloc(length);
+        const bool explicit_virt = virt != memory_manager::map_alloc_virt && virt != memory_manager::map_alloc_virt_close_to_kernel;
+        if (!explicit_virt) {
+            const bool close_to_kernel = virt == memory_manager::map_alloc_virt_close_to_kernel;
+            if (!virtual_ranges_.try_alloc(length, alignment, close_to_kernel, virt)) {
+                virt = virtual_ranges_.alloc(length, page_alignment, close_to_kernel);
+            }
         }
 
-        dbgout() << "[mem] map " << as_hex(virt) << " <- " << as_hex(phys) << " len " << as_hex(length).width(0) << ' ' << type << "\n";
+        if (log_mappings) {
+            dbgout() << "[mem] map " << as_hex(virt) << " len " << as_hex(length).width(0) << ' ' << type << "\n";
+        }
 
         // Check virtual address
-        REQUIRE((virt & (map_page_size - 1)) == 0);
+        REQUIRE((virt & (page_alignment - 1)) == 0);
         REQUIRE(virt + length > virt && "No wraparound allowed");
 
-        const auto virt_start = virt;
-
         auto it = find_mapping(memory_map_tree_, virt, length);
         if (it != memory_map_tree_.end()) {
             dbgout() << "[mem] FATAL ERROR overlaps " << as_hex(it->address()) << "\n";
             REQUIRE(false);
         }
+        if (explicit_virt) {
+            virtual_ranges_.reserve(virt, length);
+        }
 
-        // Flags
-        REQUIRE(static_cast<uint32_t>(type & memory_type::read));
+        auto mm = memory_mappings_.construct(virt, length, type, demand_paged);
+        memory_map_tree_.insert(*mm);
+        return virt;
+    }
 
-        const uint64_t flags  = PAGEF_PRESENT
-            | (static_cast<uint32_t>(type & memory_type::user) ? PAGEF_USER : 0);
-        const auto page_flags = flags
-            | (static_cast<uint32_t>(type & memory_type::write) ? PAGEF_WRITE : 0)
-            | (static_cast<uint32_t>(type & memory_type::execute) ? 0 : PAGEF_NX)
-            | (static_cast<uint32_t>(type & memory_type::cache_disable) ? PAGEF_PWT | PAGEF_PCD : 0);
+protected:
+    virtual virtual_address do_map_memory(virtual_address virt, uint64_t length, memory_type type, physical_address phys) override {
+        const uint64_t map_page_size = memory_type_page_size(type);
 
-        auto mm = memory_mappings_.construct(virt, length, type);
-        memory_map_tree_.insert(*mm);
+        // Check physical address alignment
+        REQUIRE((phys & (map_page_size - 1)) == 0);
+        REQUIRE(phys < 1ULL<<32); // Probably more work required before we support > 4GB addresses
 
-        for (; length; length -= map_page_size, virt += map_page_size, phys += map_page_size) {
-            auto* pdp = alloc_if_not_present(pml4_[virt.pml4e()], flags | PAGEF_WRITE);
+        // Unless the caller asked for a specific page size the largest one allowed by alignment and length is used.
+        // Allocated virtual addresses are aligned so large pages can be used when the physical address allows it.
+        const bool explicit_page_size = static_cast<uint32_t>(type & (memory_type::ps_2mb | memory_type::ps_1gb)) != 0;
+        const uint64_t alignment  = explicit_page_size ? map_page_size : largest_page_size(phys, length);
+        const uint64_t flags      = table_flags(type);
+        const uint64_t page_flags = memory_manager_base::page_flags(type);
 
-            if (static_cast<uint32_t>(type & memory_type::ps_1gb)) {
-                pdp[virt.pdpe()] = phys | PAGEF_PAGESIZE | page_flags;
-            } else {
-                auto* pd = alloc_if_not_present(pdp[virt.pdpe()], flags | PAGEF_WRITE);
-                if (static_cast<uint32_t>(type & memory_type::ps_2mb)) {
-                    pd[virt.pde()] = phys | PAGEF_PAGESIZE | page_flags;
-                } else {
-                    auto* pt = alloc_if_not_present(pd[virt.pde()], flags | PAGEF_WRITE);
-                    pt[virt.pte()] = phys | page_flags;
-                }
+        virt = add_mapping(virt, length, type, alignment, map_page_size, false);
+        const auto virt_start = virt;
+
+        for (uint64_t size; length; length -= size, virt += size, phys += size) {
+            size = explicit_page_size ? map_page_size : largest_page_size(virt | phys, length);
+
+            auto& pml4e = pml4_[virt.pml4e()];
+            auto* pdp = alloc_if_not_present(nullptr, pml4e, flags);
+            auto& pdpe = pdp[virt.pdpe()];
+            if (size == page_size_1gb && (explicit_page_size || !(pdpe & PAGEF_PRESENT))) {
+                set_leaf_entry(&pml4e, pdpe, phys | PAGEF_PAGESIZE | page_flags, size);
+                continue;
+            }
+
+            // An existing table means there are (or have been) other mappings nearby, so use smaller pages
+            size = std::min(size, page_size_2mb);
+            auto* pd = alloc_if_not_present(&pml4e, pdpe, flags);
+            auto& pde = pd[virt.pde()];
+            if (size == page_size_2mb && (explicit_page_size || !(pde & PAGEF_PRESENT))) {
+                set_leaf_entry(&pdpe, pde, phys | PAGEF_PAGESIZE | page_flags, size);
+                continue;
             }
+
+            size = page_size;
+            auto* pt = alloc_if_not_present(&pdpe, pde, flags);
+            set_leaf_entry(&pde, pt[virt.pte()], phys | page_flags, size);
             //dbgout() << "[mem] " << as_hex(virt) << " " << as_hex(phys) << " " << as_hex(page_flags) << "\n";
         }
 
         return virt_start;
     }
 
+    virtual virtual_address do_reserve_memory(virtual_address virt, uint64_t length, memory_type type) override {
+        REQUIRE(memory_type_page_size(type) == page_size);
+        page_flags(type); // Check the type
+        return add_mapping(virt, length, type, page_size, page_size, true);
+    }
+
+    virtual void do_populate_page(virtual_address virt, memory_type type, physical_address phys) override {
+        REQUIRE((virt & (page_size - 1)) == 0);
+        REQUIRE((phys & (page_size - 1)) == 0);
+        auto it = find_mapping(memory_map_tree_, virt, page_size);
+        REQUIRE(it != memory_map_tree_.end() && it->demand_paged());
+        REQUIRE((type & it->type()) == type && "Page type must be a subset of the reserved type");
+
+        auto& pml4e = pml4_[virt.pml4e()];
+        auto* pdp = alloc_if_not_present(nullptr, pml4e, table_flags(it->type()));
+        auto& pdpe = pdp[virt.pdpe()];
+        auto* pd = alloc_if_not_present(&pml4e, pdpe, table_flags(it->type()));
+        auto& pde = pd[virt.pde()];
+        auto* pt = alloc_if_not_present(&pdpe, pde, table_flags(it->type()));
+        auto& pte = pt[virt.pte()];
+        if (pte & PAGEF_PRESENT) {
+            // Replacing a page (e.g. a private copy of a shared one), the old translation must go
+            do_begin_transaction();
+            pte = phys | page_flags(type);
+            queue_invalidation(virt, (__readcr3() & ~(page_size - 1)) == static_cast<uint64_t>(pml4()));
+            do_commit_transaction();
+        } else {
+            set_leaf_entry(&pde, pte, phys | page_flags(type), page_size);
+        }
+    }
+
+    virtual bool do_lookup_page(virtual_address virt, physical_address& phys) override {
+        const auto pml4e = pml4_[virt.pml4e()];
+        if (!(pml4e & PAGEF_PRESENT)) {
+            return false;
+        }
+        const auto pdpe = table_entry(pml4e)[virt.pdpe()];
+        if (!(pdpe & PAGEF_PRESENT)) {
+            return false;
+        }
+        if (pdpe & PAGEF_PAGESIZE) {
+            phys = physical_address{(pdpe & ~(PAGEF_NX | (page_size_1gb - 1))) + (virt & (page_size_1gb - 1))};
+            return true;
+        }
+        const auto pde = table_entry(pdpe)[virt.pde()];
+        if (!(pde & PAGEF_PRESENT)) {
+            return false;
+        }
+        if (pde & PAGEF_PAGESIZE) {
+            phys = physical_address{(pde & ~(PAGEF_NX | (page_size_2mb - 1))) + (virt & (page_size_2mb - 1))};
+            return true;
+        }
+        const auto pte = table_entry(pde)[virt.pte()];
+        if (!(pte & PAGEF_PRESENT)) {
+            return false;
+        }
+        phys = physical_address{(pte & ~(PAGEF_NX | (page_size - 1))) + (virt & (page_size - 1))};
+        return true;
+    }
+
     virtual void do_unmap_memory(virtual_address virt, uint64_t length) override {
         auto it = find_mapping(memory_map_tree_, virt, length);
         REQUIRE(it != memory_map_tree_.end());
-        const auto type = it->type();
-        const uint64_t map_page_size = memory_type_page_size(it->type());
         REQUIRE(it->length() == length);
+        virtual_ranges_.free(virt, length);
 
-        dbgout() << "[mem] unmap " << as_hex(virt) << " len " << as_hex(length).width(0) << ' ' << it->type() << "\n";
+        if (log_mappings) {
+            dbgout() << "[mem] unmap " << as_hex(virt) << " len " << as_hex(length).width(0) << ' ' << it->type() << "\n";
+        }
 
-        memory_map_tree_.remove(*it);
-        for (; length; length -= map_page_size, virt += map_page_size) {
-            auto* pdp = present_table_entry(pml4_[virt.pml4e()]);
+        // Demand paged mappings can have holes, they're skipped up to the end of the missing entry
+        const bool demand_paged = it->demand_paged();
+        auto hole = [&](uint64_t entry_size) {
+            REQUIRE(demand_paged);
+            return std::min(length, entry_size - (virt & (entry_size - 1)));
+        };
 
-            if (static_cast<uint32_t>(type & memory_type::ps_1gb)) {
-                pdp[virt.pdpe()] = 0;
+        memory_map_tree_.remove(*it);
+        memory_mappings_.destroy(&*it);
+
+        do_begin_transaction();
+        const bool active = (__readcr3() & ~(page_size - 1)) == static_cast<uint64_t>(pml4());
+        // The page size of each part of the mapping is found by walking the tables
+        for (uint64_t size; length; length -= size, virt += size) {
+            auto& pml4e = pml4_[virt.pml4e()];
+            if (!(pml4e & PAGEF_PRESENT)) {
+                size = hole(table_size * page_size_1gb);
+                continue;
+            }
+            auto* pdp = present_table_entry(pml4e);
+            auto& pdpe = pdp[virt.pdpe()];
+
+            // Free tables as they become empty, except for the kernel PDPT which is shared by all address spaces
+            if (!(pdpe & PAGEF_PRESENT)) {
+                size = hole(page_size_1gb);
+            } else if (pdpe & PAGEF_PAGESIZE) {
+                size = page_size_1gb;
+                clear_leaf_entry(&pml4e, pdpe, size);
+                queue_invalidation(virt, active);
             } else {
-                auto* pd = present_table_entry(pdp[virt.pdpe()]);
-                if (static_cast<uint32_t>(type & memory_type::ps_2mb)) {
-                    pd[virt.pde()] = 0;
+                auto* pd = present_table_entry(pdpe);
+                auto& pde = pd[virt.pde()];
+                if (!(pde & PAGEF_PRESENT)) {
+                    size = hole(page_size_2mb);
+                } else if (pde & PAGEF_PAGESIZE) {
+                    size = page_size_2mb;
+                    clear_leaf_entry(&pdpe, pde, size);
+                    queue_invalidation(virt, active);
                 } else {
-                    auto* pt = present_table_entry(pd[virt.pde()]);
-                    pt[virt.pte()] = 0;
+                    size = page_size;
+                    auto* pt = present_table_entry(pde);
+                    auto& pte = pt[virt.pte()];
+                    if (!(pte & PAGEF_PRESENT)) {
+                        REQUIRE(demand_paged);
+                    } else {
+                        // Queued first so the invalidation covers the table if it's freed (and flushed) now
+                        queue_invalidation(virt, active);
+                        if (!clear_leaf_entry(&pde, pte, size)) {
+                            free_table_entry(&pdpe, pde);
+                        }
+                    }
+                }
+                if (!table_count(pdpe)) {
+                    free_table_entry(&pml4e, pdpe);
                 }
             }
+            REQUIRE(size <= length);
+            if (!table_count(pml4e) && virt.pml4e() != kernel_pml4) {
+                free_table_entry(nullptr, pml4e);
+            }
         }
-        // TODO: Free empty tables
-        memory_map_tree_.remove(*it);
-        // TODO: The memory_mapping in *it can now be reused
+        do_commit_transaction();
     }
 
 };
 
 constexpr virtual_address kernel_map_start{0xFFFFFFFF'FF000000};
-constexpr uint32_t        kernel_pml4 = 0x1ff;
 constexpr uint64_t        initial_heap_size = 1<<20;
+constexpr uint32_t        kernel_heap_cpus  = max_cpus;
 
-class kernel_memory_manager : public memory_manager, public singleton<kernel_memory_manager> {
+class kernel_memory_manager : public memory_manager, public page_source, public singleton<kernel_memory_manager> {
 public:
     explicit kernel_memory_manager(physical_address base, uint64_t length)
         : saved_cr3_{__readcr3()}
         , physical_pages_{base, length}
-        , kernel_heap_phys_{alloc_physical(initial_heap_size)}
-        , kernel_heap_{static_cast<uint8_t*>(kernel_heap_phys_.address()), kernel_heap_phys_.length()} {
-        dbgout() << "[mem] Starting. Base 0x" << as_hex(base) << " Length " << (length>>20) << " MB\n";
-        mm_ = mm_buffer_.construct(kernel_map_start-(1ULL<<30)); // HACK: ISR needs virtual memory within 2GB of the kernel code...
+        , kernel_heap_phys_{alloc_physical(initial_heap_size, physical_allocation_flags::no_zero)} {
+        dbgout() << "[mem] Starting. Base 0x" << as_hex(base) << " Length " << (length>>20) << " MB. " << (physical_pages_.free_bytes()>>20) << " MB free\n";
+        one_gb_pages_supported = cpu_has_1gb_pages();
+        // HACK: ISR needs virtual memory within 2GB of the kernel code, so the kernel address space is the 1GB just
+        // below it. Allocations close to the kernel come from the top.
+        mm_ = mm_buffer_.construct(kernel_map_start-(1ULL<<30), 1ULL<<30);
+        // The kernel heap grows by mapping more memory (see do_alloc_pages)
+        kernel_heap_  = kernel_heap_buffer_.construct(static_cast<uint8_t*>(kernel_heap_phys_.address()), kernel_heap_phys_.length(), this);
+        kernel_cache_ = kernel_cache_buffer_.construct(*kernel_heap_, kernel_heap_cpus);
     }
 
     ~kernel_memory_manager() {
-        dbgout() << "[mem] Shutting down. Restoring CR3 to " << as_hex(saved_cr3_) << "\n";
+        // Tear down the heap while its mappings are still active
+        {
+            mapping_transaction transaction{*mm_};
+            kernel_cache_.reset();
+            kernel_heap_.reset();
+        }
+        dbgout() << "[mem] Shutting down. Live pages " << mm_page_stats() << "\n";
+        dbgout() << "[mem] Restoring CR3 to " << as_hex(saved_cr3_) << "\n";
         __writecr3(saved_cr3_);
+        dbgout() << "[mem] Pages zeroed in background " << stats_.background_zeroed << ", taken from pool " << stats_.pool_hits;
+        dbgout() << ", zeroed synchronously " << stats_.sync_zeroed << ", zeroing avoided " << stats_.zeroing_avoided << "\n";
+        while (zeroed_count_) {
+            physical_pages_.free(zeroed_pages_[--zeroed_count_], page_size);
+        }
     }
 
     kernel_memory_manager(const kernel_memory_manager&) = delete;
     kernel_memory_manager& operator=(const kernel_memory_manager&) = delete;
 
-    physical_allocation alloc_physical(uint64_t size) {
+    physical_address boot_pml4() const {
+        return saved_cr3_;
+    }
+
+    physical_allocation alloc_physical(uint64_t size, physical_allocation_flags flags) {
         size = round_up(size, page_size);
+        if (static_cast<uint32_t>(flags & physical_allocation_flags::no_zero)) {
+            stats_.zeroing_avoided += size / page_size;
+        } else if (size == page_size && zeroed_count_) {
+            ++stats_.pool_hits;
+            return { zeroed_pages_[--zeroed_count_], size };
+        } else {
+            stats_.sync_zeroed += size / page_size;
+        }
         auto ptr = physical_pages_.alloc(size);
-        __stosq(reinterpret_cast<uint64_t*>(ptr), 0, size / 8);
+        if (!static_cast<uint32_t>(flags & physical_allocation_flags::no_zero)) {
+            __stosq(reinterpret_cast<uint64_t*>(ptr), 0, size / 8);
+        }
         return { physical_address::from_identity_mapped_ptr(ptr), size };
     }
 
+    // Zero up to max_pages pages for the pool. Returns true if any work was done.
+    bool refill_zeroed_pages(uint32_t max_pages) {
+        uint32_t count = 0;
+        for (; count < max_pages && zeroed_count_ < zeroed_pool_size && physical_pages_.free_bytes() >= zeroed_pool_min_free; ++count) {
+            auto ptr = physical_pages_.alloc(page_size);
+            __stosq(reinterpret_cast<uint64_t*>(ptr), 0, page_size / 8);
+            zeroed_pages_[zeroed_count_++] = physical_address::from_identity_mapped_ptr(ptr);
+        }
+        stats_.background_zeroed += count;
+        return count != 0;
+    }
+
     void free_physical(physical_address addr, uint64_t length) {
         physical_pages_.free(addr, length);
     }
 
+    // Free physical memory including the pool of zeroed pages
+    uint64_t free_bytes() const {
+        return physical_pages_.free_bytes() + zeroed_count_ * page_size;
+    }
+
     physical_address pml4() const {
         return mm_->pml4();
     }
 
     void* alloc(uint64_t size) {
-        return kernel_heap_.alloc(size);
+        return kernel_cache_->alloc(current_cpu(), size);
     }
 
     void free(void* ptr) {
-        return kernel_heap_.free(ptr);
+        return kernel_cache_->free(current_cpu(), ptr);
     }
 private:
+    // Single pages (mostly page tables) are taken from a pool of pages zeroed while the system is idle
+    static constexpr uint32_t zeroed_pool_size    = 64;
+    static constexpr uint64_t zeroed_pool_min_free = 4 << 20;
+
+    struct zeroing_stats {
+        uint64_t background_zeroed;
+        uint64_t pool_hits;
+        uint64_t sync_zeroed;
+        uint64_t zeroing_avoided;
+    };
+
     physical_address                                 saved_cr3_;
-    simple_heap                                      physical_pages_;
+    buddy_allocator                                  physical_pages_;
+    physical_address                                 zeroed_pages_[zeroed_pool_size];
+    uint32_t                                         zeroed_count_ = 0;
+    zeroing_stats                                    stats_ = {};
     physical_allocation                              kernel_heap_phys_;
-    default_heap                                     kernel_heap_;
     object_buffer<memory_manager_base>               mm_buffer_;
     owned_ptr<memory_manager_base, destruct_deleter> mm_;
+    object_buffer<default_heap>                      kernel_heap_buffer_;
+    owned_ptr<default_heap, destruct_deleter>        kernel_heap_;
+    object_buffer<magazine_cache>                    kernel_cache_buffer_;
+    owned_ptr<magazine_cache, destruct_deleter>      kernel_cache_;
 
     virtual void do_switch_to() override {
         return mm_->switch_to();
@@ -341,6 +898,41 @@ private:
     void do_unmap_memory(virtual_address virt, uint64_t length) {
         mm_->unmap_memory(virt, length);
     }
+
+    virtual virtual_address do_reserve_memory(virtual_address virt, uint64_t length, memory_type type) override {
+        REQUIRE(virt.pml4e() == kernel_pml4);
+        return mm_->reserve_memory(virt, length, type);
+    }
+
+    virtual void do_populate_page(virtual_address virt, memory_type type, physical_address phys) override {
+        mm_->populate_page(virt, type, phys);
+    }
+
+    virtual bool do_lookup_page(virtual_address virt, physical_address& phys) override {
+        return mm_->lookup_page(virt, phys);
+    }
+
+    virtual void do_begin_transaction() override {
+        mm_->begin_transaction();
+    }
+
+    virtual void do_commit_transaction() override {
+        mm_->commit_transaction();
+    }
+
+    virtual uint8_t* do_alloc_pages(uint64_t length) override {
+        auto phys = alloc_physical(length, physical_allocation_flags::no_zero);
+        const auto virt = mm_->map_memory(map_alloc_virt, phys.length(), memory_type_rw, phys.address());
+        phys.length_ = 0; // Owned by the mapping now, freed in do_free_pages
+        return virt.in_current_address_space();
+    }
+
+    virtual void do_free_pages(uint8_t* ptr, uint64_t length) override {
+        const auto phys = virt_to_phys(ptr);
+        mapping_transaction transaction{*mm_};
+        mm_->unmap_memory(virtual_address::in_current_address_space(ptr), length);
+        mm_->free_after_flush(phys, length);
+    }
 };
 object_buffer<kernel_memory_manager> mm_buffer;
 
@@ -460,8 +1052,17 @@ void iomem_unmap(volatile void* virt, uint64_t length)
     kernel_memory_manager::instance().unmap_memory(virtual_address::in_current_address_space(const_cast<void*>(virt)), length);
 }
 
-physical_allocation alloc_physical(uint64_t bytes) {
-    return kernel_memory_manager::instance().alloc_physical(bytes);
+physical_allocation alloc_physical(uint64_t bytes, physical_allocation_flags flags) {
+    return kernel_memory_manager::instance().alloc_physical(bytes, flags);
+}
+
+physical_address boot_pml4() {
+    return kernel_memory_manager::instance().boot_pml4();
+}
+
+bool mm_idle() {
+    constexpr uint32_t pages_per_call = 8; // Keep the time spent with interrupts pending short
+    return kernel_memory_manager::instance().refill_zeroed_pages(pages_per_call);
 }
 
 void free_physical_page(physical_address addr) { // Internal use only
@@ -469,15 +1070,25 @@ void free_physical_page(physical_address addr) { // Internal use only
     return kernel_memory_manager::instance().free_physical(addr, memory_manager::page_size);
 }
 
+void free_physical_range(physical_address addr, uint64_t length) { // Internal use only
+    REQUIRE(!(addr & (memory_manager::page_size-1)));
+    return kernel_memory_manager::instance().free_physical(addr, length);
+}
+
+// Lower half of the address space, minus the first MB
+constexpr virtual_address user_space_start{1<<20};
+constexpr virtual_address user_space_end{0x00008000'00000000};
+
 class default_memory_manager : public memory_manager_base {
 public:
-    explicit default_memory_manager() : memory_manager_base{virtual_address{1<<20}} {
+    explicit default_memory_manager() : memory_manager_base{user_space_start, static_cast<uint64_t>(user_space_end) - user_space_start} {
         // The mm is born with the current high mem (kernel) mapping
         static_cast<uint64_t*>(pml4())[kernel_pml4] = static_cast<const uint64_t*>(kernel_memory_manager::instance().pml4())[kernel_pml4];
     }
 
     ~default_memory_manager() {
-        REQUIRE(static_cast<uint64_t*>(pml4())[kernel_pml4] == static_cast<const uint64_t*>(kernel_memory_manager::instance().pml4())[kernel_pml4]);
+        // The kernel's copy of the entry also counts the entries in the PDPT, so only compare the table addresses
+        REQUIRE(table_entry(static_cast<uint64_t*>(pml4())[kernel_pml4]) == table_entry(static_cast<const uint64_t*>(kernel_memory_manager::instance().pml4())[kernel_pml4]));
         static_cast<uint64_t*>(pml4())[kernel_pml4] = 0;
     }
 
@@ -489,12 +1100,84 @@ private:
         }
         return memory_manager_base::do_map_memory(virt, length, type, phys);
     }
+
+    virtual virtual_address do_reserve_memory(virtual_address virt, uint64_t length, memory_type type) override {
+        if (virt != memory_manager::map_alloc_virt) {
+            REQUIRE(virt.pml4e() < 0x100);
+        }
+        return memory_manager_base::do_reserve_memory(virt, length, type);
+    }
 };
 
 kowned_ptr<memory_manager> create_default_memory_manager() {
     return kowned_ptr<memory_manager>{knew<default_memory_manager>().release()};
 }
 
+void flush_tlb(const virtual_address* pages, uint32_t count, bool all) {
+    if (all) {
+        __writecr3(__readcr3());
+    } else {
+        for (uint32_t i = 0; i < count; ++i) {
+            __invlpg(pages[i].in_current_address_space());
+        }
+    }
+    if (shootdown_handler) {
+        shootdown_handler(pages, count, all);
+    }
+}
+
+void set_tlb_shootdown_handler(tlb_shootdown_handler handler) {
+    shootdown_handler = handler;
+}
+
+page_mapping_stats mm_page_stats() {
+    return all_live_pages;
+}
+
+out_stream& operator<<(out_stream& os, const page_mapping_stats& stats) {
+    return os << "4K: " << stats.pages_4k << " 2M: " << stats.pages_2mb << " 1G: " << stats.pages_1gb;
+}
+
+void mm_test(int iterations) {
+    auto& kmm = kernel_memory_manager::instance();
+    auto user_mm = create_default_memory_manager();
+    auto phys = alloc_physical(memory_manager::page_size);
+
+    auto map_unmap = [&](int i) {
+        // Spread the user mappings so page tables at every level are created and freed
+        const auto user_virt = virtual_address{(static_cast<uint64_t>(1 + i % 255) << virtual_address::pml4_shift) | (static_cast<uint64_t>(i % 509) << virtual_address::pdp_shift) | (static_cast<uint64_t>(i % 503) << virtual_address::pd_shift)};
+        user_mm->map_memory(user_virt, memory_manager::page_size, memory_type_rw | memory_type::user, phys.address());
+        const auto kernel_virt = kmm.map_memory(memory_manager::map_alloc_virt, memory_manager::page_size, memory_type_rw, phys.address());
+        user_mm->unmap_memory(user_virt, memory_manager::page_size);
+        kmm.unmap_memory(kernel_virt, memory_manager::page_size);
+    };
+
+    map_unmap(0); // The first round allocates pages for the mapping records
+    const auto free_before = kmm.free_bytes();
+    log_mappings = false;
+    for (int i = 1; i < iterations; ++i) {
+        map_unmap(i);
+        REQUIRE(kmm.free_bytes() == free_before);
+    }
+    log_mappings = true;
+    dbgout() << "[mem] mm_test: " << iterations << " map/unmap iterations, " << (free_before >> 10) << " KB free before and after\n";
+
+    // Large pages are used where alignment and length allow it, small pages for the rest. The physical
+    // allocation is only page aligned, so map from the first 2MB boundary inside it.
+    auto big = alloc_physical(2 * page_size_2mb, physical_allocation_flags::no_zero);
+    const physical_address big_phys{round_up(static_cast<uint64_t>(big.address()), page_size_2mb)};
+    const uint64_t big_length = page_size_2mb + memory_manager::page_size;
+    REQUIRE(static_cast<uint64_t>(big_phys) + big_length <= static_cast<uint64_t>(big.address()) + big.length());
+    const auto before = mm_page_stats();
+    const auto big_virt = user_mm->map_memory(memory_manager::map_alloc_virt, big_length, memory_type_rw, big_phys);
+    const auto during = mm_page_stats();
+    REQUIRE(during.pages_2mb == before.pages_2mb + 1);
+    REQUIRE(during.pages_4k == before.pages_4k + 1);
+    user_mm->unmap_memory(big_virt, big_length);
+    const auto after = mm_page_stats();
+    REQUIRE(after.pages_2mb == before.pages_2mb && after.pages_4k == before.pages_4k);
+}
+
 void* kalloc(uint64_t size) {
     return kernel_memory_manager::instance().alloc(size);
 }
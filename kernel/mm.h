@@ -27,12 +27,64 @@ public:
         do_unmap_memory(virt, length);
     }
 
+    // Reserves address space for a mapping without backing it. Pages are supplied one at a time with
+    // populate_page, e.g. when they're first touched.
+    virtual_address reserve_memory(virtual_address virt, uint64_t length, memory_type type) {
+        return do_reserve_memory(virt, length, type);
+    }
+
+    // Maps (or replaces) the page at `virt' in a reserved range, `type' must be a subset of the reserved type
+    void populate_page(virtual_address virt, memory_type type, physical_address phys) {
+        do_populate_page(virt, type, phys);
+    }
+
+    // Returns true and the physical address backing `virt' if it's mapped
+    bool lookup_page(virtual_address virt, physical_address& phys) {
+        return do_lookup_page(virt, phys);
+    }
+
+    // Stale TLB entries left by changes made between begin_transaction() and commit_transaction() are invalidated
+    // together on commit. Outside a transaction each map_memory/unmap_memory call commits by itself.
+    void begin_transaction() {
+        do_begin_transaction();
+    }
+
+    void commit_transaction() {
+        do_commit_transaction();
+    }
+
 private:
     virtual virtual_address do_map_memory(virtual_address virt, uint64_t length, memory_type type, physical_address phys) = 0;
     virtual void do_unmap_memory(virtual_address virt, uint64_t length) = 0;
+    virtual virtual_address do_reserve_memory(virtual_address virt, uint64_t length, memory_type type) = 0;
+    virtual void do_populate_page(virtual_address virt, memory_type type, physical_address phys) = 0;
+    virtual bool do_lookup_page(virtual_address virt, physical_address& phys) = 0;
     virtual void do_switch_to() = 0;
+    virtual void do_begin_transaction() = 0;
+    virtual void do_commit_transaction() = 0;
 };
 
+class mapping_transaction {
+public:
+    explicit mapping_transaction(memory_manager& mm) : mm_(&mm) {
+        mm_->begin_transaction();
+    }
+    ~mapping_transaction() {
+        mm_->commit_transaction();
+    }
+    mapping_transaction(const mapping_transaction&) = delete;
+    mapping_transaction& operator=(const mapping_transaction&) = delete;
+
+private:
+    memory_manager* mm_;
+};
+
+// Invalidates TLB entries on the current CPU: `count' pages or everything if `all' is set. The shootdown handler
+// (if any) is then called to do the same on the other CPUs.
+void flush_tlb(const virtual_address* pages, uint32_t count, bool all);
+using tlb_shootdown_handler = void (*)(const virtual_address* pages, uint32_t count, bool all);
+void set_tlb_shootdown_handler(tlb_shootdown_handler handler);
+
 using memory_manager_ptr = owned_ptr<memory_manager, destruct_deleter>;
 
 memory_manager_ptr mm_init(physical_address base, uint64_t length);
@@ -48,6 +100,7 @@ memory_manager& kmemory_manager();
 
 class kernel_memory_manager;
 class memory_manager_base;
+template<typename> class fixed_size_object_heap;
 
 class physical_allocation {
 public:
@@ -70,13 +123,41 @@ private:
 
     friend kernel_memory_manager;
     friend memory_manager_base;
+    template<typename> friend class fixed_size_object_heap;
     physical_address addr_;
     uint64_t         length_;
 };
 
-physical_allocation alloc_physical(uint64_t bytes);
+enum class physical_allocation_flags : uint32_t {
+    none    = 0x0000,
+    no_zero = 0x0001, // The caller overwrites the memory, so don't bother zeroing it
+};
+ENUM_BIT_OPS(physical_allocation_flags, uint32_t)
+
+// The allocation is rounded up to whole pages. A power of two number of pages is naturally aligned, so e.g.
+// 2 MB allocations can back memory_type::ps_2mb mappings.
+physical_allocation alloc_physical(uint64_t bytes, physical_allocation_flags flags = physical_allocation_flags::none);
+
+// The page tables set up by the boot loader. They identity map the first 1 GB of physical memory (both at 0
+// and at the identity map) and map the kernel image.
+physical_address boot_pml4();
+
+// Background work for the idle loop (prepares zeroed pages). Returns true if any work was done.
+bool mm_idle();
 
 kowned_ptr<memory_manager> create_default_memory_manager();
 
+// Number of live page table entries mapping pages of each size in all address spaces
+struct page_mapping_stats {
+    uint64_t pages_4k;
+    uint64_t pages_2mb;
+    uint64_t pages_1gb;
+};
+page_mapping_stats mm_page_stats();
+out_stream& operator<<(out_stream& os, const page_mapping_stats& stats);
+
+// Maps and unmaps memory repeatedly, checking that no memory is leaked
+void mm_test(int iterations);
+
 } // namespace attos
 #endif
@@ -2,6 +2,7 @@
 #include <attos/out_stream.h>
 #include <attos/cpu.h>
 #include <attos/containers.h>
+#include "apic.h"
 
 namespace attos { namespace pci {
 
@@ -34,6 +35,14 @@ void write_config_dword(device_address addr, uint8_t reg, uint32_t value)
     __outdword(config_address_port, 0x8000'0000 | static_cast<uint32_t>(addr) | (reg << 2));
     __outdword(config_data_port, value);
 }
+constexpr uint32_t command_interrupt_disable = 0x0400;   // Disables INTx# (in the command register)
+constexpr uint16_t status_capabilities_list  = 0x0010;
+
+constexpr uint8_t  capability_id_msi          = 0x05;
+constexpr uint16_t msi_control_enable         = 0x0001;
+constexpr uint16_t msi_control_multiple_mask  = 0x0070; // Multiple message enable
+constexpr uint16_t msi_control_64bit          = 0x0080;
+
 constexpr uint8_t header_type_device_mask         = 0x03; // 0x00 = general device, 0x01 = PCI-to-PCI bridge, 0x02 = CardBus bridge
 constexpr uint8_t header_type_multi_function_mask = 0x80;
 
@@ -252,6 +261,64 @@ private:
     }
 };
 
+// Returns the config area offset of the capability with id `cap_id' or 0 if the device doesn't have it
+uint8_t find_capability(const device_info& dev, uint8_t cap_id)
+{
+    if (!(dev.config.status & status_capabilities_list)) {
+        return 0;
+    }
+    const auto config = reinterpret_cast<const uint8_t*>(&dev.config);
+    auto offset = static_cast<uint8_t>(dev.config.header0.caps & ~3);
+    for (int count = 0; offset && count < config_area_num_dwords; ++count) { // Don't get stuck in a broken list
+        if (config[offset] == cap_id) {
+            return offset;
+        }
+        offset = static_cast<uint8_t>(config[offset + 1] & ~3);
+    }
+    return 0;
+}
+
+class msi_registration_impl : public isr_registration {
+public:
+    explicit msi_registration_impl(const device_info& dev, uint8_t cap_offset, irq_handler_t handler) : addr_(dev.address), cap_(cap_offset / 4), handler_(handler) {
+        const auto vector = find_free_vector();
+        vector_reg_ = register_vector_handler(vector, [this]() { handler_(); apic::eoi(); });
+
+        const auto control = static_cast<uint16_t>(read_config_dword(addr_, cap_) >> 16);
+        const auto address = apic::msi_address(apic::local_id());
+        const auto data    = apic::msi_data(vector);
+        write_config_dword(addr_, cap_ + 1, static_cast<uint32_t>(address));
+        if (control & msi_control_64bit) {
+            write_config_dword(addr_, cap_ + 2, static_cast<uint32_t>(address >> 32));
+            write_config_dword(addr_, cap_ + 3, data);
+        } else {
+            write_config_dword(addr_, cap_ + 2, data);
+        }
+        write_config_dword(addr_, 1, read_config_dword(addr_, 1) | command_interrupt_disable);
+        set_control((control & ~msi_control_multiple_mask) | msi_control_enable);
+        dbgout() << "[pci] " << addr_ << " using MSI vector " << as_hex(vector) << "\n";
+    }
+
+    ~msi_registration_impl() {
+        set_control(static_cast<uint16_t>(read_config_dword(addr_, cap_) >> 16) & ~msi_control_enable);
+        write_config_dword(addr_, 1, read_config_dword(addr_, 1) & ~command_interrupt_disable);
+    }
+
+    msi_registration_impl(const msi_registration_impl&) = delete;
+    msi_registration_impl& operator=(const msi_registration_impl&) = delete;
+
+private:
+    device_address       addr_;
+    uint8_t              cap_; // Dword index of the MSI capability
+    irq_handler_t        handler_;
+    isr_registration_ptr vector_reg_;
+
+    void set_control(uint16_t control) {
+        const auto dw = read_config_dword(addr_, cap_);
+        write_config_dword(addr_, cap_, (dw & 0xFFFF) | (static_cast<uint32_t>(control) << 16));
+    }
+};
+
 object_buffer<manager_impl> manager_buffer;
 
 owned_ptr<manager, destruct_deleter> init() {
@@ -263,4 +330,16 @@ void bus_master(device_address addr, bool enabled)
     manager_impl::instance().bus_master(addr, enabled);
 }
 
+isr_registration_ptr register_msi_handler(const device_info& dev, irq_handler_t handler)
+{
+    if (!apic::available()) {
+        return isr_registration_ptr{};
+    }
+    const auto cap_offset = find_capability(dev, capability_id_msi);
+    if (!cap_offset) {
+        return isr_registration_ptr{};
+    }
+    return isr_registration_ptr{knew<msi_registration_impl>(dev, cap_offset, handler).release()};
+}
+
 } } // namespace attos::pci
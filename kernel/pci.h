@@ -4,6 +4,7 @@
 #include <attos/mem.h>
 #include <attos/array_view.h>
 #include <array>
+#include "isr.h"
 
 namespace attos {
 class out_stream;
@@ -146,6 +147,10 @@ owned_ptr<manager, destruct_deleter> init();
 
 void bus_master(device_address addr, bool enabled);
 
+// Switches the device to message signaled interrupts delivered to a free vector on the boot processor. Returns
+// null if the device doesn't support MSI or the local APIC isn't in use. `handler' doesn't need to signal EOI.
+isr_registration_ptr register_msi_handler(const device_info& dev, irq_handler_t handler);
+
 } }  // namespace attos::pci
 
 #endif
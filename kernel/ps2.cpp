@@ -157,6 +157,11 @@ public:
         return std::any_of(buffer_.begin(), buffer_.end(), [](uint8_t c) { return c > 0x80 && c < 0xE0; });
     }
 
+    void set_key_notify(function<void ()> notify) {
+        interrupt_disabler id{};
+        notify_ = notify;
+    }
+
     uint8_t read_key() {
         REQUIRE(__readeflags() & rflag_mask_if);
         // Very crude translation of scan keys in Scan Code Set 1
@@ -193,6 +198,7 @@ private:
 
     isr_registration_ptr reg_;
     fixed_size_queue<uint8_t, 32> buffer_;
+    function<void ()> notify_;
 
     bool buffer_empty() {
         interrupt_disabler id{};
@@ -217,6 +223,9 @@ private:
         } else {
             dbgout() << "[ps2] Keyboard buffer is full!!\n";
         }
+        if (notify_) {
+            notify_();
+        }
     }
 };
 
@@ -248,4 +257,8 @@ uint8_t read_key() {
     }
 }
 
+void set_key_notify(function<void ()> notify) {
+    controller_impl::instance().set_key_notify(notify);
+}
+
 } } // namespace attos::ps2
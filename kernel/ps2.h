@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <attos/mem.h>
+#include <attos/function.h>
 
 namespace attos { namespace ps2 {
 
@@ -16,6 +17,9 @@ owned_ptr<controller, destruct_deleter> init();
 bool    key_available();
 uint8_t read_key();
 
+// `notify' is called from the keyboard interrupt handler whenever a scan code has been received
+void set_key_notify(function<void ()> notify);
+
 } } // namespace attos::ps2
 
 #endif
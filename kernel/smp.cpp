@@ -0,0 +1,211 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu_manager.h"
+#include "isr.h"
+#include "mm.h"
+#include "timer.h"
+#include <attos/out_stream.h>
+
+// smp_trampoline.asm
+extern "C" const uint8_t smp_trampoline_start[];
+extern "C" const uint8_t smp_trampoline_long_mode[];
+extern "C" const uint8_t smp_trampoline_params[];
+extern "C" const uint8_t smp_trampoline_end[];
+extern "C" void smp_ap_entry();
+extern "C" void smp_ap_main(attos::cpu_data& data);
+
+namespace attos { namespace smp {
+
+#pragma pack(push, 1)
+// Must match the structure in smp_trampoline.asm
+struct trampoline_params {
+    uint64_t gdt[3];
+    uint16_t gdt_limit;
+    uint32_t gdt_base;
+    uint32_t long_mode_entry;
+    uint16_t long_mode_cs;
+    uint32_t cr0;
+    uint32_t cr3;
+    uint32_t cr4;
+    uint64_t kernel_cr3;
+    uint64_t stack_top;
+    uint64_t entry;
+    uint64_t data;
+};
+#pragma pack(pop)
+
+// Conventional memory below the boot stack (which grows down from 0x7C00). Only used while a processor starts.
+constexpr uint32_t trampoline_page = 0x1000;
+
+constexpr uint32_t ap_stack_size = 16 << 10;
+
+constexpr uint8_t tlb_shootdown_vector = 0xF0;
+
+struct ap_stack {
+    uint8_t data[ap_stack_size];
+};
+
+class controller_impl : public controller, public singleton<controller_impl> {
+public:
+    explicit controller_impl(cpu_manager& cpu, array_view<uint8_t> apic_ids) : cpu_(cpu) {
+        shootdown_reg_ = register_vector_handler(tlb_shootdown_vector, [this]() { on_tlb_shootdown(); });
+        this_cpu().apic_id = apic::local_id();
+        set_tlb_shootdown_handler(&tlb_shootdown);
+
+        for (const auto id : apic_ids) {
+            if (id == this_cpu().apic_id) {
+                continue;
+            }
+            if (!start_processor(id)) {
+                // The processor might still start later using the trampoline, so don't reuse it
+                dbgout() << "[smp] Processor with APIC id " << as_hex(id) << " didn't start\n";
+                break;
+            }
+        }
+        dbgout() << "[smp] " << cpu_count() << " processor(s) online\n";
+    }
+
+    ~controller_impl() {
+        set_tlb_shootdown_handler(nullptr);
+        // Put the application processors back into the wait-for-SIPI state before freeing their stacks
+        for (uint32_t i = 0; i < ap_count_; ++i) {
+            apic::send_ipi(ap_ids_[i], apic::icr_delivery_init | apic::icr_level_assert);
+        }
+        ap_count_ = 0;
+        stacks_.clear();
+        cpu_.remove_processors();
+        shootdown_reg_.reset();
+    }
+
+    uint32_t cpu_count() const {
+        return 1 + ap_count_;
+    }
+
+    // Runs on the application processor (on its own stack) once it has loaded its GDT, TSS and IDT
+    __declspec(noreturn) void ap_main() {
+        apic::enable_local();
+        REQUIRE(apic::local_id() == this_cpu().apic_id);
+        _InterlockedIncrement(&started_);
+        _enable();
+        for (;;) {
+            __halt();
+        }
+    }
+
+private:
+    cpu_manager&          cpu_;
+    isr_registration_ptr  shootdown_reg_;
+    kvector<kowned_ptr<ap_stack>> stacks_;
+    uint32_t              ap_ids_[max_cpus];
+    uint32_t              ap_count_ = 0;
+    volatile long         started_ = 0;
+
+    // Current TLB shootdown request
+    const virtual_address* shootdown_pages_ = nullptr;
+    uint32_t              shootdown_count_ = 0;
+    bool                  shootdown_all_ = false;
+    volatile long         shootdown_pending_ = 0;
+
+    bool start_processor(uint32_t apic_id) {
+        auto& data = cpu_.add_processor(apic_id);
+        stacks_.push_back(knew<ap_stack>());
+        const auto& stack = *stacks_.back();
+
+        const auto trampoline_size = static_cast<uint32_t>(smp_trampoline_end - smp_trampoline_start);
+        const auto params_offset   = static_cast<uint32_t>(smp_trampoline_params - smp_trampoline_start);
+        REQUIRE(trampoline_size <= memory_manager::page_size);
+        uint8_t* const trampoline = physical_address{trampoline_page};
+        memcpy(trampoline, smp_trampoline_start, trampoline_size);
+
+        const auto boot_cr3 = static_cast<uint64_t>(boot_pml4());
+        REQUIRE(boot_cr3 < (1ULL << 32));
+
+        auto& params = *reinterpret_cast<trampoline_params*>(trampoline + params_offset);
+        params.gdt[0]          = 0;
+        params.gdt[1]          = 0x00209A0000000000; // 0x08 64-bit code
+        params.gdt[2]          = 0x0000920000000000; // 0x10 data
+        params.gdt_limit       = static_cast<uint16_t>(sizeof(params.gdt) - 1);
+        params.gdt_base        = trampoline_page + params_offset + static_cast<uint32_t>(offsetof(trampoline_params, gdt));
+        params.long_mode_entry = trampoline_page + static_cast<uint32_t>(smp_trampoline_long_mode - smp_trampoline_start);
+        params.long_mode_cs    = kernel_cs;
+        params.cr0             = static_cast<uint32_t>(__readcr0());
+        params.cr3             = static_cast<uint32_t>(boot_cr3);
+        params.cr4             = static_cast<uint32_t>(__readcr4());
+        params.kernel_cr3      = __readcr3();
+        params.stack_top       = static_cast<uint64_t>(virtual_address::in_current_address_space(stack.data + sizeof(stack.data))) & ~15ULL;
+        params.entry           = reinterpret_cast<uint64_t>(&smp_ap_entry);
+        params.data            = static_cast<uint64_t>(virtual_address::in_current_address_space(&data));
+
+        const long expected = started_ + 1;
+
+        // Intel MP specification: INIT, wait 10ms, STARTUP, wait 200us and STARTUP again if the processor hasn't started
+        apic::send_ipi(apic_id, apic::icr_delivery_init | apic::icr_level_assert);
+        timer::delay_microseconds(10000);
+        for (int attempt = 0; attempt < 2 && started_ != expected; ++attempt) {
+            apic::send_ipi(apic_id, apic::icr_delivery_startup | apic::icr_level_assert | (trampoline_page >> 12));
+            timer::delay_microseconds(200);
+        }
+        for (uint32_t waited = 0; started_ != expected && waited < 1000000; waited += 100) {
+            timer::delay_microseconds(100);
+        }
+        if (started_ != expected) {
+            return false;
+        }
+        ap_ids_[ap_count_++] = apic_id;
+        dbgout() << "[smp] Started processor " << data.index << " APIC id " << as_hex(apic_id) << "\n";
+        return true;
+    }
+
+    static void tlb_shootdown(const virtual_address* pages, uint32_t count, bool all) {
+        instance().do_tlb_shootdown(pages, count, all);
+    }
+
+    void do_tlb_shootdown(const virtual_address* pages, uint32_t count, bool all) {
+        if (!ap_count_) {
+            return;
+        }
+        REQUIRE(current_cpu() == 0); // Only the boot processor changes mappings
+        shootdown_pages_   = pages;
+        shootdown_count_   = count;
+        shootdown_all_     = all;
+        shootdown_pending_ = ap_count_;
+        for (uint32_t i = 0; i < ap_count_; ++i) {
+            apic::send_ipi(ap_ids_[i], tlb_shootdown_vector);
+        }
+        while (shootdown_pending_) {
+            _mm_pause();
+        }
+    }
+
+    void on_tlb_shootdown() {
+        if (shootdown_all_) {
+            __writecr3(__readcr3());
+        } else {
+            for (uint32_t i = 0; i < shootdown_count_; ++i) {
+                __invlpg(shootdown_pages_[i].in_current_address_space());
+            }
+        }
+        _InterlockedDecrement(&shootdown_pending_);
+        apic::eoi();
+    }
+};
+
+object_buffer<controller_impl> controller_buffer;
+
+owned_ptr<controller, destruct_deleter> init(cpu_manager& cpu, array_view<uint8_t> apic_ids) {
+    REQUIRE(apic::available());
+    return owned_ptr<controller, destruct_deleter>{controller_buffer.construct(cpu, apic_ids).release()};
+}
+
+uint32_t cpu_count() {
+    return controller_impl::has_instance() ? controller_impl::instance().cpu_count() : 1;
+}
+
+} } // namespace attos::smp
+
+void smp_ap_main(attos::cpu_data& data)
+{
+    attos::cpu_ap_init(data);
+    attos::isr_ap_init();
+    attos::smp::controller_impl::instance().ap_main();
+}
@@ -0,0 +1,28 @@
+#ifndef ATTOS_SMP_H
+#define ATTOS_SMP_H
+
+#include <attos/mem.h>
+#include <attos/array_view.h>
+
+namespace attos {
+class cpu_manager;
+} // namespace attos
+
+namespace attos { namespace smp {
+
+class __declspec(novtable) controller {
+public:
+    virtual ~controller() = 0 {}
+};
+
+// Starts the application processors with the local APIC ids in `apic_ids' (the boot processor is skipped) using
+// INIT-SIPI-SIPI. They halt with interrupts enabled and only handle TLB shootdown requests for now.
+// The local APIC must have been initialized with apic::init().
+owned_ptr<controller, destruct_deleter> init(cpu_manager& cpu, array_view<uint8_t> apic_ids);
+
+// Number of processors running the kernel (including the boot processor)
+uint32_t cpu_count();
+
+} } // namespace attos::smp
+
+#endif
@@ -0,0 +1,93 @@
+    bits 64
+    default rel
+
+    section .text
+
+%include "kernel.inc"
+
+    global smp_trampoline_start
+    global smp_trampoline_long_mode
+    global smp_trampoline_params
+    global smp_trampoline_end
+    global smp_ap_entry
+
+    extern smp_ap_main ; void smp_ap_main(cpu_data&)
+
+; Must match trampoline_params in smp.cpp
+struc smp_params
+    .gdt             resq 3
+    .gdt_limit       resw 1
+    .gdt_base        resd 1
+    .long_mode_entry resd 1
+    .long_mode_cs    resw 1
+    .cr0             resd 1
+    .cr3             resd 1 ; Boot page tables (identity maps the trampoline)
+    .cr4             resd 1
+    .kernel_cr3      resq 1
+    .stack_top       resq 1
+    .entry           resq 1
+    .data            resq 1
+endstruc
+
+%define TRAMPOLINE_OFFSET(x) ((x) - smp_trampoline_start)
+%define PARAM(x) TRAMPOLINE_OFFSET(smp_trampoline_params) + smp_params.%+x
+
+; Copied to a page below 1MB and started in real mode at page:0000 by the STARTUP IPI. Switches directly to
+; long mode and jumps to smp_ap_entry (in the kernel image) with rcx = cpu_data&, rdx = kernel CR3 and
+; rsp = the stack of the processor.
+    bits 16
+    align 16
+smp_trampoline_start:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+
+    ; Use the CR4 features of the boot processor (PAE, FXSR etc.)
+    mov eax, [PARAM(cr4)]
+    mov cr4, eax
+    mov eax, [PARAM(cr3)]
+    mov cr3, eax
+
+    ; Enable long mode and NX (the kernel page tables use it)
+    mov ecx, 0xC0000080 ; EFER
+    rdmsr
+    or eax, (1<<8) | (1<<11) ; LME | NXE
+    wrmsr
+
+    o32 lgdt [PARAM(gdt_limit)]
+
+    ; Enable protection and paging at once
+    mov eax, [PARAM(cr0)]
+    mov cr0, eax
+
+    o32 jmp far [PARAM(long_mode_entry)]
+
+    bits 64
+smp_trampoline_long_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor eax, eax
+    mov fs, ax
+    mov gs, ax
+
+    mov rcx, [rel smp_trampoline_params + smp_params.data]
+    mov rdx, [rel smp_trampoline_params + smp_params.kernel_cr3]
+    mov rsp, [rel smp_trampoline_params + smp_params.stack_top]
+    mov rax, [rel smp_trampoline_params + smp_params.entry]
+    jmp rax
+
+    align 16
+smp_trampoline_params:
+    times smp_params_size db 0
+smp_trampoline_end:
+
+; Jumped to from the trampoline while running on the boot page tables
+    align 16
+smp_ap_entry:
+    mov cr3, rdx
+    sub rsp, 0x20 ; shadow space
+    call smp_ap_main
+    ud2
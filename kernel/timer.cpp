@@ -0,0 +1,291 @@
+#include "timer.h"
+#include "isr.h"
+#include "apic.h"
+#include <attos/cpu.h>
+#include <attos/out_stream.h>
+
+namespace attos { namespace timer {
+
+constexpr uint8_t  pit_irq            = 0;
+constexpr uint64_t pit_frequency      = 1193182;
+constexpr uint64_t pit_divisor        = 65536; // The PIT is left at its default rate of about 18.2 Hz
+constexpr uint16_t pit_channel0_port  = 0x40;
+constexpr uint16_t pit_command_port   = 0x43;
+constexpr uint8_t  pit_latch_channel0 = 0x00; // Counter latch command
+
+constexpr uint8_t  apic_timer_vector = 0xE0; // Above device interrupts
+
+constexpr uint32_t max_armed_events  = 256;
+
+// Converts `count' ticks of a `hz' clock to nanoseconds without overflowing
+constexpr uint64_t ticks_to_ns(uint64_t count, uint64_t hz) {
+    return count / hz * ns_per_s + count % hz * ns_per_s / hz;
+}
+
+constexpr uint64_t ns_to_ticks(uint64_t ns, uint64_t hz) {
+    return ns / ns_per_s * hz + ns % ns_per_s * hz / ns_per_s;
+}
+
+// The TSC is only usable as a clock if its rate doesn't change with power states. Hypervisors don't always report
+// an invariant TSC, but generally provide one that runs at a constant rate.
+bool cpu_has_constant_tsc() {
+    int regs[4];
+    __cpuid(regs, 1);
+    if (!((regs[3] >> 4) & 1)) { // EDX.TSC
+        return false;
+    }
+    if ((regs[2] >> 31) & 1) { // ECX.Hypervisor
+        return true;
+    }
+    __cpuid(regs, 0x80000000);
+    if (static_cast<uint32_t>(regs[0]) < 0x80000007) {
+        return false;
+    }
+    __cpuid(regs, 0x80000007);
+    return (regs[3] >> 8) & 1; // EDX.InvariantTSC
+}
+
+class controller_impl : public controller, public singleton<controller_impl> {
+public:
+    explicit controller_impl() : wakeup_([]() {}) {
+        pit_reg_ = register_irq_handler(pit_irq, [this]() { on_pit_tick(); });
+        calibrate();
+        if (apic::available()) {
+            apic_reg_ = register_vector_handler(apic_timer_vector, [this]() { on_timer_interrupt(); apic::eoi(); });
+            if (use_tsc_) {
+                pit_reg_.reset(); // Not needed as a clock either
+            }
+        }
+        dbgout() << "[timer] Clock: " << (use_tsc_ ? "TSC" : "PIT") << " Interrupts: " << (apic_reg_ ? "local APIC (one-shot)" : "PIT (periodic)") << "\n";
+    }
+
+    ~controller_impl() {
+        cancel(wakeup_);
+        REQUIRE(!armed_count_);
+        if (apic_reg_) {
+            apic::timer_stop();
+            apic_reg_.reset();
+        }
+        pit_reg_.reset();
+        dbgout() << "[timer] " << interrupts_ << " timer interrupts in " << now() / ns_per_ms << " ms\n";
+    }
+
+    uint64_t now() {
+        if (use_tsc_) {
+            return ticks_to_ns(__rdtsc() - tsc_base_, tsc_hz_);
+        }
+        return pit_now();
+    }
+
+    void arm(event& e, uint64_t deadline_ns) {
+        interrupt_disabler disabler{};
+        if (e.armed()) {
+            remove(e);
+        }
+        REQUIRE(armed_count_ < max_armed_events);
+        e.deadline_ns_ = deadline_ns;
+        e.heap_index_  = armed_count_;
+        heap_[armed_count_++] = &e;
+        sift_up(e.heap_index_);
+        if (heap_[0] == &e) {
+            program_next();
+        }
+    }
+
+    void cancel(event& e) {
+        interrupt_disabler disabler{};
+        if (e.armed()) {
+            // The interrupt isn't reprogrammed, it just finds nothing to do if this was the first event
+            remove(e);
+        }
+    }
+
+    void ensure_wakeup(uint64_t ns) {
+        const auto deadline_ns = now() + ns;
+        if (!wakeup_.armed() || wakeup_.deadline_ns() > deadline_ns) {
+            arm(wakeup_, deadline_ns);
+        }
+    }
+
+private:
+    bool                 use_tsc_ = cpu_has_constant_tsc();
+    uint64_t             tsc_hz_ = 0;
+    uint64_t             tsc_base_ = 0;
+    uint64_t             apic_timer_hz_ = 0;
+    volatile uint64_t    pit_ticks_ = 0;
+    uint64_t             last_pit_ns_ = 0;
+    uint64_t             interrupts_ = 0;
+    isr_registration_ptr pit_reg_;
+    isr_registration_ptr apic_reg_;
+    event                wakeup_;
+    event*               heap_[max_armed_events]; // Min-heap ordered by deadline
+    uint32_t             armed_count_ = 0;
+
+    void on_pit_tick() {
+        ++pit_ticks_;
+        if (!apic_reg_) {
+            on_timer_interrupt();
+        }
+    }
+
+    void on_timer_interrupt() {
+        ++interrupts_;
+        ++*static_cast<uint8_t*>(physical_address{0xb8000});
+        const auto t = now();
+        while (armed_count_ && heap_[0]->deadline_ns_ <= t) {
+            auto& e = *heap_[0];
+            remove(e);
+            e.callback_(); // May arm the event again
+        }
+        program_next();
+    }
+
+    // The PIT counts down from pit_divisor once per tick. Not safe across processors.
+    uint64_t pit_now() {
+        interrupt_disabler disabler{};
+        __outbyte(pit_command_port, pit_latch_channel0);
+        const uint32_t low  = __inbyte(pit_channel0_port);
+        const uint32_t high = __inbyte(pit_channel0_port);
+        const uint32_t latched = low | (high << 8);
+        const uint64_t count = latched ? latched : pit_divisor; // 0 means 65536
+        const auto ns = ticks_to_ns(pit_ticks_ * pit_divisor + (pit_divisor - count), pit_frequency);
+        // The counter may have wrapped before the tick was counted
+        last_pit_ns_ = std::max(last_pit_ns_, ns);
+        return last_pit_ns_;
+    }
+
+    void wait_pit_ticks(uint64_t count) {
+        for (const uint64_t start = pit_ticks_; pit_ticks_ - start < count;) {
+            __halt();
+        }
+    }
+
+    // Measures the TSC and the local APIC timer against the PIT
+    void calibrate() {
+        constexpr uint64_t calibration_ticks = 4; // About 220 ms
+        const bool measure_apic = apic::available();
+        wait_pit_ticks(1); // Start right after a tick
+        if (measure_apic) {
+            apic::timer_start(apic_timer_vector, UINT32_MAX, apic::timer_mode::one_shot); // Won't expire during calibration
+        }
+        const auto tsc_start = __rdtsc();
+        wait_pit_ticks(calibration_ticks);
+        const auto tsc_elapsed = __rdtsc() - tsc_start;
+        if (measure_apic) {
+            const uint64_t apic_elapsed = UINT32_MAX - apic::timer_current_count();
+            apic::timer_stop();
+            apic_timer_hz_ = apic_elapsed * pit_frequency / (pit_divisor * calibration_ticks);
+            REQUIRE(apic_timer_hz_ != 0);
+            dbgout() << "[timer] Local APIC timer " << apic_timer_hz_ / 1000 << " kHz\n";
+        }
+        tsc_hz_ = tsc_elapsed * pit_frequency / (pit_divisor * calibration_ticks);
+        tsc_base_ = tsc_start;
+        dbgout() << "[timer] TSC " << tsc_hz_ / 1000000 << " MHz\n";
+    }
+
+    // Programs the local APIC timer to interrupt at the first deadline (the PIT is checked every tick otherwise)
+    void program_next() {
+        if (!apic_reg_) {
+            return;
+        }
+        if (!armed_count_) {
+            apic::timer_stop();
+            return;
+        }
+        const auto t = now();
+        const auto first = heap_[0]->deadline_ns_;
+        const auto count = ns_to_ticks(first > t ? first - t : 0, apic_timer_hz_);
+        apic::timer_start(apic_timer_vector, static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(count, 1), UINT32_MAX)), apic::timer_mode::one_shot);
+    }
+
+    bool before(uint32_t a, uint32_t b) const {
+        return heap_[a]->deadline_ns_ < heap_[b]->deadline_ns_;
+    }
+
+    void swap_entries(uint32_t a, uint32_t b) {
+        std::swap(heap_[a], heap_[b]);
+        heap_[a]->heap_index_ = a;
+        heap_[b]->heap_index_ = b;
+    }
+
+    void sift_up(uint32_t i) {
+        while (i && before(i, (i - 1) / 2)) {
+            swap_entries(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    void sift_down(uint32_t i) {
+        for (;;) {
+            uint32_t smallest = i;
+            const uint32_t left = 2 * i + 1, right = 2 * i + 2;
+            if (left < armed_count_ && before(left, smallest)) {
+                smallest = left;
+            }
+            if (right < armed_count_ && before(right, smallest)) {
+                smallest = right;
+            }
+            if (smallest == i) {
+                return;
+            }
+            swap_entries(i, smallest);
+            i = smallest;
+        }
+    }
+
+    void remove(event& e) {
+        const auto i = e.heap_index_;
+        REQUIRE(i < armed_count_ && heap_[i] == &e);
+        e.heap_index_ = event::not_armed;
+        if (i != --armed_count_) {
+            // Move the last entry into the hole and restore the heap order around it
+            auto& moved = *heap_[armed_count_];
+            heap_[i] = &moved;
+            moved.heap_index_ = i;
+            sift_up(i);
+            sift_down(moved.heap_index_);
+        }
+    }
+};
+
+object_buffer<controller_impl> controller_buffer;
+
+owned_ptr<controller, destruct_deleter> init() {
+    return owned_ptr<controller, destruct_deleter>{controller_buffer.construct().release()};
+}
+
+event::~event() {
+    if (armed()) {
+        controller_impl::instance().cancel(*this);
+    }
+}
+
+void arm(event& e, uint64_t deadline_ns) {
+    controller_impl::instance().arm(e, deadline_ns);
+}
+
+void cancel(event& e) {
+    controller_impl::instance().cancel(e);
+}
+
+void ensure_wakeup(uint64_t ns) {
+    if (controller_impl::has_instance()) {
+        controller_impl::instance().ensure_wakeup(ns);
+    }
+}
+
+void delay_microseconds(uint32_t count) {
+    auto& c = controller_impl::instance();
+    const auto end = c.now() + count * ns_per_us;
+    while (c.now() < end) {
+        _mm_pause();
+    }
+}
+
+} // namespace timer
+
+uint64_t monotonic_ns() {
+    return timer::controller_impl::has_instance() ? timer::controller_impl::instance().now() : 0;
+}
+
+} // namespace attos
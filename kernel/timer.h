@@ -0,0 +1,61 @@
+#ifndef ATTOS_TIMER_H
+#define ATTOS_TIMER_H
+
+#include <attos/mem.h>
+#include <attos/clock.h>
+#include <attos/function.h>
+
+namespace attos { namespace timer {
+
+class __declspec(novtable) controller {
+public:
+    virtual ~controller() = 0 {}
+};
+
+// Calibrates the clock (the TSC if it runs at a constant rate, otherwise the PIT) and starts handling timer
+// interrupts. With a local APIC (apic::init) the next interrupt is programmed for the earliest deadline, so there
+// are no periodic ticks.
+owned_ptr<controller, destruct_deleter> init();
+
+class controller_impl;
+
+// The callback runs from the timer interrupt handler (with interrupts disabled) once the deadline has passed
+class event {
+public:
+    explicit event(function<void ()> callback) : callback_(callback) {
+    }
+    ~event();
+    event(const event&) = delete;
+    event& operator=(const event&) = delete;
+
+    bool armed() const {
+        return heap_index_ != not_armed;
+    }
+
+    uint64_t deadline_ns() const {
+        return deadline_ns_;
+    }
+
+private:
+    static constexpr uint32_t not_armed = UINT32_MAX;
+
+    function<void ()> callback_;
+    uint64_t          deadline_ns_ = 0;
+    uint32_t          heap_index_ = not_armed;
+
+    friend controller_impl;
+};
+
+// (Re)arms `e' to expire at `deadline_ns' (in monotonic_ns time)
+void arm(event& e, uint64_t deadline_ns);
+void cancel(event& e);
+
+// Makes sure a timer interrupt arrives within `ns', e.g. before halting in a polling loop
+void ensure_wakeup(uint64_t ns);
+
+// Busy waits using the clock
+void delay_microseconds(uint32_t count);
+
+} } // namespace attos::timer
+
+#endif